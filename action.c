@@ -15,14 +15,19 @@
 #include "chewie.h"
 #include "action.h"
 #include "api.h"
+#include "batch.h"
 #include "configure.h"
 #include "context.h"
 #include "file.h"
 #include "function.h"
 #include "input.h"
 #include "setting.h"
+#include "summary.h"
 
+static action_result_t batch(json_object *settings, json_object *data);
 static action_result_t dump_query_history(json_object *settings, json_object *data);
+static action_result_t export_context(json_object *settings, json_object *data);
+static action_result_t fork_context(json_object *settings, json_object *data);
 static action_result_t get_embeddings(json_object *settings, json_object *data);
 static action_result_t list_apis(json_object *settings, json_object *data);
 static action_result_t list_models(json_object *settings, json_object *data);
@@ -32,6 +37,7 @@ static action_result_t show_help(json_object *settings, json_object *data);
 static action_result_t show_version(json_object *settings, json_object *data);
 static action_result_t reset_context(json_object *settings, json_object *data);
 static action_result_t update_context(json_object *settings, json_object *data);
+static const action_t *first_action(json_object *actions);
 
 static action_t action_version = {
     .name = ACTION_KEY_VERSION,
@@ -48,30 +54,48 @@ static action_t action_list_apis = {
 static action_t action_list_models = {
     .name = ACTION_KEY_LIST_MODELS,
     .callback = list_models,
+    .request = true
 };
 static action_t action_load_function_file = {
     .name = ACTION_KEY_LOAD_FUNCTION_FILE,
     .callback = load_function_file,
+    .continues = true
 };
 static action_t action_query = {
     .name = ACTION_KEY_QUERY,
     .callback = query,
+    .request = true
 };
 static action_t action_reset_context = {
     .name = ACTION_KEY_RESET_CONTEXT,
     .callback = reset_context,
+    .continues = true
 };
 static action_t action_dump_query_history = {
     .name = ACTION_KEY_DUMP_QUERY_HISTORY,
     .callback = dump_query_history
 };
+static action_t action_export_context = {
+    .name = ACTION_KEY_EXPORT_CONTEXT,
+    .callback = export_context
+};
+static action_t action_fork_context = {
+    .name = ACTION_KEY_FORK_CONTEXT,
+    .callback = fork_context
+};
 static action_t action_update_context = {
     .name = ACTION_KEY_UPDATE_CONTEXT,
     .callback = update_context
 };
 static action_t action_get_embeddings = {
     .name = ACTION_KEY_GET_EMBEDDINGS,
-    .callback = get_embeddings
+    .callback = get_embeddings,
+    .request = true
+};
+static action_t action_batch = {
+    .name = ACTION_KEY_BATCH,
+    .callback = batch,
+    .request = true
 };
 static action_t *action_templates[] = {
     &action_version,
@@ -81,8 +105,11 @@ static action_t *action_templates[] = {
     &action_load_function_file,
     &action_reset_context,
     &action_dump_query_history,
+    &action_export_context,
+    &action_fork_context,
     &action_update_context,
     &action_get_embeddings,
+    &action_batch,
     &action_query,
     NULL
 };
@@ -90,6 +117,25 @@ static action_t **merged_actions = action_templates;
 
 static action_t **action_merge(action_t **actions1, action_t **actions2);
 
+bool action_reads_input(json_object *actions, json_object *settings) {
+    debug_enter();
+    const action_t *action = first_action(actions);
+    bool prompt = json_object_object_get_ex(settings, SETTING_KEY_PROMPT, NULL);
+    if (action == &action_get_embeddings) {
+        debug_return !prompt;
+    }
+    if (action == &action_query) {
+        debug_return !prompt && !json_object_object_get_ex(settings, SETTING_KEY_PIPE, NULL);
+    }
+    debug_return false;
+}
+
+bool action_sends_request(json_object *actions) {
+    debug_enter();
+    const action_t *action = first_action(actions);
+    debug_return action != NULL && action->request;
+}
+
 action_result_t action_execute_all(json_object *actions, json_object *settings) {
     debug_enter();
     debug("actions: %s\n", json_object_to_json_string_ext(actions, JSON_C_TO_STRING_PRETTY));
@@ -129,9 +175,37 @@ action_result_t action_execute_all(json_object *actions, json_object *settings)
     debug_return result;
 }
 
-static action_result_t dump_query_history(json_object *actions, json_object *settings_obj) {
+static action_result_t batch(json_object *settings, json_object *data) {
     debug_enter();
-    context_dump_history();
+    if (batch_run(json_object_get_string(data), settings)) {
+        debug_return ACTION_ERROR;
+    }
+    debug_return ACTION_END;
+}
+
+static action_result_t dump_query_history(json_object *settings, json_object *data) {
+    debug_enter();
+    context_history_filter_t filter;
+    const char *s = json_object_get_type(data) == json_type_string ? json_object_get_string(data) : NULL;
+    if (context_parse_history_filter(s, &filter) || context_dump_history(&filter)) {
+        debug_return ACTION_ERROR;
+    }
+    debug_return ACTION_END;
+}
+
+static action_result_t export_context(json_object *settings, json_object *data) {
+    debug_enter();
+    if (context_export(json_object_get_string(data))) {
+        debug_return ACTION_ERROR;
+    }
+    debug_return ACTION_END;
+}
+
+static action_result_t fork_context(json_object *settings, json_object *data) {
+    debug_enter();
+    if (context_fork(json_object_get_string(data))) {
+        debug_return ACTION_ERROR;
+    }
     debug_return ACTION_END;
 }
 
@@ -185,7 +259,7 @@ static action_result_t query(json_object *settings, json_object *data) {
     char *query = NULL;
     json_object *prompt = NULL;
     json_object_object_get_ex(settings, SETTING_KEY_PROMPT, &prompt);
-    if (prompt == NULL) {
+    if (prompt == NULL && !json_object_object_get_ex(settings, SETTING_KEY_PIPE, NULL)) {
         query = input_get();
         if (query != NULL) {
             json_object_object_add(settings, SETTING_KEY_PROMPT, json_object_new_string(query));
@@ -194,6 +268,7 @@ static action_result_t query(json_object *settings, json_object *data) {
         }
     }
     api_interface->query(settings);
+    summary_update(settings);
     debug_return ACTION_END;
 }
 
@@ -245,6 +320,19 @@ static action_result_t update_context(json_object *settings, json_object *data)
     debug_return ACTION_END;
 }
 
+// Find the action that decides what the run does: the first one that ends
+// processing. The query is added by main() when it wasn't asked for, so it's
+// reached if nothing before it ends processing.
+static const action_t *first_action(json_object *actions) {
+    for (int i = 0; action_templates[i] != NULL; i++) {
+        const action_t *action = action_templates[i];
+        if (action == &action_query || (json_object_object_get_ex(actions, action->name, NULL) && !action->continues)) {
+            return action;
+        }
+    }
+    return NULL;
+}
+
 static action_t **action_merge(action_t **actions1, action_t **actions2) {
     debug_enter();
     int n1 = 0;
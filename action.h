@@ -10,11 +10,14 @@
 #ifndef _ACTION_H
 #define _ACTION_H
 
+#include <stdbool.h>
+
 #include <json-c/json_object.h>
 
 #define ACTION_KEY_AI_HOST              "ai-host"
 #define ACTION_KEY_AI_MODEL             "ai-model"
 #define ACTION_KEY_AI_PROVIDER          "ai-provider"
+#define ACTION_KEY_BATCH                "batch"
 #define ACTION_KEY_CONTEXT_FILENAME     "context-filename"
 #define ACTION_KEY_HELP                 "help"
 #define ACTION_KEY_VERSION              "version"
@@ -24,6 +27,8 @@
 #define ACTION_KEY_RESET_CONTEXT        "reset-context"
 #define ACTION_KEY_BUFFERED             "buffered"
 #define ACTION_KEY_DUMP_QUERY_HISTORY   "dump-query-history"
+#define ACTION_KEY_EXPORT_CONTEXT       "export-context"
+#define ACTION_KEY_FORK_CONTEXT         "fork-context"
 #define ACTION_KEY_SET_SYSTEM_PROMPT    "system-prompt"
 #define ACTION_KEY_UPDATE_CONTEXT       "update-context"
 #define ACTION_KEY_GET_EMBEDDINGS       "get-embeddings"
@@ -46,6 +51,8 @@ typedef enum action_result_t {
 typedef struct action_t {
     const char *name;
     action_result_t (*callback)(json_object *settings, json_object *data);
+    bool continues; // Processing goes on to the next action after this one.
+    bool request;   // The action sends a request to the AI provider.
 } action_t;
 
 /**
@@ -56,4 +63,21 @@ typedef struct action_t {
  */
 extern action_result_t action_execute_all(json_object *actions, json_object *settings);
 
+/**
+ * @brief Check whether running the given actions will read the prompt from
+ * stdin.
+ * @param actions json_object containing the actions to execute.
+ * @param settings json_object containing the settings to use.
+ * @return true if the prompt will be read from stdin.
+ */
+extern bool action_reads_input(json_object *actions, json_object *settings);
+
+/**
+ * @brief Check whether running the given actions will send a request to the
+ * AI provider.
+ * @param actions json_object containing the actions to execute.
+ * @return true if a request will be sent.
+ */
+extern bool action_sends_request(json_object *actions);
+
 #endif // _ACTION_H
@@ -12,6 +12,7 @@
 #include "api.h"
 
 #include "chewie.h"
+#include "http.h"
 #include "ollama.h"
 #include "openai.h"
 
@@ -29,6 +30,24 @@ api_interface_t *api_interface;
 
 api_id_t api_default = api_id_openai;
 
+void api_cancel(api_request_t *request) {
+    debug_enter();
+    http_cancel(&request->http);
+    request->res = CURLE_ABORTED_BY_CALLBACK;
+    request->api->finish(request, NULL);
+    debug_return;
+}
+
+api_request_t *api_drive(void) {
+    debug_enter();
+    CURLcode res;
+    api_request_t *request = (api_request_t *)http_wait(&res);
+    if (request != NULL) {
+        request->res = res;
+    }
+    debug_return request;
+}
+
 api_id_t api_name_to_id(const char *name) {
     debug_enter();
     if (name != NULL) {
@@ -5,6 +5,14 @@
  * @version 0.1.0
  * @date 2024-04-27
  * @copyright Copyright (c) 2024
+ * @details
+ * Besides query() and complete(), which send a request and wait for it, an
+ * API module can start requests without waiting for them. start() sends a
+ * request for a prompt and returns at once, with everything the request
+ * needs kept in a state of its own, so any number of them can be going at
+ * the same time. api_drive() runs all the started requests, of whichever
+ * module, and hands back each one as it finishes, and the module's finish()
+ * gets its answer and releases it.
  */
 
 #ifndef _API_H
@@ -12,9 +20,26 @@
 
 #include <json-c/json_object.h>
 
+#include <curl/curl.h>
+
 #include "action.h"
+#include "http.h"
 #include "option.h"
 
+/**
+ * @brief A request started by an API module's start function. http comes
+ * first, so the request http_wait() gives back is the api_request_t. res is
+ * set once it's done. user_data belongs to whoever started it. The module
+ * keeps its own state for the request along with it, which its finish
+ * function releases.
+ */
+typedef struct api_request_t {
+    http_request_t http;
+    CURLcode res;
+    const struct api_interface_t *api;
+    void *user_data;
+} api_request_t;
+
 /** @brief API function that returns a json object. */
 typedef action_t **(*api_get_action_func_t)(void);
 /** @brief API function that returns a json object. */
@@ -25,6 +50,12 @@ typedef const char *(*api_get_func_t)(void);
 typedef int (*api_print_func_t)(json_object *options);
 /** @brief API function that queries the host. */
 typedef const char *(*api_query_func_t)(json_object *options);
+/** @brief API function that returns a response without printing it or adding it to the history. */
+typedef char *(*api_complete_func_t)(json_object *options, const char *system_prompt, const char *prompt);
+/** @brief API function that starts a request for the prompt in options without waiting for it. Returns NULL if it couldn't be sent. */
+typedef api_request_t *(*api_start_func_t)(json_object *options, void *user_data);
+/** @brief API function that adds the response, or the error, of a finished request to result, if it isn't NULL, and releases the request. Returns 0 for a response. */
+typedef int (*api_finish_func_t)(api_request_t *request, json_object *result);
 
 /**
  * @brief AIP API ID.
@@ -40,14 +71,17 @@ typedef enum api_id_t {
 
 /** @brief API interface. */
 typedef struct api_interface_t {
-    api_get_action_func_t   get_actions;        // Get actions for AI API.
-    api_get_option_func_t   get_options;        // Get option templates for AI API.
-    api_get_func_t          get_default_host;   // Get default host for AI API.
-    api_get_func_t          get_default_model;  // Get default model.
-    api_get_func_t          get_api_name;       // Get API name.
-    api_print_func_t        get_embeddings;     // Get embeddings.
-    api_print_func_t        print_model_list;   // Print list of models.
-    api_query_func_t        query;              // Query the host.
+    api_get_action_func_t     get_actions;        // Get actions for AI API.
+    api_get_option_func_t     get_options;        // Get option templates for AI API.
+    api_get_func_t            get_default_host;   // Get default host for AI API.
+    api_get_func_t            get_default_model;  // Get default model.
+    api_get_func_t            get_api_name;       // Get API name.
+    api_print_func_t          get_embeddings;     // Get embeddings.
+    api_print_func_t          print_model_list;   // Print list of models.
+    api_query_func_t          query;              // Query the host.
+    api_complete_func_t       complete;           // Get a response for internal use.
+    api_start_func_t          start;              // Start a request without waiting for it.
+    api_finish_func_t         finish;             // Get the response to a started request.
 } api_interface_t;
 
 typedef const api_interface_t *(*get_api_interface_func_t)(void);
@@ -66,6 +100,11 @@ extern api_id_t api_default;
  */
 extern api_id_t api_name_to_id(const char *name);
 
+/** @brief Stop a started request that hasn't finished and release it. */
+extern void api_cancel(api_request_t *request);
+/** @brief Run the started requests until the next one finishes, and return it. Returns NULL when none are left. */
+extern api_request_t *api_drive(void);
+
 /**
  * @brief  Get the API interface for the given api_id_t.
  * @param id API ID.
@@ -0,0 +1,229 @@
+/**
+ * @file batch.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Send a file of prompts as a batch.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <json-c/json.h>
+
+#include "chewie.h"
+#include "api.h"
+#include "batch.h"
+#include "output.h"
+#include "setting.h"
+
+#define BATCH_KEY_CONTEXT               "context"
+#define BATCH_KEY_ERROR                 "error"
+#define BATCH_KEY_ID                    "id"
+#define BATCH_KEY_MODEL                 "model"
+#define BATCH_KEY_PROMPT                "prompt"
+#define BATCH_KEY_SYSTEM                "system"
+
+/**
+ * @brief A prompt of the batch, from when it's read until its result is
+ * written. result holds the id, and the response or error once it's done.
+ */
+typedef struct item_t {
+    json_object *result;
+    api_request_t *request;
+    bool done;
+} item_t;
+
+static void fail(item_t *item, const char *error);
+static void finish(api_request_t *request);
+static json_object *item_options(json_object *item_obj, json_object *settings);
+static int start(item_t *item, const char *line, long line_no, json_object *settings);
+
+int batch_run(const char *fn, json_object *settings) {
+    debug_enter();
+    FILE *f = NULL;
+    item_t *items = NULL;
+    json_object *field_obj = NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    size_t next = 0;
+    size_t written = 0;
+    long line_no = 0;
+    int concurrency = BATCH_CONCURRENCY_DEFAULT;
+    int window = 0;
+    int running = 0;
+    int failed = 0;
+    bool eof = false;
+    int result = 1;
+    if (api_interface->start == NULL || api_interface->finish == NULL) {
+        fprintf(stderr, "Batches aren't supported by %s\n", api_interface->get_api_name());
+        debug_return 1;
+    }
+    if (json_object_object_get_ex(settings, SETTING_KEY_BATCH_CONCURRENCY, &field_obj)) {
+        concurrency = json_object_get_int(field_obj);
+    }
+    window = concurrency * BATCH_WINDOW;
+    f = strcmp(fn, "-") == 0 ? stdin : fopen(fn, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Error opening batch file %s\n", fn);
+        debug_return 1;
+    }
+    items = calloc(window, sizeof(item_t));
+    if (items == NULL) {
+        fprintf(stderr, "Error allocating memory for batch\n");
+        goto term;
+    }
+    while (1) {
+        while (!eof && running < concurrency && next - written < (size_t)window) {
+            if (getline(&line, &cap, f) == -1) {
+                eof = true;
+                break;
+            }
+            line_no++;
+            if (line[strspn(line, " \t\r\n")] == '\0') {
+                continue;
+            }
+            if (start(&items[next++ % window], line, line_no, settings) == 0) {
+                running++;
+            }
+        }
+        while (written < next && items[written % window].done) {
+            item_t *item = &items[written++ % window];
+            const char *s = json_object_to_json_string_ext(item->result, JSON_C_TO_STRING_PLAIN);
+            if (json_object_object_get_ex(item->result, BATCH_KEY_ERROR, NULL)) {
+                failed++;
+            }
+            if (output_write(s, strlen(s)) || output_write("\n", 1)) {
+                goto term;
+            }
+            json_object_put(item->result);
+            item->result = NULL;
+        }
+        if (running == 0) {
+            if (eof) {
+                break;
+            }
+            continue;
+        }
+        api_request_t *request = api_drive();
+        if (request == NULL) {
+            goto term;
+        }
+        running--;
+        finish(request);
+    }
+    debug("batch of %zu prompts sent, %d failed\n", next, failed);
+    if (failed > 0) {
+        fprintf(stderr, "%d of %zu prompts failed\n", failed, next);
+    }
+    result = failed > 0 ? 1 : 0;
+term:
+    if (items != NULL) {
+        for (int i = 0; i < window; i++) {
+            if (items[i].request != NULL) {
+                api_cancel(items[i].request);
+            }
+            if (items[i].result != NULL) {
+                json_object_put(items[i].result);
+            }
+        }
+        free(items);
+    }
+    free(line);
+    if (f != stdin) {
+        fclose(f);
+    }
+    debug_return result;
+}
+
+static void fail(item_t *item, const char *error) {
+    json_object_object_add(item->result, BATCH_KEY_ERROR, json_object_new_string(error));
+    item->done = true;
+}
+
+static void finish(api_request_t *request) {
+    item_t *item = (item_t *)request->user_data;
+    item->request = NULL;
+    request->api->finish(request, item->result);
+    item->done = true;
+}
+
+/**
+ * @brief Make the options for one prompt: the prompt itself, and its model,
+ * system prompt and earlier turns, or the settings' if it doesn't give them.
+ */
+static json_object *item_options(json_object *item_obj, json_object *settings) {
+    json_object *options = json_object_new_object();
+    json_object *field_obj = NULL;
+    if (options == NULL) {
+        return NULL;
+    }
+    if (json_object_object_get_ex(settings, SETTING_KEY_AI_HOST, &field_obj)) {
+        json_object_object_add(options, SETTING_KEY_AI_HOST, json_object_get(field_obj));
+    }
+    if (json_object_object_get_ex(item_obj, BATCH_KEY_MODEL, &field_obj) ||
+        json_object_object_get_ex(settings, SETTING_KEY_AI_MODEL, &field_obj)) {
+        json_object_object_add(options, SETTING_KEY_AI_MODEL, json_object_get(field_obj));
+    }
+    if (json_object_object_get_ex(item_obj, BATCH_KEY_SYSTEM, &field_obj) ||
+        json_object_object_get_ex(settings, SETTING_KEY_SYSTEM_PROMPT, &field_obj)) {
+        json_object_object_add(options, SETTING_KEY_SYSTEM_PROMPT, json_object_get(field_obj));
+    }
+    if (json_object_object_get_ex(item_obj, BATCH_KEY_CONTEXT, &field_obj) && json_object_is_type(field_obj, json_type_array)) {
+        json_object_object_add(options, SETTING_KEY_HISTORY, json_object_get(field_obj));
+    }
+    json_object_object_get_ex(item_obj, BATCH_KEY_PROMPT, &field_obj);
+    json_object_object_add(options, SETTING_KEY_PROMPT, json_object_get(field_obj));
+    return options;
+}
+
+/**
+ * @brief Parse a line of the batch file and send its prompt. A line that
+ * can't be sent is done straight away, with the reason as its error. Returns
+ * 0 if the request was sent.
+ */
+static int start(item_t *item, const char *line, long line_no, json_object *settings) {
+    json_object *item_obj = json_tokener_parse(line);
+    json_object *options = NULL;
+    json_object *field_obj = NULL;
+    int result = 1;
+    item->done = false;
+    item->result = json_object_new_object();
+    if (item->result == NULL) {
+        fprintf(stderr, "Error creating new JSON object\n");
+        exit(1);
+    }
+    if (item_obj != NULL && json_object_object_get_ex(item_obj, BATCH_KEY_ID, &field_obj)) {
+        json_object_object_add(item->result, BATCH_KEY_ID, json_object_get(field_obj));
+    } else {
+        json_object_object_add(item->result, BATCH_KEY_ID, json_object_new_int64(line_no));
+    }
+    if (item_obj == NULL || !json_object_is_type(item_obj, json_type_object)) {
+        fail(item, "Invalid JSON");
+        goto term;
+    }
+    if (!json_object_object_get_ex(item_obj, BATCH_KEY_PROMPT, &field_obj) || !json_object_is_type(field_obj, json_type_string)) {
+        fail(item, "No prompt");
+        goto term;
+    }
+    if ((options = item_options(item_obj, settings)) == NULL) {
+        fail(item, "Error creating new JSON object");
+        goto term;
+    }
+    if ((item->request = api_interface->start(options, item)) == NULL) {
+        fail(item, "Error sending request");
+        goto term;
+    }
+    result = 0;
+term:
+    if (item_obj != NULL) {
+        json_object_put(item_obj);
+    }
+    if (options != NULL) {
+        json_object_put(options);
+    }
+    return result;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file batch.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Send a file of prompts as a batch.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * Each line of a batch file is a JSON object with one prompt to send:
+ *
+ *     {"id": 7, "prompt": "...", "system": "...", "model": "...", "context": [{"prompt": "...", "response": "..."}]}
+ *
+ * Only "prompt" is needed. "system" and "model" default to the system prompt
+ * and model chewie would otherwise use, and "context" is the conversation to
+ * send ahead of the prompt, in the same form `his=jsonl` prints it. Blank
+ * lines are skipped.
+ *
+ * Up to BATCH_CONCURRENCY_DEFAULT prompts, or as many as the batch
+ * concurrency setting says, are sent at once with the current API module's
+ * start() and run together by api_drive(). A line is written to stdout for
+ * every prompt, in the order of the file, with its id (or its line number if
+ * it has none) and either the response or what went wrong:
+ *
+ *     {"id": 7, "response": "..."}
+ *     {"id": 8, "error": "..."}
+ *
+ * Nothing is added to the context. A prompt that's still going holds back
+ * the ones after it, but the next ones keep being sent until
+ * BATCH_WINDOW times the concurrency are waiting to be written.
+ */
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <json-c/json_object.h>
+
+/** @brief Number of prompts sent at once, if the batch concurrency setting isn't given. */
+#define BATCH_CONCURRENCY_DEFAULT       4
+/** @brief How many times the concurrency may be sent or waiting to be written at once. */
+#define BATCH_WINDOW                    4
+
+/** @brief Send every prompt in the batch file fn ("-" for stdin). Returns 1 if any of them failed. */
+extern int batch_run(const char *fn, json_object *settings);
+
+#endif // _BATCH_H
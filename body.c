@@ -0,0 +1,251 @@
+/**
+ * @file body.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Stream a JSON request body without building it in memory.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+#include <json-c/json.h>
+
+#include "chewie.h"
+#include "body.h"
+
+/** @brief Most bytes read from an input segment's file descriptor at once. */
+#define BODY_INPUT_READ                 16384
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int add_segment(body_t *body, const char *s, size_t offset, size_t len, bool escape);
+static int read_input(body_t *body, const body_segment_t *seg);
+static size_t escape_char(unsigned char c, char *out);
+static size_t escaped_length(const char *s, size_t len);
+
+int body_add(body_t *body, const char *s, size_t len) {
+    size_t offset = body->text.len;
+    body->text.spill_size = SIZE_MAX;
+    if (buffer_append(&body->text, s, len)) {
+        return 1;
+    }
+    if (body->len != SIZE_MAX) {
+        body->len += len;
+    }
+    // Copied text is contiguous, so text copied right after more copied text
+    // just makes the last segment longer.
+    if (body->count > 0) {
+        body_segment_t *last = &body->segments[body->count - 1];
+        if (last->s == NULL && !last->escape && last->input == NULL && last->offset + last->len == offset) {
+            last->len += len;
+            return 0;
+        }
+    }
+    return add_segment(body, NULL, offset, len, false);
+}
+
+int body_add_escaped(body_t *body, const char *s, size_t len) {
+    if (body->len != SIZE_MAX) {
+        body->len += escaped_length(s, len);
+    }
+    return add_segment(body, s, 0, len, true);
+}
+
+int body_add_input(body_t *body, int fd, buffer_t *input) {
+    if (add_segment(body, NULL, 0, 0, true)) {
+        return 1;
+    }
+    input->spill_size = SIZE_MAX;
+    body->segments[body->count - 1].fd = fd;
+    body->segments[body->count - 1].input = input;
+    body->input_done = false;
+    body->len = SIZE_MAX;
+    return 0;
+}
+
+int body_add_json(body_t *body, json_object *obj) {
+    const char *s = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+    if (s == NULL) {
+        fprintf(stderr, "Error serializing JSON object\n");
+        return 1;
+    }
+    return body_add(body, s, strlen(s));
+}
+
+int body_add_string(body_t *body, const char *s) {
+    if (s == NULL) {
+        return body_add(body, "null", 4);
+    }
+    return body_add(body, "\"", 1) || body_add_escaped(body, s, strlen(s)) || body_add(body, "\"", 1);
+}
+
+void body_free(body_t *body) {
+    free(body->segments);
+    buffer_free(&body->text);
+    memset(body, 0, sizeof(body_t));
+}
+
+size_t body_length(const body_t *body) {
+    return body->len;
+}
+
+size_t body_read(char *buf, size_t size, size_t nitems, void *user_data) {
+    body_t *body = (body_t *)user_data;
+    size_t max = size * nitems;
+    size_t n = 0;
+    while (n < max) {
+        if (body->pending_pos < body->pending_len) {
+            size_t k = body->pending_len - body->pending_pos;
+            if (k > max - n) {
+                k = max - n;
+            }
+            memcpy(buf + n, body->pending + body->pending_pos, k);
+            body->pending_pos += k;
+            n += k;
+            continue;
+        }
+        if (body->segment >= body->count) {
+            break;
+        }
+        const body_segment_t *seg = &body->segments[body->segment];
+        const char *s = seg->s != NULL ? seg->s : body->text.data + seg->offset;
+        size_t len = seg->len;
+        if (seg->input != NULL) {
+            // Everything read so far is kept, so a rewind reads it again from
+            // the copy. Only wait for more input if there's nothing to send.
+            if (body->pos == seg->input->len && !body->input_done) {
+                if (n > 0) {
+                    break;
+                }
+                if (read_input(body, seg)) {
+                    return CURL_READFUNC_ABORT;
+                }
+            }
+            s = seg->input->data;
+            len = seg->input->len;
+        }
+        if (!seg->escape) {
+            size_t k = len - body->pos;
+            if (k > max - n) {
+                k = max - n;
+            }
+            memcpy(buf + n, s + body->pos, k);
+            body->pos += k;
+            n += k;
+        } else {
+            while (n < max && body->pos < len) {
+                // Copy the run of characters that don't need escaping in one
+                // go, then escape the one that ends it.
+                size_t run = body->pos;
+                while (run < len && run - body->pos < max - n && escape_char((unsigned char)s[run], NULL) == 0) {
+                    run++;
+                }
+                memcpy(buf + n, s + body->pos, run - body->pos);
+                n += run - body->pos;
+                body->pos = run;
+                if (n < max && body->pos < len) {
+                    body->pending_len = escape_char((unsigned char)s[body->pos], body->pending);
+                    body->pending_pos = 0;
+                    body->pos++;
+                    break;
+                }
+            }
+        }
+        if (body->pos == len && body->pending_pos == body->pending_len && (seg->input == NULL || body->input_done)) {
+            body->segment++;
+            body->pos = 0;
+        }
+    }
+    return n;
+}
+
+int body_rewind(void *user_data) {
+    body_t *body = (body_t *)user_data;
+    body->segment = 0;
+    body->pos = 0;
+    body->pending_len = 0;
+    body->pending_pos = 0;
+    return 0;
+}
+
+static int add_segment(body_t *body, const char *s, size_t offset, size_t len, bool escape) {
+    if (body->count == body->cap) {
+        int cap = body->cap == 0 ? 64 : body->cap * 2;
+        body_segment_t *segments = realloc(body->segments, cap * sizeof(body_segment_t));
+        if (segments == NULL) {
+            fprintf(stderr, "Error allocating memory for request body\n");
+            return 1;
+        }
+        body->segments = segments;
+        body->cap = cap;
+    }
+    body->segments[body->count++] = (body_segment_t){.s = s, .offset = offset, .len = len, .escape = escape, .fd = -1};
+    return 0;
+}
+
+/**
+ * @brief Get the escape sequence for c, written to out if out isn't NULL.
+ * Returns 0 if c is sent as it is.
+ */
+static size_t escape_char(unsigned char c, char *out) {
+    char e = 0;
+    switch (c) {
+        case '"': e = '"'; break;
+        case '\\': e = '\\'; break;
+        case '\b': e = 'b'; break;
+        case '\f': e = 'f'; break;
+        case '\n': e = 'n'; break;
+        case '\r': e = 'r'; break;
+        case '\t': e = 't'; break;
+        default:
+            if (c >= 0x20) {
+                return 0;
+            }
+            if (out != NULL) {
+                memcpy(out, "\\u00", 4);
+                out[4] = hex_digits[c >> 4];
+                out[5] = hex_digits[c & 0x0f];
+            }
+            return 6;
+    }
+    if (out != NULL) {
+        out[0] = '\\';
+        out[1] = e;
+    }
+    return 2;
+}
+
+static size_t escaped_length(const char *s, size_t len) {
+    size_t n = len;
+    for (size_t i = 0; i < len; i++) {
+        size_t k = escape_char((unsigned char)s[i], NULL);
+        if (k > 0) {
+            n += k - 1;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Read the next piece of an input segment into its copy, blocking
+ * until there is some or the input ends.
+ */
+static int read_input(body_t *body, const body_segment_t *seg) {
+    char buf[BODY_INPUT_READ];
+    ssize_t r = read(seg->fd, buf, sizeof(buf));
+    if (r < 0) {
+        fprintf(stderr, "Error reading input for request body\n");
+        return 1;
+    }
+    if (r == 0) {
+        body->input_done = true;
+        return 0;
+    }
+    return buffer_append(seg->input, buf, r);
+}
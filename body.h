@@ -0,0 +1,83 @@
+/**
+ * @file body.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Stream a JSON request body without building it in memory.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * A query sends the conversation history with every request. Building that
+ * request as json-c objects copies every history string into the objects,
+ * and rendering them copies it all again into one string before the upload
+ * starts. A body_t instead keeps a list of segments that point at the text
+ * where it already is, such as the history entries held by the context, and
+ * turns them into JSON as the upload asks for more with body_read().
+ *
+ * Strings added with body_add_string() or body_add_escaped() are escaped as
+ * they are read. They are not copied, so they have to stay put until the
+ * request is done. Text added with body_add() or body_add_json() is copied
+ * into the body, since it is usually short and built on the spot.
+ *
+ * The length of the whole body is usually known as soon as it is put
+ * together, so it is sent with a Content-Length rather than in chunks. The
+ * exception is a body with text added by body_add_input(), which is read from
+ * a file descriptor, such as stdin, only as the upload gets to it. Its length
+ * isn't known until the input ends, so body_length() returns SIZE_MAX.
+ */
+
+#ifndef _BODY_H
+#define _BODY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <json-c/json.h>
+
+#include "buffer.h"
+
+/** @brief A piece of the body: text to send as it is or to escape as the contents of a JSON string. */
+typedef struct body_segment_t {
+    const char *s;
+    size_t offset;
+    size_t len;
+    bool escape;
+    int fd;
+    buffer_t *input;
+} body_segment_t;
+
+/** @brief A request body and how much of it has been read. */
+typedef struct body_t {
+    body_segment_t *segments;
+    int count;
+    int cap;
+    buffer_t text;
+    size_t len;
+    int segment;
+    size_t pos;
+    char pending[8];
+    size_t pending_len;
+    size_t pending_pos;
+    bool input_done;
+} body_t;
+
+/** @brief Append a copy of len bytes of s, sent as it is. */
+extern int body_add(body_t *body, const char *s, size_t len);
+/** @brief Append len bytes of s, escaped as the contents of a JSON string. s is not copied. */
+extern int body_add_escaped(body_t *body, const char *s, size_t len);
+/** @brief Append what is read from fd until it ends, escaped as the contents of a JSON string, keeping a copy in input. */
+extern int body_add_input(body_t *body, int fd, buffer_t *input);
+/** @brief Append the given object, serialized by json-c. */
+extern int body_add_json(body_t *body, json_object *obj);
+/** @brief Append s as a quoted and escaped JSON string. s is not copied. */
+extern int body_add_string(body_t *body, const char *s);
+/** @brief Release the segments and copied text, leaving the body empty. */
+extern void body_free(body_t *body);
+/** @brief Get the number of bytes the body serializes to, or SIZE_MAX if it has input still to be read. */
+extern size_t body_length(const body_t *body);
+/** @brief Copy the next part of the body into buf. Has the signature of CURLOPT_READFUNCTION. */
+extern size_t body_read(char *buf, size_t size, size_t nitems, void *user_data);
+/** @brief Start reading the body from the beginning again. */
+extern int body_rewind(void *user_data);
+
+#endif // _BODY_H
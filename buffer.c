@@ -0,0 +1,161 @@
+/**
+ * @file buffer.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Collect text of unknown length in memory.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chewie.h"
+#include "buffer.h"
+
+/** @brief Smallest block allocated for a buffer's contents. */
+#define BUFFER_MIN_SIZE                 4096
+/** @brief Number of bytes read from a file at a time by buffer_read_file(). */
+#define BUFFER_READ_SIZE                65536
+
+static int grow(buffer_t *buffer, size_t len);
+static int spill(buffer_t *buffer);
+static int unspill(buffer_t *buffer);
+
+int buffer_append(buffer_t *buffer, const char *data, size_t len) {
+    size_t spill_size = buffer->spill_size == 0 ? BUFFER_SPILL_SIZE : buffer->spill_size;
+    if (buffer->spill == NULL && buffer->len + len > spill_size && spill(buffer)) {
+        // Without a temporary file, keep everything in memory.
+        buffer->spill_size = SIZE_MAX;
+    }
+    if (buffer->spill != NULL) {
+        if (fwrite(data, 1, len, buffer->spill) != len) {
+            perror("Error writing to temporary buffer file");
+            return 1;
+        }
+        buffer->len += len;
+        return 0;
+    }
+    if (grow(buffer, len)) {
+        return 1;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    buffer->data[buffer->len] = '\0';
+    return 0;
+}
+
+void buffer_free(buffer_t *buffer) {
+    if (buffer->spill != NULL) {
+        fclose(buffer->spill);
+    }
+    free(buffer->data);
+    memset(buffer, 0, sizeof(buffer_t));
+}
+
+const char *buffer_get(buffer_t *buffer) {
+    if (buffer->spill != NULL && unspill(buffer)) {
+        return NULL;
+    }
+    return buffer->len > 0 ? buffer->data : NULL;
+}
+
+int buffer_read_file(buffer_t *buffer, FILE *f) {
+    char block[BUFFER_READ_SIZE];
+    size_t n = 0;
+    while ((n = fread(block, 1, sizeof(block), f)) > 0) {
+        if (buffer_append(buffer, block, n)) {
+            return 1;
+        }
+    }
+    if (ferror(f)) {
+        perror("Error reading input");
+        return 1;
+    }
+    return 0;
+}
+
+void buffer_reset(buffer_t *buffer) {
+    if (buffer->spill != NULL) {
+        fclose(buffer->spill);
+        buffer->spill = NULL;
+    }
+    buffer->len = 0;
+    if (buffer->data != NULL) {
+        buffer->data[0] = '\0';
+    }
+}
+
+char *buffer_take(buffer_t *buffer) {
+    char *data = NULL;
+    if (buffer_get(buffer) == NULL) {
+        return NULL;
+    }
+    data = buffer->data;
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->cap = 0;
+    return data;
+}
+
+static int grow(buffer_t *buffer, size_t len) {
+    if (buffer->len + len < buffer->cap) {
+        return 0;
+    }
+    size_t cap = buffer->cap == 0 ? BUFFER_MIN_SIZE : buffer->cap;
+    while (cap <= buffer->len + len) {
+        cap *= 2;
+    }
+    char *data = realloc(buffer->data, cap);
+    if (data == NULL) {
+        fprintf(stderr, "Error allocating %zu bytes for buffer\n", cap);
+        return 1;
+    }
+    buffer->data = data;
+    buffer->cap = cap;
+    return 0;
+}
+
+static int spill(buffer_t *buffer) {
+    debug("moving %zu byte buffer to a temporary file\n", buffer->len);
+    FILE *f = tmpfile();
+    if (f == NULL) {
+        return 1;
+    }
+    if (fwrite(buffer->data, 1, buffer->len, f) != buffer->len) {
+        fclose(f);
+        return 1;
+    }
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->cap = 0;
+    buffer->spill = f;
+    return 0;
+}
+
+static int unspill(buffer_t *buffer) {
+    FILE *f = buffer->spill;
+    size_t len = buffer->len;
+    buffer->spill = NULL;
+    buffer->len = 0;
+    if (fseek(f, 0L, SEEK_SET) == -1) {
+        perror("Unable to rewind temporary buffer file");
+        goto err;
+    }
+    if (grow(buffer, len)) {
+        goto err;
+    }
+    if (fread(buffer->data, 1, len, f) != len) {
+        perror("Unable to read temporary buffer file");
+        goto err;
+    }
+    fclose(f);
+    buffer->len = len;
+    buffer->data[len] = '\0';
+    return 0;
+err:
+    fclose(f);
+    return 1;
+}
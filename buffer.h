@@ -0,0 +1,54 @@
+/**
+ * @file buffer.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Collect text of unknown length in memory.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * A buffer_t collects text that arrives a piece at a time, such as a streamed
+ * response or the prompt read from stdin. Pieces are copied into a single
+ * block of memory that doubles in size as it fills, so appending a token
+ * usually costs a memcpy() and nothing else. The contents are always
+ * null-terminated.
+ *
+ * A buffer that grows past its spill size is moved into a temporary file, and
+ * later pieces are written to that file through stdio's own buffering. The
+ * contents are only read back into memory when they are asked for. The spill
+ * size defaults to BUFFER_SPILL_SIZE when it is left at zero.
+ *
+ * A buffer_t that is all zeros is empty and ready to use.
+ */
+
+#ifndef _BUFFER_H
+#define _BUFFER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/** @brief Size past which a buffer is moved to a temporary file, if the buffer doesn't set its own. */
+#define BUFFER_SPILL_SIZE               (64 * 1024 * 1024)
+
+/** @brief Text collected so far. */
+typedef struct buffer_t {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t spill_size;
+    FILE *spill;
+} buffer_t;
+
+/** @brief Append len bytes of data to the buffer. */
+extern int buffer_append(buffer_t *buffer, const char *data, size_t len);
+/** @brief Release everything the buffer holds. */
+extern void buffer_free(buffer_t *buffer);
+/** @brief Get the null-terminated contents of the buffer, or NULL if nothing has been appended. */
+extern const char *buffer_get(buffer_t *buffer);
+/** @brief Append everything that is left to read from the given file. */
+extern int buffer_read_file(buffer_t *buffer, FILE *f);
+/** @brief Empty the buffer, keeping its memory for reuse. */
+extern void buffer_reset(buffer_t *buffer);
+/** @brief Get the contents of the buffer and leave it empty. The caller frees them. */
+extern char *buffer_take(buffer_t *buffer);
+
+#endif // _BUFFER_H
@@ -24,11 +24,18 @@
 #include "chewie.h"
 #include "action.h"
 #include "api.h"
+#include "batch.h"
 #include "configure.h"
 #include "context.h"
 #include "file.h"
+#include "http.h"
+#include "input.h"
 #include "option.h"
+#include "output.h"
+#include "ratelimit.h"
+#include "route.h"
 #include "setting.h"
+#include "tokenizer.h"
 
 const char *list_argument = "?";
 const char *program_name = NULL;
@@ -39,17 +46,31 @@ static int set_missing_ctx(option_t *option, json_object *actions_obj, json_obje
 static int set_missing_fun(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int set_missing_mdl(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int set_missing_qry(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int set_missing_smk(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int set_missing_smt(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int set_missing_sys(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int set_missing_tok(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_aih_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_aip_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_cmp_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_ctx_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_bat_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_bcn_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_buf_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_emb_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_exp_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_flu_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_frk_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_fun_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_hdg_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_his_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_mdl_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_pip_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_qry_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_smk_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_smt_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_sys_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_tok_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_h_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_r_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int option_u_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
@@ -94,6 +115,13 @@ static option_t option_mdl = {
     .validate = option_mdl_validate,
     .set_missing = set_missing_mdl
 };
+static option_t option_pip = {
+    .name = "pip",
+    .description = "Send the prompt from stdin as it is read, without waiting for the end.",
+    .arg_type = option_arg_none,
+    .value = NULL,
+    .validate = option_pip_validate,
+};
 static option_t option_qry = {
     .name = "qry",
     .description = "Set the query.",
@@ -130,6 +158,20 @@ static option_t option_v = {
     .value = NULL,
     .validate = option_v_validate
 };
+static option_t option_bat = {
+    .name = "bat",
+    .description = "Send every prompt in the given JSONL file (\"-\" for stdin) and print the responses as JSONL.",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = option_bat_validate
+};
+static option_t option_bcn = {
+    .name = "bcn",
+    .description = "Set how many prompts of a batch are sent at once.",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = option_bcn_validate
+};
 static option_t option_buf = {
     .name = "buf",
     .description = "Buffer the response instead of printing as it comes in.",
@@ -137,10 +179,17 @@ static option_t option_buf = {
     .value = NULL,
     .validate = option_buf_validate,
 };
+static option_t option_cmp = {
+    .name = "cmp",
+    .description = "Compress request bodies with zstd. Only for servers that accept them.",
+    .arg_type = option_arg_none,
+    .value = NULL,
+    .validate = option_cmp_validate,
+};
 static option_t option_his = {
     .name = "his",
-    .description = "Print the query/response history.",
-    .arg_type = option_arg_none,
+    .description = "Print the query/response history. Optionally give a comma-separated range: N (the last N entries), start:end, from=time, to=time, jsonl.",
+    .arg_type = option_arg_optional,
     .value = NULL,
     .validate = option_his_validate
 };
@@ -152,6 +201,30 @@ static option_t option_sys = {
     .validate = option_sys_validate,
     .set_missing = set_missing_sys
 };
+static option_t option_smk = {
+    .name = "smk",
+    .description = "Summarize the oldest history once the unsummarized history exceeds this many tokens. 0 turns it off.",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = option_smk_validate,
+    .set_missing = set_missing_smk
+};
+static option_t option_smt = {
+    .name = "smt",
+    .description = "Summarize the oldest history once there are more than this many unsummarized turns. 0 turns it off.",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = option_smt_validate,
+    .set_missing = set_missing_smt
+};
+static option_t option_tok = {
+    .name = "tok",
+    .description = "Set the tokenizer vocabulary file used to count tokens.",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = option_tok_validate,
+    .set_missing = set_missing_tok
+};
 static option_t option_emb = {
     .name = "emb",
     .description = "Generate embeddings for the input text.",
@@ -159,17 +232,56 @@ static option_t option_emb = {
     .value = NULL,
     .validate = option_emb_validate
 };
+static option_t option_exp = {
+    .name = "exp",
+    .description = "Export the context to the given file and exit. A name ending in \".ctx\" selects the binary format.",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = option_exp_validate
+};
+static option_t option_flu = {
+    .name = "flu",
+    .description = "Set when the response is written out as it streams in: token, line, full (when the output buffer fills) or a number of milliseconds.",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = option_flu_validate
+};
+static option_t option_frk = {
+    .name = "frk",
+    .description = "Fork the context into the given file and exit. The new context shares the current history with this one.",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = option_frk_validate
+};
+static option_t option_hdg = {
+    .name = "hdg",
+    .description = "Send a request that is slower than usual to start answering a second time, to the given host, or else the next host of a pool or another address of the same host, and use whichever answers first. Giving the request's own host only helps behind a load balancer.",
+    .arg_type = option_arg_optional,
+    .value = NULL,
+    .validate = option_hdg_validate
+};
 static option_t *common_options[] = {
     &option_buf,
     &option_aip,
     &option_aih,
+    &option_bat,
+    &option_bcn,
+    &option_cmp,
     &option_ctx,
     &option_emb,
+    &option_exp,
+    &option_flu,
+    &option_frk,
     &option_fun,
+    &option_hdg,
     &option_his,
     &option_mdl,
+    &option_pip,
     &option_qry,
+    &option_smk,
+    &option_smt,
     &option_sys,
+    &option_tok,
     &option_h,
     &option_r,
     &option_u,
@@ -179,6 +291,9 @@ static option_t *common_options[] = {
 static option_t **options = common_options;
 
 static int merge_api_options(void);
+static void set_cache_files(void);
+static int set_summary_threshold(option_t *option, json_object *settings_obj, const char *key);
+static int set_missing_summary_threshold(json_object *settings_obj, const char *key);
 
 int configure(json_object *actions_obj, json_object *settings_obj, int ac, char **av) {
     json_object *context_fn_obj = NULL;
@@ -187,19 +302,25 @@ int configure(json_object *actions_obj, json_object *settings_obj, int ac, char
         debug_return 1;
     }
     program_name = av[0];
+    file_set_dictionary(getenv(ENV_KEY_ZSTD_DICTIONARY));
     if (option_parse_args(options, ac, av, actions_obj, settings_obj) != 0) {
         debug("configure() option_parse_args() failed\n");
         debug_return 1;
     }
+    // When the prompt is to come from stdin, read it while the context loads.
+    // Nothing else touches stdin, so it's left alone otherwise.
+    if (action_reads_input(actions_obj, settings_obj)) {
+        input_start();
+    }
     if ((context_fn_obj = json_object_object_get(settings_obj, SETTING_KEY_CONTEXT_FILENAME)) == NULL) {
         debug("context filename not found\n");
         if (set_missing_ctx(NULL, actions_obj, settings_obj)) {
             debug("configure() set_missing_ctx() failed\n");
             debug_return 1;
         }
-    } else {
-        context_load(json_object_get_string(context_fn_obj));
-    }   
+    } else if (context_load(json_object_get_string(context_fn_obj)) && !option_r.present) {
+        debug_return 1;
+    }
     if (option_r.present) {
         debug("resetting context\n");
         if (context_fn_obj != NULL) {
@@ -209,6 +330,8 @@ int configure(json_object *actions_obj, json_object *settings_obj, int ac, char
         }
     }
     option_set_missing(options, actions_obj, settings_obj);
+    set_cache_files();
+    route_set_key(json_object_get_string(json_object_object_get(settings_obj, SETTING_KEY_CONTEXT_FILENAME)));
     debug("actions_obj = %s\n", json_object_to_json_string(actions_obj));
     if (context_set_ai_host(json_object_get_string(json_object_object_get(settings_obj, SETTING_KEY_AI_HOST)))) {
         debug_return 1;
@@ -353,7 +476,9 @@ static int set_missing_ctx(option_t *option, json_object *actions_obj, json_obje
     json_object_object_add(settings_obj, SETTING_KEY_CONTEXT_FILENAME, json_object_new_string(context_fn));
     result = 0;
 term:
-    context_load(context_fn);
+    if (context_load(context_fn) && !option_r.present) {
+        result = 1;
+    }
     if (context_fn != NULL) {
         free(context_fn);
     }
@@ -443,6 +568,79 @@ static int set_missing_sys(option_t *option, json_object *actions_obj, json_obje
     debug_return 0;
 }
 
+static int set_missing_smk(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    debug_return set_missing_summary_threshold(settings_obj, SETTING_KEY_SUMMARY_TOKENS);
+}
+
+static int set_missing_smt(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    debug_return set_missing_summary_threshold(settings_obj, SETTING_KEY_SUMMARY_TURNS);
+}
+
+static void set_cache_files(void) {
+    debug_enter();
+    const char *h = getenv("HOME");
+    char *fn = NULL;
+    size_t l = 0;
+    size_t d = 0;
+    if (h == NULL) {
+        debug_return;
+    }
+    l = strlen(h) + strlen(context_dir_default) + 1 + strlen(HTTP_CACHE_FILENAME) + strlen(RATELIMIT_FILENAME) + strlen(ROUTE_FILENAME) + 1;
+    fn = malloc(l);
+    if (fn == NULL) {
+        debug_return;
+    }
+    snprintf(fn, l, "%s%s", h, context_dir_default);
+    if (file_create_path(fn) == 0) {
+        d = strlen(fn);
+        snprintf(fn + d, l - d, "/%s", HTTP_CACHE_FILENAME);
+        debug("setting http cache filename to %s\n", fn);
+        http_set_cache(fn);
+        snprintf(fn + d, l - d, "/%s", RATELIMIT_FILENAME);
+        debug("setting rate limit filename to %s\n", fn);
+        ratelimit_set_file(fn);
+        snprintf(fn + d, l - d, "/%s", ROUTE_FILENAME);
+        debug("setting host pool filename to %s\n", fn);
+        route_set_file(fn);
+    }
+    free(fn);
+    debug_return;
+}
+
+static int set_missing_summary_threshold(json_object *settings_obj, const char *key) {
+    debug_enter();
+    json_object *value = NULL;
+    if (json_object_object_get_ex(settings_obj, key, &value)) {
+        debug("%s is set to %s\n", key, json_object_get_string(value));
+        context_set(key, value);
+        debug_return 0;
+    }
+    value = context_get(key);
+    if (value != NULL) {
+        debug("%s in context file is %s\n", key, json_object_get_string(value));
+        json_object_object_add(settings_obj, key, json_object_get(value));
+    }
+    debug_return 0;
+}
+
+static int set_missing_tok(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    json_object *value;
+    if (json_object_object_get_ex(settings_obj, SETTING_KEY_TOKENIZER, &value)) {
+        debug("tokenizer is set to %s\n", json_object_get_string(value));
+        debug_return 0;
+    }
+    const char *t = getenv(ENV_KEY_TOKENIZER);
+    if (t != NULL) {
+        debug("setting tokenizer to %s from environment variable %s\n", t, ENV_KEY_TOKENIZER);
+        json_object_object_add(settings_obj, SETTING_KEY_TOKENIZER, json_object_new_string(t));
+        tokenizer_set_file(t);
+    }
+    debug_return 0;
+}
+
 static int option_aih_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
     debug_enter();
     json_object_object_add(settings_obj, SETTING_KEY_AI_HOST, json_object_new_string(option->value));
@@ -466,9 +664,34 @@ static int option_aip_validate(option_t *option, json_object *actions_obj, json_
     debug_return 0;
 }
 
+static int option_bat_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    json_object_object_add(actions_obj, ACTION_KEY_BATCH, json_object_new_string(option->value));
+    debug_return 0;
+}
+
+static int option_bcn_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    char *end = NULL;
+    long n = strtol(option->value, &end, 10);
+    if (end == option->value || *end != '\0' || n < 1 || n > HTTP_POOL_SIZE) {
+        fprintf(stderr, "Error: option %s must be a number from 1 to %d\n", option->name, HTTP_POOL_SIZE);
+        debug_return 1;
+    }
+    json_object_object_add(settings_obj, SETTING_KEY_BATCH_CONCURRENCY, json_object_new_int(n));
+    debug_return 0;
+}
+
 static int option_buf_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
     debug_enter();
-    json_object_object_add(actions_obj, ACTION_KEY_BUFFERED, json_object_new_boolean(true));
+    json_object_object_add(settings_obj, SETTING_KEY_BUFFERED, json_object_new_boolean(true));
+    debug_return 0;
+}
+
+static int option_cmp_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    json_object_object_add(settings_obj, SETTING_KEY_COMPRESS, json_object_new_boolean(true));
+    http_set_compress(true);
     debug_return 0;
 }
 
@@ -484,6 +707,27 @@ static int option_emb_validate(option_t *option, json_object *actions_obj, json_
     debug_return 0;
 }
 
+static int option_exp_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    json_object_object_add(actions_obj, ACTION_KEY_EXPORT_CONTEXT, json_object_new_string(option->value));
+    debug_return 0;
+}
+
+static int option_flu_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    if (output_parse_flush(option->value)) {
+        debug_return 1;
+    }
+    json_object_object_add(settings_obj, SETTING_KEY_FLUSH, json_object_new_string(option->value));
+    debug_return 0;
+}
+
+static int option_frk_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    json_object_object_add(actions_obj, ACTION_KEY_FORK_CONTEXT, json_object_new_string(option->value));
+    debug_return 0;
+}
+
 static int option_fun_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
     debug_enter();
     json_object_object_add(actions_obj, ACTION_KEY_LOAD_FUNCTION_FILE, json_object_new_string(option->value));
@@ -491,9 +735,28 @@ static int option_fun_validate(option_t *option, json_object *actions_obj, json_
     debug_return 0;
 }
 
+static int option_hdg_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    if (option->value != NULL) {
+        json_object_object_add(settings_obj, SETTING_KEY_HEDGE, json_object_new_string(option->value));
+    } else {
+        json_object_object_add(settings_obj, SETTING_KEY_HEDGE, json_object_new_boolean(true));
+    }
+    http_set_hedge(true, option->value);
+    debug_return 0;
+}
+
 static int option_his_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
     debug_enter();
-    json_object_object_add(actions_obj, ACTION_KEY_DUMP_QUERY_HISTORY, json_object_new_boolean(true));
+    context_history_filter_t filter;
+    if (option->value != NULL && context_parse_history_filter(option->value, &filter)) {
+        debug_return 1;
+    }
+    if (option->value != NULL) {
+        json_object_object_add(actions_obj, ACTION_KEY_DUMP_QUERY_HISTORY, json_object_new_string(option->value));
+    } else {
+        json_object_object_add(actions_obj, ACTION_KEY_DUMP_QUERY_HISTORY, json_object_new_boolean(true));
+    }
     debug_return 0;
 }
 
@@ -508,6 +771,12 @@ static int option_mdl_validate(option_t *option, json_object *actions_obj, json_
     debug_return 0;
 }
 
+static int option_pip_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    json_object_object_add(settings_obj, SETTING_KEY_PIPE, json_object_new_boolean(true));
+    debug_return 0;
+}
+
 static int option_qry_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
     debug_enter();
     if (option->value != NULL) {
@@ -519,12 +788,29 @@ static int option_qry_validate(option_t *option, json_object *actions_obj, json_
     debug_return 0;
 }
 
+static int option_smk_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    debug_return set_summary_threshold(option, settings_obj, SETTING_KEY_SUMMARY_TOKENS);
+}
+
+static int option_smt_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    debug_return set_summary_threshold(option, settings_obj, SETTING_KEY_SUMMARY_TURNS);
+}
+
 static int option_sys_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
     debug_enter();
     json_object_object_add(settings_obj, SETTING_KEY_SYSTEM_PROMPT, json_object_new_string(option->value));
     debug_return 0;
 }
 
+static int option_tok_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    json_object_object_add(settings_obj, SETTING_KEY_TOKENIZER, json_object_new_string(option->value));
+    tokenizer_set_file(option->value);
+    debug_return 0;
+}
+
 static int option_h_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
     debug_enter();
     json_object_object_add(actions_obj, ACTION_KEY_HELP, json_object_new_int64((int64_t)options));
@@ -572,3 +858,15 @@ static int merge_api_options(void) {
     }
     debug_return 0;
 }
+
+static int set_summary_threshold(option_t *option, json_object *settings_obj, const char *key) {
+    debug_enter();
+    char *end = NULL;
+    long n = strtol(option->value, &end, 10);
+    if (end == option->value || *end != '\0' || n < 0 || n > INT32_MAX) {
+        fprintf(stderr, "Error: \"%s\" is not a valid count for option %s\n", option->value, option->name);
+        debug_return 1;
+    }
+    json_object_object_add(settings_obj, key, json_object_new_int(n));
+    debug_return 0;
+}
@@ -33,6 +33,8 @@ extern const char *program_name;
 #define ENV_KEY_AI_PROVIDER         "CHEWIE_AI_PROVIDER"
 #define ENV_KEY_CONTEXT_FILENAME    "CHEWIE_CONTEXT_FILENAME"
 #define ENV_KEY_MODEL               "CHEWIE_MODEL"
+#define ENV_KEY_TOKENIZER           "CHEWIE_TOKENIZER"
+#define ENV_KEY_ZSTD_DICTIONARY     "CHEWIE_ZSTD_DICTIONARY"
 
 /**
  * @brief Parse command line arguments into JSON object.
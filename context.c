@@ -8,8 +8,10 @@
  */
  
 #include <ctype.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -18,31 +20,241 @@
 #include "chewie.h"
 #include "context.h"
 #include "file.h"
+#include "scan.h"
+#include "tokenizer.h"
 
 /** @brief Strings used as context object keys */
 #define CONTEXT_KEY_PROMPT              "prompt"
+#define CONTEXT_KEY_PROMPT_TOKENS       "prompt-tokens"
 #define CONTEXT_KEY_AI_HOST             "ai-host"
 #define CONTEXT_KEY_AI_PROVIDER         "ai-provider"
 #define CONTEXT_KEY_MODEL               "model"
 #define CONTEXT_KEY_CONTEXT_FILENAME    "context-filename"
 #define CONTEXT_KEY_FUNCTION_FILENAME   "function-filename"
+#define CONTEXT_KEY_PARENT              "parent"
+#define CONTEXT_KEY_PARENT_FILE         "file"
+#define CONTEXT_KEY_PARENT_TURNS        "turns"
 #define CONTEXT_KEY_RESPONSE            "response"
+#define CONTEXT_KEY_RESPONSE_TOKENS     "response-tokens"
+#define CONTEXT_KEY_SUMMARY             "summary"
+#define CONTEXT_KEY_SUMMARY_END         "end"
+#define CONTEXT_KEY_SUMMARY_TEXT        "text"
 #define CONTEXT_KEY_HISTORY             "history"
 #define CONTEXT_KEY_TIMESTAMP           "timestamp"
 #define CONTEXT_KEY_SYSTEM_PROMPT       "system-prompt"
 
+/** @brief Strings used as journal record keys */
+#define JOURNAL_KEY_ADD                 "add"
+#define JOURNAL_KEY_BASE                "base"
+#define JOURNAL_KEY_DEL                 "del"
+#define JOURNAL_KEY_SET                 "set"
+#define JOURNAL_KEY_VALUE               "value"
+
+/** @brief Terms of a history filter that aren't plain ranges */
+#define HISTORY_FILTER_FROM             "from="
+#define HISTORY_FILTER_JSONL            "jsonl"
+#define HISTORY_FILTER_TO               "to="
+
+/** @brief Prefix of journal records that add a history entry. */
+#define JOURNAL_ADD_PREFIX              "{\"" JOURNAL_KEY_ADD "\":"
+
+/** @brief Suffix appended to the context filename to name its journal. */
+#define JOURNAL_SUFFIX                  ".journal"
+/** @brief Suffix of the lock file kept next to the context file. */
+#define LOCK_SUFFIX                     ".lock"
+/** @brief Suffix appended to the context filename to name its index. */
+#define INDEX_SUFFIX                    ".idx"
+/** @brief Magic number identifying a history index file. */
+#define INDEX_MAGIC                     "CIX2"
+/** @brief Suffix of context filenames that are stored in binary format. */
+#define BINARY_SUFFIX                   ".ctx"
+/** @brief Magic number identifying a binary context file. */
+#define BINARY_MAGIC                    "CHWB"
+/** @brief Version of the binary context file format. */
+#define BINARY_VERSION                  1
+/** @brief Binary record types. */
+#define BINARY_RECORD_HEADER            'H'
+#define BINARY_RECORD_ENTRY             'E'
+/** @brief Size of a binary record with the given payload length. */
+#define BINARY_RECORD_SIZE(len)         (sizeof(binary_record_t) + (((len) + 7) & ~(size_t)7))
+/** @brief Longest chain of parent contexts that will be followed. */
+#define FORK_DEPTH_MAX                  64
+
+/** @brief A file of a parent context that stays mapped while its entries are in use. */
+typedef struct parent_map_t {
+    const char *map;
+    size_t size;
+} parent_map_t;
+
+/** @brief Digest of a top-level context field, used to detect changes. */
+typedef struct field_digest_t {
+    char *key;
+    uint64_t digest;
+} field_digest_t;
+
+/** 
+ * @brief A history entry. Entries that come from the context file or the
+ * journal keep a pointer to their raw JSON text (or binary record) in the
+ * mapped file and are only decoded the first time they are accessed. Entries
+ * of the context file start out with no raw pointer; it is looked up in the
+ * index. Once decoded, prompt and response point either into obj or, for
+ * binary context files, straight into the mapped file. Token counts are -1
+ * until they are known. Entries inherited from a parent context point into
+ * the parent's mapped files, which may be in the other format, so they carry
+ * their own binary flag.
+ */
+typedef struct history_entry_t {
+    const char *raw;
+    size_t raw_len;
+    bool binary;
+    json_object *obj;
+    const char *prompt;
+    const char *response;
+    int64_t timestamp;
+    int prompt_tokens;
+    int response_tokens;
+} history_entry_t;
+
+/** 
+ * @brief Header of the history index file. The index stores the location of
+ * every history entry in the context file, so that loading a context doesn't
+ * have to scan or parse the history. It is only used if the size and
+ * modification time of the context file match the ones recorded here. The
+ * span is the history array of a JSON context file, or the payload of the
+ * newest header record of a binary context file. Garbage is the number of
+ * bytes taken up by older header records of a binary context file.
+ */
+typedef struct index_header_t {
+    char magic[4];
+    uint32_t count;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t span_start;
+    uint64_t span_end;
+    uint64_t garbage;
+} index_header_t;
+
+/** @brief Location of a history entry in the context file. */
+typedef struct index_entry_t {
+    uint64_t offset;
+    uint64_t len;
+} index_entry_t;
+
+/** @brief Header at the start of a binary context file. */
+typedef struct binary_file_header_t {
+    char magic[4];
+    uint32_t version;
+} binary_file_header_t;
+
+/** 
+ * @brief Header of a record in a binary context file. The payload follows,
+ * padded to a multiple of 8 bytes. A header record holds the top-level
+ * fields as JSON text; the newest one wins. An entry record holds a
+ * binary_entry_t followed by the prompt and the response.
+ */
+typedef struct binary_record_t {
+    uint32_t type;
+    uint32_t len;
+} binary_record_t;
+
+/** 
+ * @brief History entry in a binary context file. Both strings that follow it
+ * are NUL-terminated. Token counts are -1 if they weren't counted.
+ */
+typedef struct binary_entry_t {
+    int64_t timestamp;
+    uint32_t prompt_len;
+    uint32_t response_len;
+    int32_t prompt_tokens;
+    int32_t response_tokens;
+} binary_entry_t;
+
 const char context_dir_default[] = "/.cache/chewie";
 const char context_fn_default[] = "default-context.json";
 
 static const char *context_fn = NULL;
 static json_object *context_obj = NULL;
+static char *journal_fn = NULL;
+static char *index_fn = NULL;
+static char *lock_fn = NULL;
+static file_version_t snapshot_version;
+static file_version_t journal_version;
+static size_t journal_size = 0;
+static size_t snapshot_size = 0;
+static const char *snapshot_map = NULL;
+static size_t snapshot_map_size = 0;
+static const char *journal_map = NULL;
+static size_t journal_map_size = 0;
+static const char *index_map = NULL;
+static size_t index_map_size = 0;
+static char *index_buf = NULL;
+static index_header_t index_state;
+static const index_entry_t *index_entries = NULL;
+static int index_count = 0;
+static history_entry_t *history = NULL;
+static int history_len = 0;
+static int history_cap = 0;
+static int history_base = 0;
+static parent_map_t *parent_maps = NULL;
+static int parent_map_count = 0;
+static json_tokener *tokener = NULL;
+static int history_committed = 0;
+static bool compact_pending = false;
+static bool context_binary = false;
+static bool context_compressed = false;
+static bool context_reset = false;
+static field_digest_t *field_digests = NULL;
+static int field_digest_count = 0;
 
+static int add_entry(const char *raw, size_t raw_len, json_object *obj);
+static int add_index_entry(index_entry_t **entries, int *cap, index_header_t *header, uint64_t offset, uint64_t len);
+static int append_binary_entry(char **buf, size_t *len, const history_entry_t *entry);
+static int append_binary_header(char **buf, size_t *len);
+static int append_record(char **buf, size_t *len, json_object *record);
+static char *buf_extend(char **buf, size_t *len, size_t n);
+static char *build_binary_index(const char *buf, size_t len, size_t *index_len);
+static char *build_index(const char *buf, size_t len, size_t *index_len);
+static void commit(void);
+static void compact(void);
+static bool context_changed(void);
+static int decode_binary_entry(history_entry_t *entry, const char *raw, size_t raw_len);
+static uint64_t digest(const char *s);
+static bool fields_changed(void);
+static char *finish_index(const index_header_t *header, const index_entry_t *entries, size_t *index_len);
+static void free_field_digests(void);
+static void free_history(void);
+static history_entry_t *get_entry(int i);
+static json_object *get_entry_obj(int i);
+static const char *get_entry_raw(int i, size_t *len, bool *binary);
+static int64_t get_entry_timestamp(int i);
+static const field_digest_t *get_field_digest(const char *key);
+static char *get_sidecar_fn(const char *fn, const char *suffix);
+static int inherit_history(json_object *parent_obj, int depth);
+static int inherit_journal(const char *fn, int start, int turns);
+static bool index_is_valid(const char *index, size_t index_size, size_t size, int64_t mtime);
+static bool is_binary_fn(const char *fn);
+static int keep_parent_map(const char *map, size_t size);
+static int merge_changes(void);
+static json_object *parse_header(const char *map, size_t size, bool binary, const index_header_t *header);
+static json_object *parse_json(const char *s, size_t len);
+static int parse_time(const char *s, bool end, int64_t *t);
+static int read_context(void);
 static json_object *read_context_file(const char *fn);
-static int write_context_file(const char *fn, json_object *context_obj);
+static int read_index_file(const char *fn);
+static void read_journal_file(const char *fn);
+static void release_entry(int i);
+static void save_field_digests(void);
+static char *serialize_binary(size_t *len, int start);
+static void update_binary(void);
+static void write_compact_json(const char *s, size_t len);
+static int write_context_file(const char *fn, bool binary, int start);
+static int write_history_entry(int i, bool jsonl);
+static void write_index_file(const char *fn, char *index, size_t len, int64_t mtime);
+static void write_json_string(const char *s);
+static void write_summary(const char *summary, int end, bool jsonl);
 
 void context_add_history(const char *prompt, const char *response, const int64_t timestamp) {
     debug_enter();
-    json_object *history_obj = NULL;
     json_object *new_entry = NULL;
     json_object *prompt_obj = NULL;
     json_object *response_obj = NULL;
@@ -50,10 +262,6 @@ void context_add_history(const char *prompt, const char *response, const int64_t
     if (context_obj == NULL) {
         debug_return;
     }
-    if (!json_object_object_get_ex(context_obj, CONTEXT_KEY_HISTORY, &history_obj)) {
-        history_obj = json_object_new_array();
-        json_object_object_add(context_obj, CONTEXT_KEY_HISTORY, history_obj);
-    }
     if (prompt != NULL) {
         while (isspace(*prompt) && (*prompt != '\0')) prompt++;
         char *s = (char *)prompt + strlen(prompt) - 1;
@@ -74,9 +282,13 @@ void context_add_history(const char *prompt, const char *response, const int64_t
         json_object_object_add(new_entry, CONTEXT_KEY_TIMESTAMP, timestamp_obj);
         json_object_object_add(new_entry, CONTEXT_KEY_PROMPT, prompt_obj);
         json_object_object_add(new_entry, CONTEXT_KEY_RESPONSE, response_obj);
+        if (tokenizer_is_exact()) {
+            json_object_object_add(new_entry, CONTEXT_KEY_PROMPT_TOKENS, json_object_new_int(tokenizer_count(prompt)));
+            json_object_object_add(new_entry, CONTEXT_KEY_RESPONSE_TOKENS, json_object_new_int(tokenizer_count(response)));
+        }
     }
     if (new_entry != NULL) {
-        json_object_array_add(history_obj, new_entry);
+        add_entry(NULL, 0, new_entry);
     }
     debug_return;
 }
@@ -91,18 +303,18 @@ json_object *context_get(const char *field) {
     debug_return result;
 }
 
-void context_load(const char *fn) {
+int context_load(const char *fn) {
     debug_enter();
-    if (fn != NULL) {
-        context_fn = strdup(fn);
-        context_obj = read_context_file(fn);
-        if (context_obj != NULL) {
-            debug_return;
-        }
-    }
-    debug("creating new context_obj\n");
-    context_obj = json_object_new_object();
-    debug_return;
+    int lock = -1;
+    int result = 0;
+    free_history();
+    context_fn = fn != NULL ? strdup(fn) : NULL;
+    free(lock_fn);
+    lock_fn = get_sidecar_fn(fn, LOCK_SUFFIX);
+    lock = file_lock(lock_fn, false);
+    result = read_context();
+    file_unlock(lock);
+    debug_return result;
 }
 
 void context_new(const char *fn) {
@@ -113,6 +325,21 @@ void context_new(const char *fn) {
         json_object_put(context_obj);
     }
     context_obj = json_object_new_object();
+    free_history();
+    context_binary = is_binary_fn(fn);
+    journal_fn = get_sidecar_fn(fn, JOURNAL_SUFFIX);
+    index_fn = get_sidecar_fn(fn, INDEX_SUFFIX);
+    free(lock_fn);
+    lock_fn = get_sidecar_fn(fn, LOCK_SUFFIX);
+    compact_pending = true;
+    context_reset = true;
+    if (journal_fn != NULL) {
+        file_remove(journal_fn);
+    }
+    if (index_fn != NULL) {
+        file_remove(index_fn);
+    }
+    free_field_digests();
     debug_return;
 }
 
@@ -125,50 +352,47 @@ int context_delete_system_prompt(void) {
     debug_return 0;
 }
 
-int context_dump_history(void) {
+int context_dump_history(const context_history_filter_t *filter) {
     debug_enter();
+    const char *summary = NULL;
+    int summary_end = 0;
+    int start = filter->start;
+    int end = filter->end;
     int result = 1;
+    bool by_time = filter->from != INT64_MIN || filter->to != INT64_MAX;
     if (context_obj == NULL) {
         fprintf(stderr, "Error parsing context file\n");
         debug_return 1;
     }
-    json_object *history_obj = NULL;
-    json_object_object_get_ex(context_obj, CONTEXT_KEY_HISTORY, &history_obj);
-    if (history_obj == NULL) {
-        goto term;
-    }
-    int history_len = json_object_array_length(history_obj);
-    for (int i = 0; i < history_len; i++) {
-        json_object *query_obj = json_object_array_get_idx(history_obj, i);
-        json_object *prompt_obj = NULL;
-        json_object *response_obj = NULL;
-        json_object *timestamp_obj = NULL;
-        if (query_obj == NULL) {
-            fprintf(stderr, "Error getting history item\n");
-            goto term;
+    summary = context_get_summary();
+    summary_end = context_get_summary_end();
+    start = start < 0 ? (start < -history_len ? 0 : history_len + start) : (start > history_len ? history_len : start);
+    end = end < 0 ? (end < -history_len ? 0 : history_len + end) : (end > history_len ? history_len : end);
+    for (int i = start; i < end; i++) {
+        bool decoded = history[i].prompt != NULL;
+        if (i == summary_end && i > start && summary != NULL) {
+            write_summary(summary, summary_end, filter->jsonl);
         }
-        json_object_object_get_ex(query_obj, CONTEXT_KEY_PROMPT, &prompt_obj);
-        if (prompt_obj == NULL) {
-            fprintf(stderr, "Error getting prompt from history\n");
-            goto term;
+        if (by_time) {
+            int64_t ts = get_entry_timestamp(i);
+            if (ts < filter->from || ts > filter->to) {
+                continue;
+            }
         }
-        json_object_object_get_ex(query_obj, CONTEXT_KEY_RESPONSE, &response_obj);
-        if (response_obj == NULL) {
-            fprintf(stderr, "Error getting AI response from history\n");
+        if (write_history_entry(i, filter->jsonl)) {
+            fprintf(stderr, "Error getting history item\n");
             goto term;
         }
-        json_object_object_get_ex(query_obj, CONTEXT_KEY_TIMESTAMP, &timestamp_obj);
-        if (timestamp_obj == NULL) {
-            fprintf(stderr, "Error getting query timestamp from history\n");
-            goto term;
+        if (!decoded) {
+            release_entry(i);
         }
-        time_t ts = json_object_get_int64(timestamp_obj);
-        printf("%s", ctime(&ts));
-        printf("User: \"%s\"\n", json_object_get_string(prompt_obj));
-        printf("AI: %s\n\n", json_object_get_string(response_obj));
+    }
+    if (summary_end == end && end > start && summary != NULL) {
+        write_summary(summary, summary_end, filter->jsonl);
     }
     result = 0;
 term:
+    fflush(stdout);
     debug_return result;
 }
 
@@ -256,34 +480,228 @@ term:
     debug_return result;
 }
 
-json_object *context_get_history(void) {
+const char *context_get_summary(void) {
     debug_enter();
-    json_object *history_obj = NULL;
+    json_object *summary_obj = NULL;
+    json_object *text_obj = NULL;
     if (context_obj == NULL) {
-        debug("No context object\n");
         debug_return NULL;
     }
-    if (!json_object_object_get_ex(context_obj, CONTEXT_KEY_HISTORY, &history_obj)) {
-        debug("No history object\n");
+    if (!json_object_object_get_ex(context_obj, CONTEXT_KEY_SUMMARY, &summary_obj)) {
+        debug_return NULL;
+    }
+    if (!json_object_object_get_ex(summary_obj, CONTEXT_KEY_SUMMARY_TEXT, &text_obj)) {
+        debug_return NULL;
+    }
+    debug_return json_object_get_string(text_obj);
+}
+
+int context_get_summary_end(void) {
+    debug_enter();
+    json_object *summary_obj = NULL;
+    json_object *end_obj = NULL;
+    int end = 0;
+    if (context_obj == NULL) {
+        debug_return 0;
+    }
+    if (!json_object_object_get_ex(context_obj, CONTEXT_KEY_SUMMARY, &summary_obj)) {
+        debug_return 0;
+    }
+    if (json_object_object_get_ex(summary_obj, CONTEXT_KEY_SUMMARY_END, &end_obj)) {
+        end = json_object_get_int(end_obj);
+    }
+    if (end < 0) {
+        end = 0;
+    }
+    if (end > history_len) {
+        end = history_len;
+    }
+    debug_return end;
+}
+
+char *context_get_transcript(int start, int end) {
+    debug_enter();
+    size_t l = 1;
+    char *s = NULL;
+    char *p = NULL;
+    if (start < 0) {
+        start = 0;
+    }
+    if (end > history_len) {
+        end = history_len;
+    }
+    for (int i = start; i < end; i++) {
+        const history_entry_t *entry = get_entry(i);
+        if (entry == NULL) {
+            fprintf(stderr, "Error getting history item\n");
+            debug_return NULL;
+        }
+        l += sizeof("User: \nAI: \n\n") + strlen(entry->prompt) + strlen(entry->response);
+    }
+    s = malloc(l);
+    if (s == NULL) {
+        fprintf(stderr, "Error allocating memory for transcript\n");
         debug_return NULL;
     }
-    debug("history_obj: %s\n", json_object_to_json_string_ext(history_obj, JSON_C_TO_STRING_PRETTY));
-    debug_return history_obj;
+    p = s;
+    *p = '\0';
+    for (int i = start; i < end; i++) {
+        const history_entry_t *entry = get_entry(i);
+        p += sprintf(p, "User: %s\nAI: %s\n\n", entry->prompt, entry->response);
+    }
+    debug_return s;
+}
+
+int context_get_history_length(void) {
+    debug_enter();
+    debug_return history_len;
+}
+
+const char *context_get_history_prompt(int i) {
+    debug_enter();
+    const history_entry_t *entry = get_entry(i);
+    debug_return entry != NULL ? entry->prompt : NULL;
+}
+
+const char *context_get_history_response(int i) {
+    debug_enter();
+    const history_entry_t *entry = get_entry(i);
+    debug_return entry != NULL ? entry->response : NULL;
+}
+
+int context_get_history_tokens(int i) {
+    debug_enter();
+    history_entry_t *entry = get_entry(i);
+    if (entry == NULL) {
+        debug_return 0;
+    }
+    if (entry->prompt_tokens < 0) {
+        entry->prompt_tokens = tokenizer_count(entry->prompt);
+    }
+    if (entry->response_tokens < 0) {
+        entry->response_tokens = tokenizer_count(entry->response);
+    }
+    debug_return entry->prompt_tokens + entry->response_tokens;
+}
+
+int64_t context_get_history_timestamp(int i) {
+    debug_enter();
+    const history_entry_t *entry = get_entry(i);
+    debug_return entry != NULL ? entry->timestamp : 0;
 }
 
-const char *context_get_history_prompt(json_object *entry) {
+int context_export(const char *fn) {
     debug_enter();
-    debug_return json_object_get_string(json_object_object_get(entry, CONTEXT_KEY_PROMPT));
+    if (context_obj == NULL || fn == NULL) {
+        fprintf(stderr, "No context to export\n");
+        debug_return 1;
+    }
+    debug("exporting context to \"%s\"\n", fn);
+    debug_return write_context_file(fn, is_binary_fn(fn), 0);
 }
 
-const char *context_get_history_response(json_object *entry) {
+int context_fork(const char *fn) {
     debug_enter();
-    debug_return json_object_get_string(json_object_object_get(entry, CONTEXT_KEY_RESPONSE));
+    json_object *parent_obj = NULL;
+    json_object *old_parent_obj = NULL;
+    char *parent_fn = NULL;
+    char *child_fn = NULL;
+    char *child_journal_fn = NULL;
+    int result = 1;
+    if (context_obj == NULL || context_fn == NULL || fn == NULL) {
+        fprintf(stderr, "No context to fork\n");
+        debug_return 1;
+    }
+    context_update();
+    parent_fn = realpath(context_fn, NULL);
+    if (parent_fn == NULL) {
+        fprintf(stderr, "Unable to find context file \"%s\"\n", context_fn);
+        goto term;
+    }
+    child_fn = realpath(fn, NULL);
+    if (child_fn != NULL && strcmp(child_fn, parent_fn) == 0) {
+        fprintf(stderr, "Can't fork context \"%s\" onto itself\n", fn);
+        goto term;
+    }
+    parent_obj = json_object_new_object();
+    if (parent_obj == NULL) {
+        fprintf(stderr, "Error creating parent context object\n");
+        goto term;
+    }
+    json_object_object_add(parent_obj, CONTEXT_KEY_PARENT_FILE, json_object_new_string(parent_fn));
+    json_object_object_add(parent_obj, CONTEXT_KEY_PARENT_TURNS, json_object_new_int(history_len));
+    if (json_object_object_get_ex(context_obj, CONTEXT_KEY_PARENT, &old_parent_obj)) {
+        json_object_get(old_parent_obj);
+    }
+    json_object_object_add(context_obj, CONTEXT_KEY_PARENT, parent_obj);
+    debug("forking context \"%s\" at %d entries to \"%s\"\n", parent_fn, history_len, fn);
+    if ((child_journal_fn = get_sidecar_fn(fn, JOURNAL_SUFFIX)) != NULL) {
+        file_remove(child_journal_fn);
+    }
+    result = write_context_file(fn, is_binary_fn(fn), history_len);
+    if (old_parent_obj != NULL) {
+        json_object_object_add(context_obj, CONTEXT_KEY_PARENT, old_parent_obj);
+    } else {
+        json_object_object_del(context_obj, CONTEXT_KEY_PARENT);
+    }
+term:
+    free(child_journal_fn);
+    free(child_fn);
+    free(parent_fn);
+    debug_return result;
 }
 
-int64_t context_get_history_timestamp(json_object *entry) {
+int context_parse_history_filter(const char *s, context_history_filter_t *filter) {
     debug_enter();
-    debug_return json_object_get_int64(json_object_object_get(entry, CONTEXT_KEY_TIMESTAMP));
+    char term[64];
+    filter->start = 0;
+    filter->end = INT_MAX;
+    filter->from = INT64_MIN;
+    filter->to = INT64_MAX;
+    filter->jsonl = false;
+    while (s != NULL && *s != '\0') {
+        const char *next = strchr(s, ',');
+        size_t len = next != NULL ? (size_t)(next - s) : strlen(s);
+        char *colon = NULL;
+        char *e = NULL;
+        if (len >= sizeof(term)) {
+            len = sizeof(term) - 1;
+        }
+        memcpy(term, s, len);
+        term[len] = '\0';
+        s = next != NULL ? next + 1 : NULL;
+        if (strcmp(term, HISTORY_FILTER_JSONL) == 0) {
+            filter->jsonl = true;
+        } else if (strncmp(term, HISTORY_FILTER_FROM, sizeof(HISTORY_FILTER_FROM) - 1) == 0) {
+            if (parse_time(term + sizeof(HISTORY_FILTER_FROM) - 1, false, &filter->from)) {
+                goto err;
+            }
+        } else if (strncmp(term, HISTORY_FILTER_TO, sizeof(HISTORY_FILTER_TO) - 1) == 0) {
+            if (parse_time(term + sizeof(HISTORY_FILTER_TO) - 1, true, &filter->to)) {
+                goto err;
+            }
+        } else if ((colon = strchr(term, ':')) != NULL) {
+            filter->start = colon == term ? 0 : (int)strtol(term, &e, 10);
+            if (colon != term && e != colon) {
+                goto err;
+            }
+            filter->end = colon[1] == '\0' ? INT_MAX : (int)strtol(colon + 1, &e, 10);
+            if (colon[1] != '\0' && *e != '\0') {
+                goto err;
+            }
+        } else {
+            long n = strtol(term, &e, 10);
+            if (e == term || *e != '\0' || n < 0 || n > INT_MAX) {
+                goto err;
+            }
+            filter->start = n > 0 ? (int)-n : 0;
+            filter->end = n > 0 ? INT_MAX : 0;
+        }
+    }
+    debug_return 0;
+err:
+    fprintf(stderr, "Invalid history range \"%s\"\n", term);
+    debug_return 1;
 }
 
 int context_set(const char *field, json_object *obj) {
@@ -366,6 +784,22 @@ term:
     debug_return result;
 }
 
+int context_set_summary(const char *s, int end) {
+    debug_enter();
+    json_object *summary_obj = NULL;
+    if (context_obj == NULL || s == NULL || end < 0 || end > history_len) {
+        debug_return 1;
+    }
+    summary_obj = json_object_new_object();
+    if (summary_obj == NULL) {
+        debug_return 1;
+    }
+    json_object_object_add(summary_obj, CONTEXT_KEY_SUMMARY_TEXT, json_object_new_string(s));
+    json_object_object_add(summary_obj, CONTEXT_KEY_SUMMARY_END, json_object_new_int(end));
+    json_object_object_add(context_obj, CONTEXT_KEY_SUMMARY, summary_obj);
+    debug_return 0;
+}
+
 int context_set_system_prompt(const char *s) {
     debug_enter();
     if (s == NULL) {
@@ -385,54 +819,1376 @@ int context_set_system_prompt(const char *s) {
 
 void context_update(void) {
     debug_enter();
-    debug("writing context file \"%s\"\n", context_fn);
-    const char *s = json_object_to_json_string_ext(context_obj, JSON_C_TO_STRING_PRETTY);
-    file_write(context_fn, s);
+    int lock = -1;
+    if (context_obj == NULL || context_fn == NULL) {
+        debug_return;
+    }
+    lock = file_lock(lock_fn, true);
+    if (!context_reset && context_changed()) {
+        if (history_committed == history_len && !fields_changed()) {
+            debug("context file \"%s\" changed since it was loaded, nothing to add\n", context_fn);
+            goto term;
+        }
+        if (merge_changes()) {
+            fprintf(stderr, "Context file \"%s\" not updated\n", context_fn);
+            goto term;
+        }
+    }
+    commit();
+    context_reset = false;
+    file_get_version(context_fn, &snapshot_version);
+    file_get_version(journal_fn, &journal_version);
+term:
+    file_unlock(lock);
     debug_return;
 }
 
-json_object *read_context_file(const char *fn) {
+static int add_entry(const char *raw, size_t raw_len, json_object *obj) {
     debug_enter();
-    const char *context = NULL;
-    json_tokener *json = NULL;
-    if (fn == NULL) {
-        fprintf(stderr, "No context filename\n");
-        debug_return NULL;
+    if (history_len == history_cap) {
+        int cap = history_cap == 0 ? 64 : history_cap * 2;
+        history_entry_t *h = realloc(history, cap * sizeof(history_entry_t));
+        if (h == NULL) {
+            fprintf(stderr, "Error allocating memory for context history\n");
+            debug_return 1;
+        }
+        history = h;
+        history_cap = cap;
     }
-    context = file_read(fn);
-    if (context == NULL) {
-        debug_return NULL;
+    memset(&history[history_len], 0, sizeof(history_entry_t));
+    history[history_len].raw = raw;
+    history[history_len].raw_len = raw_len;
+    history[history_len].obj = obj;
+    history_len++;
+    debug_return 0;
+}
+
+static int add_index_entry(index_entry_t **entries, int *cap, index_header_t *header, uint64_t offset, uint64_t len) {
+    debug_enter();
+    if ((int)header->count == *cap) {
+        int c = *cap == 0 ? 64 : *cap * 2;
+        index_entry_t *e = realloc(*entries, c * sizeof(index_entry_t));
+        if (e == NULL) {
+            fprintf(stderr, "Error allocating memory for context index\n");
+            debug_return 1;
+        }
+        *entries = e;
+        *cap = c;
+    }
+    (*entries)[header->count].offset = offset;
+    (*entries)[header->count].len = len;
+    header->count++;
+    debug_return 0;
+}
+
+static int append_binary_entry(char **buf, size_t *len, const history_entry_t *entry) {
+    debug_enter();
+    binary_record_t record;
+    binary_entry_t e;
+    size_t prompt_len = strlen(entry->prompt);
+    size_t response_len = strlen(entry->response);
+    char *p = NULL;
+    if (prompt_len > UINT32_MAX / 2 || response_len > UINT32_MAX / 2) {
+        fprintf(stderr, "History entry too large for binary context file\n");
+        debug_return 1;
+    }
+    record.type = BINARY_RECORD_ENTRY;
+    record.len = sizeof(e) + prompt_len + response_len + 2;
+    e.timestamp = entry->timestamp;
+    e.prompt_len = prompt_len;
+    e.response_len = response_len;
+    e.prompt_tokens = entry->prompt_tokens;
+    e.response_tokens = entry->response_tokens;
+    if ((p = buf_extend(buf, len, BINARY_RECORD_SIZE(record.len))) == NULL) {
+        debug_return 1;
+    }
+    memcpy(p, &record, sizeof(record));
+    p += sizeof(record);
+    memcpy(p, &e, sizeof(e));
+    p += sizeof(e);
+    memcpy(p, entry->prompt, prompt_len);
+    memcpy(p + prompt_len + 1, entry->response, response_len);
+    debug_return 0;
+}
+
+static int append_binary_header(char **buf, size_t *len) {
+    debug_enter();
+    binary_record_t record;
+    const char *s = json_object_to_json_string_ext(context_obj, JSON_C_TO_STRING_PLAIN);
+    size_t l = strlen(s);
+    char *p = NULL;
+    if (l > UINT32_MAX / 2) {
+        fprintf(stderr, "Context too large for binary context file\n");
+        debug_return 1;
+    }
+    record.type = BINARY_RECORD_HEADER;
+    record.len = l;
+    if ((p = buf_extend(buf, len, BINARY_RECORD_SIZE(l))) == NULL) {
+        debug_return 1;
+    }
+    memcpy(p, &record, sizeof(record));
+    memcpy(p + sizeof(record), s, l);
+    debug_return 0;
+}
+
+static int append_record(char **buf, size_t *len, json_object *record) {
+    debug_enter();
+    if (record == NULL) {
+        fprintf(stderr, "Error creating context journal record\n");
+        debug_return 1;
+    }
+    const char *s = json_object_to_json_string_ext(record, JSON_C_TO_STRING_PLAIN);
+    size_t l = strlen(s);
+    char *p = buf_extend(buf, len, l + 1);
+    if (p != NULL) {
+        memcpy(p, s, l);
+        p[l] = '\n';
+    }
+    json_object_put(record);
+    debug_return p == NULL ? 1 : 0;
+}
+
+static void commit(void) {
+    debug_enter();
+    json_object *record = NULL;
+    char *buf = NULL;
+    size_t len = 0;
+    int records = 0;
+    if (context_binary) {
+        update_binary();
+        debug_return;
+    }
+    if (journal_fn == NULL || compact_pending || journal_size > snapshot_size) {
+        compact();
+        debug_return;
     }
-    json = json_tokener_new();
-    if (json == NULL) {
+    if (journal_size == 0) {
+        record = json_object_new_object();
+        json_object_object_add(record, JOURNAL_KEY_BASE, json_object_new_int(history_committed));
+        if (append_record(&buf, &len, record)) {
+            goto term;
+        }
+    }
+    json_object_object_foreach(context_obj, key, val) {
+        const field_digest_t *fd = get_field_digest(key);
+        if (fd != NULL && fd->digest == digest(json_object_to_json_string_ext(val, JSON_C_TO_STRING_PLAIN))) {
+            continue;
+        }
+        record = json_object_new_object();
+        json_object_object_add(record, JOURNAL_KEY_SET, json_object_new_string(key));
+        json_object_object_add(record, JOURNAL_KEY_VALUE, json_object_get(val));
+        if (append_record(&buf, &len, record)) {
+            goto term;
+        }
+        records++;
+    }
+    for (int i = 0; i < field_digest_count; i++) {
+        if (!json_object_object_get_ex(context_obj, field_digests[i].key, NULL)) {
+            record = json_object_new_object();
+            json_object_object_add(record, JOURNAL_KEY_DEL, json_object_new_string(field_digests[i].key));
+            if (append_record(&buf, &len, record)) {
+                goto term;
+            }
+            records++;
+        }
+    }
+    for (int i = history_committed; i < history_len; i++) {
+        record = json_object_new_object();
+        json_object_object_add(record, JOURNAL_KEY_ADD, json_object_get(get_entry_obj(i)));
+        if (append_record(&buf, &len, record)) {
+            goto term;
+        }
+        records++;
+    }
+    if (records == 0) {
+        debug("context file \"%s\" is up to date\n", context_fn);
         goto term;
     }
-    context_obj = json_tokener_parse_ex(json, context, strlen(context));
+    debug("appending %zu bytes to journal \"%s\"\n", len, journal_fn);
+    if (file_append(journal_fn, buf)) {
+        goto term;
+    }
+    journal_size += len;
+    history_committed = history_len;
+    save_field_digests();
 term:
-    if (context != NULL) {
-        free((void *)context);
+    if (buf != NULL) {
+        free(buf);
     }
-    if (json != NULL) {
-        json_tokener_free(json);
+    debug_return;
+}
+
+static bool context_changed(void) {
+    debug_enter();
+    file_version_t version;
+    file_get_version(context_fn, &version);
+    if (memcmp(&version, &snapshot_version, sizeof(version)) != 0) {
+        debug_return true;
     }
-    debug_return context_obj;
+    file_get_version(journal_fn, &version);
+    debug_return memcmp(&version, &journal_version, sizeof(version)) != 0;
 }
 
-static int write_context_file(const char *fn, json_object *context_obj) {
+static void compact(void) {
     debug_enter();
-    if (fn == NULL) {
-        fprintf(stderr, "No context filename\n");
-        debug_return 1;
+    debug("compacting context file \"%s\"\n", context_fn);
+    if (write_context_file(context_fn, context_binary, history_base)) {
+        debug_return;
     }
-    if (context_obj == NULL) {
-        fprintf(stderr, "No context object\n");
-        debug_return 1;
+    if (journal_fn != NULL) {
+        file_remove(journal_fn);
     }
-    const char *context_json = json_object_to_json_string_ext(context_obj, JSON_C_TO_STRING_PRETTY);
-    if (context_json == NULL) {
-        fprintf(stderr, "Error converting context object to JSON string\n");
+    journal_size = 0;
+    compact_pending = false;
+    history_committed = history_len;
+    save_field_digests();
+    debug_return;
+}
+
+static int decode_binary_entry(history_entry_t *entry, const char *raw, size_t raw_len) {
+    debug_enter();
+    const binary_record_t *record = (const binary_record_t *)raw;
+    const binary_entry_t *e = (const binary_entry_t *)(raw + sizeof(binary_record_t));
+    const char *s = (const char *)(e + 1);
+    if (raw_len < sizeof(binary_record_t) + sizeof(binary_entry_t) ||
+        record->type != BINARY_RECORD_ENTRY ||
+        record->len > raw_len - sizeof(binary_record_t) ||
+        sizeof(binary_entry_t) + (size_t)e->prompt_len + e->response_len + 2 > record->len ||
+        s[e->prompt_len] != '\0' ||
+        s[e->prompt_len + 1 + e->response_len] != '\0') {
         debug_return 1;
     }
-    file_write(fn, context_json);
+    entry->timestamp = e->timestamp;
+    entry->prompt = s;
+    entry->response = s + e->prompt_len + 1;
+    entry->prompt_tokens = e->prompt_tokens;
+    entry->response_tokens = e->response_tokens;
     debug_return 0;
 }
+
+static uint64_t digest(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s != '\0') {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static bool fields_changed(void) {
+    debug_enter();
+    json_object_object_foreach(context_obj, key, val) {
+        const field_digest_t *fd = get_field_digest(key);
+        if (fd == NULL || fd->digest != digest(json_object_to_json_string_ext(val, JSON_C_TO_STRING_PLAIN))) {
+            debug_return true;
+        }
+    }
+    for (int i = 0; i < field_digest_count; i++) {
+        if (!json_object_object_get_ex(context_obj, field_digests[i].key, NULL)) {
+            debug_return true;
+        }
+    }
+    debug_return false;
+}
+
+static void free_history(void) {
+    debug_enter();
+    for (int i = 0; i < history_len; i++) {
+        if (history[i].obj != NULL) {
+            json_object_put(history[i].obj);
+        }
+    }
+    free(history);
+    history = NULL;
+    history_len = 0;
+    history_cap = 0;
+    history_committed = 0;
+    history_base = 0;
+    for (int i = 0; i < parent_map_count; i++) {
+        file_unmap(parent_maps[i].map, parent_maps[i].size);
+    }
+    free(parent_maps);
+    parent_maps = NULL;
+    parent_map_count = 0;
+    file_unmap(snapshot_map, snapshot_map_size);
+    snapshot_map = NULL;
+    snapshot_map_size = 0;
+    file_unmap(journal_map, journal_map_size);
+    journal_map = NULL;
+    journal_map_size = 0;
+    file_unmap(index_map, index_map_size);
+    index_map = NULL;
+    index_map_size = 0;
+    free(index_buf);
+    index_buf = NULL;
+    memset(&index_state, 0, sizeof(index_state));
+    index_entries = NULL;
+    index_count = 0;
+    free(journal_fn);
+    journal_fn = NULL;
+    free(index_fn);
+    index_fn = NULL;
+    journal_size = 0;
+    snapshot_size = 0;
+    compact_pending = false;
+    context_compressed = false;
+    debug_return;
+}
+
+static history_entry_t *get_entry(int i) {
+    debug_enter();
+    history_entry_t *entry = NULL;
+    if (i < 0 || i >= history_len) {
+        debug_return NULL;
+    }
+    entry = &history[i];
+    if (entry->prompt != NULL) {
+        debug_return entry;
+    }
+    if (entry->obj == NULL) {
+        size_t raw_len = 0;
+        bool binary = false;
+        const char *raw = get_entry_raw(i, &raw_len, &binary);
+        if (raw != NULL && binary) {
+            if (decode_binary_entry(entry, raw, raw_len) == 0) {
+                debug_return entry;
+            }
+        } else if (raw != NULL) {
+            entry->obj = parse_json(raw, raw_len);
+        }
+    }
+    if (entry->obj != NULL) {
+        json_object *tokens_obj = NULL;
+        entry->prompt = json_object_get_string(json_object_object_get(entry->obj, CONTEXT_KEY_PROMPT));
+        entry->response = json_object_get_string(json_object_object_get(entry->obj, CONTEXT_KEY_RESPONSE));
+        entry->timestamp = json_object_get_int64(json_object_object_get(entry->obj, CONTEXT_KEY_TIMESTAMP));
+        entry->prompt_tokens = json_object_object_get_ex(entry->obj, CONTEXT_KEY_PROMPT_TOKENS, &tokens_obj) ? json_object_get_int(tokens_obj) : -1;
+        entry->response_tokens = json_object_object_get_ex(entry->obj, CONTEXT_KEY_RESPONSE_TOKENS, &tokens_obj) ? json_object_get_int(tokens_obj) : -1;
+    }
+    if (entry->prompt == NULL || entry->response == NULL) {
+        fprintf(stderr, "Error parsing history entry %d\n", i);
+        entry->prompt = NULL;
+        debug_return NULL;
+    }
+    debug_return entry;
+}
+
+static const char *get_entry_raw(int i, size_t *len, bool *binary) {
+    debug_enter();
+    const history_entry_t *entry = &history[i];
+    int j = i - history_base;
+    *binary = i < history_base ? entry->binary : context_binary;
+    if (entry->raw != NULL) {
+        *len = entry->raw_len;
+        debug_return entry->raw;
+    }
+    if (j >= 0 && j < index_count && index_entries[j].offset + index_entries[j].len <= snapshot_map_size) {
+        *len = index_entries[j].len;
+        debug_return snapshot_map + index_entries[j].offset;
+    }
+    debug_return NULL;
+}
+
+static int64_t get_entry_timestamp(int i) {
+    debug_enter();
+    const history_entry_t *entry = &history[i];
+    const char *raw = NULL;
+    const char *end = NULL;
+    const char *p = NULL;
+    size_t raw_len = 0;
+    bool binary = false;
+    if (entry->prompt != NULL || entry->obj != NULL || (raw = get_entry_raw(i, &raw_len, &binary)) == NULL) {
+        entry = get_entry(i);
+        debug_return entry != NULL ? entry->timestamp : 0;
+    }
+    if (binary) {
+        if (raw_len < sizeof(binary_record_t) + sizeof(binary_entry_t)) {
+            debug_return 0;
+        }
+        debug_return ((const binary_entry_t *)(raw + sizeof(binary_record_t)))->timestamp;
+    }
+    p = scan_member(raw, raw + raw_len, CONTEXT_KEY_TIMESTAMP, &end);
+    debug_return p != NULL ? strtoll(p, NULL, 10) : 0;
+}
+
+static json_object *get_entry_obj(int i) {
+    debug_enter();
+    history_entry_t *entry = get_entry(i);
+    if (entry == NULL) {
+        debug_return NULL;
+    }
+    if (entry->obj == NULL) {
+        entry->obj = json_object_new_object();
+        if (entry->obj == NULL) {
+            fprintf(stderr, "Error creating history entry %d\n", i);
+            debug_return NULL;
+        }
+        json_object_object_add(entry->obj, CONTEXT_KEY_TIMESTAMP, json_object_new_int64(entry->timestamp));
+        json_object_object_add(entry->obj, CONTEXT_KEY_PROMPT, json_object_new_string(entry->prompt));
+        json_object_object_add(entry->obj, CONTEXT_KEY_RESPONSE, json_object_new_string(entry->response));
+        if (entry->prompt_tokens >= 0 && entry->response_tokens >= 0) {
+            json_object_object_add(entry->obj, CONTEXT_KEY_PROMPT_TOKENS, json_object_new_int(entry->prompt_tokens));
+            json_object_object_add(entry->obj, CONTEXT_KEY_RESPONSE_TOKENS, json_object_new_int(entry->response_tokens));
+        }
+    }
+    debug_return entry->obj;
+}
+
+static void free_field_digests(void) {
+    debug_enter();
+    for (int i = 0; i < field_digest_count; i++) {
+        free(field_digests[i].key);
+    }
+    free(field_digests);
+    field_digests = NULL;
+    field_digest_count = 0;
+    debug_return;
+}
+
+static const field_digest_t *get_field_digest(const char *key) {
+    debug_enter();
+    for (int i = 0; i < field_digest_count; i++) {
+        if (strcmp(field_digests[i].key, key) == 0) {
+            debug_return &field_digests[i];
+        }
+    }
+    debug_return NULL;
+}
+
+
+static char *get_sidecar_fn(const char *fn, const char *suffix) {
+    debug_enter();
+    if (fn == NULL) {
+        debug_return NULL;
+    }
+    size_t l = strlen(fn) + strlen(suffix) + 1;
+    char *s = malloc(l);
+    if (s == NULL) {
+        fprintf(stderr, "Error allocating memory for context filename\n");
+        debug_return NULL;
+    }
+    strcpy(s, fn);
+    strcat(s, suffix);
+    debug_return s;
+}
+
+static int inherit_history(json_object *parent_obj, int depth) {
+    debug_enter();
+    json_object *obj = NULL;
+    json_object *field_obj = NULL;
+    const index_header_t *header = NULL;
+    const index_entry_t *entries = NULL;
+    const char *fn = NULL;
+    const char *map = NULL;
+    const char *index = NULL;
+    char *built_index = NULL;
+    char *sidecar_fn = NULL;
+    size_t map_size = 0;
+    size_t index_size = 0;
+    int start = history_len;
+    int turns = -1;
+    int result = 1;
+    bool binary = false;
+    if (json_object_object_get_ex(parent_obj, CONTEXT_KEY_PARENT_FILE, &field_obj)) {
+        fn = json_object_get_string(field_obj);
+    }
+    if (json_object_object_get_ex(parent_obj, CONTEXT_KEY_PARENT_TURNS, &field_obj)) {
+        turns = json_object_get_int(field_obj);
+    }
+    if (fn == NULL || turns < 0) {
+        fprintf(stderr, "Invalid parent context\n");
+        debug_return 1;
+    }
+    if (depth >= FORK_DEPTH_MAX) {
+        fprintf(stderr, "Parent contexts nested too deeply at \"%s\"\n", fn);
+        debug_return 1;
+    }
+    if (turns == 0) {
+        debug_return 0;
+    }
+    debug("inheriting %d entries from parent context \"%s\"\n", turns, fn);
+    map = file_map(fn, &map_size);
+    if (map == NULL || keep_parent_map(map, map_size)) {
+        fprintf(stderr, "Error loading parent context \"%s\"\n", fn);
+        debug_return 1;
+    }
+    binary = map_size >= sizeof(binary_file_header_t) && memcmp(map, BINARY_MAGIC, sizeof(BINARY_MAGIC) - 1) == 0;
+    sidecar_fn = get_sidecar_fn(fn, INDEX_SUFFIX);
+    if (sidecar_fn != NULL && (index = file_map(sidecar_fn, &index_size)) != NULL &&
+        !index_is_valid(index, index_size, map_size, file_get_mtime(fn))) {
+        file_unmap(index, index_size);
+        index = NULL;
+    }
+    if (index == NULL) {
+        index = built_index = binary ? build_binary_index(map, map_size, &index_size) : build_index(map, map_size, &index_size);
+    }
+    if (index == NULL || (obj = parse_header(map, map_size, binary, (const index_header_t *)index)) == NULL) {
+        fprintf(stderr, "Error parsing parent context \"%s\"\n", fn);
+        goto term;
+    }
+    if (json_object_object_get_ex(obj, CONTEXT_KEY_PARENT, &field_obj) && inherit_history(field_obj, depth + 1)) {
+        goto term;
+    }
+    header = (const index_header_t *)index;
+    entries = (const index_entry_t *)(index + sizeof(index_header_t));
+    for (uint32_t i = 0; i < header->count && history_len - start < turns; i++) {
+        if (entries[i].offset + entries[i].len > map_size || add_entry(map + entries[i].offset, entries[i].len, NULL)) {
+            goto term;
+        }
+        history[history_len - 1].binary = binary;
+    }
+    if (!binary && history_len - start < turns && inherit_journal(fn, start, turns)) {
+        goto term;
+    }
+    if (history_len - start < turns) {
+        fprintf(stderr, "Parent context \"%s\" has fewer than %d history entries\n", fn, turns);
+        goto term;
+    }
+    result = 0;
+term:
+    if (obj != NULL) {
+        json_object_put(obj);
+    }
+    if (built_index != NULL) {
+        free(built_index);
+    } else if (index != NULL) {
+        file_unmap(index, index_size);
+    }
+    free(sidecar_fn);
+    debug_return result;
+}
+
+static int inherit_journal(const char *fn, int start, int turns) {
+    debug_enter();
+    json_object *record = NULL;
+    json_object *field_obj = NULL;
+    char *sidecar_fn = get_sidecar_fn(fn, JOURNAL_SUFFIX);
+    const char *map = NULL;
+    const char *line = NULL;
+    const char *eol = NULL;
+    const char *end = NULL;
+    const size_t prefix_len = sizeof(JOURNAL_ADD_PREFIX) - 1;
+    size_t map_size = 0;
+    int result = 0;
+    if (sidecar_fn == NULL || (map = file_map(sidecar_fn, &map_size)) == NULL) {
+        goto term;
+    }
+    if ((result = keep_parent_map(map, map_size)) != 0) {
+        goto term;
+    }
+    end = map + map_size;
+    for (line = map; line < end && history_len - start < turns && (eol = memchr(line, '\n', end - line)) != NULL; line = eol + 1) {
+        size_t len = eol - line;
+        if (len > prefix_len + 1 && memcmp(line, JOURNAL_ADD_PREFIX, prefix_len) == 0 && line[len - 1] == '}') {
+            if ((result = add_entry(line + prefix_len, len - prefix_len - 1, NULL)) != 0) {
+                break;
+            }
+            continue;
+        }
+        if ((record = parse_json(line, len)) == NULL) {
+            break;
+        }
+        if (json_object_object_get_ex(record, JOURNAL_KEY_BASE, &field_obj) && json_object_get_int(field_obj) != history_len - start) {
+            debug("journal \"%s\" is stale, ignoring it\n", sidecar_fn);
+            json_object_put(record);
+            break;
+        }
+        if (json_object_object_get_ex(record, JOURNAL_KEY_ADD, &field_obj) && (result = add_entry(NULL, 0, json_object_get(field_obj))) != 0) {
+            json_object_put(record);
+            break;
+        }
+        json_object_put(record);
+    }
+term:
+    free(sidecar_fn);
+    debug_return result;
+}
+
+static bool index_is_valid(const char *index, size_t index_size, size_t size, int64_t mtime) {
+    debug_enter();
+    const index_header_t *header = (const index_header_t *)index;
+    debug_return index_size >= sizeof(index_header_t) &&
+        memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+        index_size == sizeof(index_header_t) + header->count * sizeof(index_entry_t) &&
+        header->size == size &&
+        header->mtime == mtime &&
+        header->span_end <= size;
+}
+
+static bool is_binary_fn(const char *fn) {
+    debug_enter();
+    size_t l = fn != NULL ? strlen(fn) : 0;
+    debug_return l >= sizeof(BINARY_SUFFIX) - 1 && strcmp(fn + l - (sizeof(BINARY_SUFFIX) - 1), BINARY_SUFFIX) == 0;
+}
+
+static int keep_parent_map(const char *map, size_t size) {
+    debug_enter();
+    parent_map_t *p = realloc(parent_maps, (parent_map_count + 1) * sizeof(parent_map_t));
+    if (p == NULL) {
+        fprintf(stderr, "Error allocating memory for parent context\n");
+        file_unmap(map, size);
+        debug_return 1;
+    }
+    parent_maps = p;
+    parent_maps[parent_map_count].map = map;
+    parent_maps[parent_map_count].size = size;
+    parent_map_count++;
+    debug_return 0;
+}
+
+static int merge_changes(void) {
+    debug_enter();
+    json_object *fields = json_object_new_object();
+    json_object *deleted = json_object_new_array();
+    json_object *entries = json_object_new_array();
+    int result = 1;
+    if (fields == NULL || deleted == NULL || entries == NULL) {
+        fprintf(stderr, "Error allocating memory to merge context changes\n");
+        goto term;
+    }
+    json_object_object_foreach(context_obj, key, val) {
+        const field_digest_t *fd = get_field_digest(key);
+        if (fd == NULL || fd->digest != digest(json_object_to_json_string_ext(val, JSON_C_TO_STRING_PLAIN))) {
+            json_object_object_add(fields, key, json_object_get(val));
+        }
+    }
+    for (int i = 0; i < field_digest_count; i++) {
+        if (!json_object_object_get_ex(context_obj, field_digests[i].key, NULL)) {
+            json_object_array_add(deleted, json_object_new_string(field_digests[i].key));
+        }
+    }
+    for (int i = history_committed; i < history_len; i++) {
+        json_object_array_add(entries, json_object_get(get_entry_obj(i)));
+    }
+    debug("context file \"%s\" changed since it was loaded, merging %zu new entries\n", context_fn, json_object_array_length(entries));
+    free_history();
+    json_object_put(context_obj);
+    context_obj = NULL;
+    if (read_context()) {
+        goto term;
+    }
+    json_object_object_foreach(fields, field_key, field_val) {
+        json_object_object_add(context_obj, field_key, json_object_get(field_val));
+    }
+    for (size_t i = 0; i < json_object_array_length(deleted); i++) {
+        json_object_object_del(context_obj, json_object_get_string(json_object_array_get_idx(deleted, i)));
+    }
+    for (size_t i = 0; i < json_object_array_length(entries); i++) {
+        add_entry(NULL, 0, json_object_get(json_object_array_get_idx(entries, i)));
+    }
+    result = 0;
+term:
+    json_object_put(fields);
+    json_object_put(deleted);
+    json_object_put(entries);
+    debug_return result;
+}
+
+static json_object *parse_header(const char *map, size_t size, bool binary, const index_header_t *header) {
+    debug_enter();
+    json_object *obj = NULL;
+    char *s = NULL;
+    size_t len = 0;
+    if (binary && header->span_end > 0) {
+        obj = parse_json(map + header->span_start, header->span_end - header->span_start);
+    } else if (binary) {
+        obj = json_object_new_object();
+    } else if (header->span_end > 0) {
+        size_t suffix_len = size - header->span_end;
+        len = header->span_start + 2 + suffix_len;
+        s = malloc(len);
+        if (s == NULL) {
+            fprintf(stderr, "Error allocating %zu bytes for context header\n", len);
+            debug_return NULL;
+        }
+        memcpy(s, map, header->span_start);
+        memcpy(s + header->span_start, "[]", 2);
+        memcpy(s + header->span_start + 2, map + header->span_end, suffix_len);
+        obj = parse_json(s, len);
+        free(s);
+    } else {
+        obj = parse_json(map, size);
+    }
+    if (obj != NULL) {
+        json_object_object_del(obj, CONTEXT_KEY_HISTORY);
+    }
+    debug_return obj;
+}
+
+static json_object *parse_json(const char *s, size_t len) {
+    debug_enter();
+    json_object *obj = NULL;
+    if (tokener == NULL) {
+        tokener = json_tokener_new();
+        if (tokener == NULL) {
+            fprintf(stderr, "JSON parser error: couldn't initialize JSON parser\n");
+            debug_return NULL;
+        }
+    }
+    json_tokener_reset(tokener);
+    obj = json_tokener_parse_ex(tokener, s, len);
+    if (json_tokener_get_error(tokener) != json_tokener_success) {
+        if (obj != NULL) {
+            json_object_put(obj);
+        }
+        debug_return NULL;
+    }
+    debug_return obj;
+}
+
+static int parse_time(const char *s, bool end, int64_t *t) {
+    debug_enter();
+    struct tm tm;
+    char *e = NULL;
+    int fields = 0;
+    int n = 0;
+    if (*s == '\0') {
+        debug_return 1;
+    }
+    *t = strtoll(s, &e, 10);
+    if (*e == '\0') {
+        debug_return 0;
+    }
+    memset(&tm, 0, sizeof(tm));
+    fields = sscanf(s, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n);
+    if (fields == 3 && (s[n] == 'T' || s[n] == ' ')) {
+        int m = 0;
+        fields += sscanf(s + n + 1, "%d:%d%n:%d%n", &tm.tm_hour, &tm.tm_min, &m, &tm.tm_sec, &m);
+        n += 1 + m;
+    }
+    if (fields < 3 || fields == 4 || s[n] != '\0') {
+        debug_return 1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    *t = mktime(&tm);
+    if (end) {
+        *t += fields == 3 ? 24 * 60 * 60 - 1 : fields == 5 ? 59 : 0;
+    }
+    debug_return 0;
+}
+
+static int read_context(void) {
+    debug_enter();
+    if (context_fn != NULL) {
+        context_binary = is_binary_fn(context_fn);
+        journal_fn = get_sidecar_fn(context_fn, JOURNAL_SUFFIX);
+        index_fn = get_sidecar_fn(context_fn, INDEX_SUFFIX);
+        context_obj = read_context_file(context_fn);
+        // The file is there but it, or a parent it inherits from, couldn't be
+        // read. Starting over with an empty context would write over it.
+        if (context_obj == NULL && snapshot_map != NULL) {
+            debug_return 1;
+        }
+    }
+    if (context_obj == NULL) {
+        debug("creating new context_obj\n");
+        context_obj = json_object_new_object();
+    }
+    if (!context_binary) {
+        read_journal_file(journal_fn);
+    }
+    history_committed = history_len;
+    save_field_digests();
+    file_get_version(context_fn, &snapshot_version);
+    file_get_version(journal_fn, &journal_version);
+    debug_return 0;
+}
+
+static json_object *read_context_file(const char *fn) {
+    debug_enter();
+    json_object *obj = NULL;
+    json_object *parent_obj = NULL;
+    if (fn == NULL) {
+        fprintf(stderr, "No context filename\n");
+        debug_return NULL;
+    }
+    snapshot_map = file_map(fn, &snapshot_map_size);
+    if (snapshot_map == NULL) {
+        debug_return NULL;
+    }
+    snapshot_size = snapshot_map_size;
+    context_compressed = file_is_compressed(fn);
+    context_binary = snapshot_map_size >= sizeof(binary_file_header_t) && memcmp(snapshot_map, BINARY_MAGIC, sizeof(BINARY_MAGIC) - 1) == 0;
+    if (read_index_file(index_fn)) {
+        size_t index_len = 0;
+        char *index = NULL;
+        if (context_binary) {
+            index = build_binary_index(snapshot_map, snapshot_map_size, &index_len);
+        } else {
+            index = build_index(snapshot_map, snapshot_map_size, &index_len);
+        }
+        if (index == NULL) {
+            fprintf(stderr, "Error parsing context file \"%s\"\n", fn);
+            debug_return NULL;
+        }
+        index_buf = index;
+        index_entries = (const index_entry_t *)(index_buf + sizeof(index_header_t));
+        memcpy(&index_state, index_buf, sizeof(index_header_t));
+        index_count = index_state.count;
+        if (index_state.size == snapshot_map_size) {
+            write_index_file(index_fn, index, index_len, file_get_mtime(fn));
+        } else {
+            debug("context file \"%s\" has an incomplete record at the end\n", fn);
+            compact_pending = true;
+        }
+    }
+    obj = parse_header(snapshot_map, snapshot_map_size, context_binary, &index_state);
+    if (obj == NULL) {
+        fprintf(stderr, "Error parsing context file \"%s\"\n", fn);
+        debug_return NULL;
+    }
+    if (json_object_object_get_ex(obj, CONTEXT_KEY_PARENT, &parent_obj) && inherit_history(parent_obj, 0)) {
+        goto err;
+    }
+    history_base = history_len;
+    if (history_base + index_count > history_cap) {
+        history_entry_t *h = realloc(history, (history_base + index_count) * sizeof(history_entry_t));
+        if (h == NULL) {
+            fprintf(stderr, "Error allocating memory for context history\n");
+            goto err;
+        }
+        history = h;
+        history_cap = history_base + index_count;
+    }
+    memset(&history[history_base], 0, index_count * sizeof(history_entry_t));
+    history_len = history_base + index_count;
+    debug_return obj;
+err:
+    for (int i = 0; i < history_len; i++) {
+        if (history[i].obj != NULL) {
+            json_object_put(history[i].obj);
+        }
+    }
+    history_len = 0;
+    history_base = 0;
+    json_object_put(obj);
+    debug_return NULL;
+}
+
+static int read_index_file(const char *fn) {
+    debug_enter();
+    const index_header_t *header = NULL;
+    if (fn == NULL) {
+        debug_return 1;
+    }
+    index_map = file_map(fn, &index_map_size);
+    if (index_map == NULL) {
+        debug_return 1;
+    }
+    header = (const index_header_t *)index_map;
+    if (!index_is_valid(index_map, index_map_size, snapshot_map_size, file_get_mtime(context_fn))) {
+        debug("index \"%s\" is stale\n", fn);
+        file_unmap(index_map, index_map_size);
+        index_map = NULL;
+        index_map_size = 0;
+        debug_return 1;
+    }
+    memcpy(&index_state, header, sizeof(index_header_t));
+    index_entries = (const index_entry_t *)(index_map + sizeof(index_header_t));
+    index_count = header->count;
+    debug_return 0;
+}
+
+static void read_journal_file(const char *fn) {
+    debug_enter();
+    json_object *record = NULL;
+    json_object *field_obj = NULL;
+    const char *line = NULL;
+    const char *eol = NULL;
+    const char *end = NULL;
+    const size_t prefix_len = sizeof(JOURNAL_ADD_PREFIX) - 1;
+    if (fn == NULL || (journal_map = file_map(fn, &journal_map_size)) == NULL) {
+        debug_return;
+    }
+    journal_size = journal_map_size;
+    end = journal_map + journal_map_size;
+    for (line = journal_map; line < end && (eol = memchr(line, '\n', end - line)) != NULL; line = eol + 1) {
+        size_t len = eol - line;
+        if (len > prefix_len + 1 && memcmp(line, JOURNAL_ADD_PREFIX, prefix_len) == 0 && line[len - 1] == '}') {
+            add_entry(line + prefix_len, len - prefix_len - 1, NULL);
+            continue;
+        }
+        record = parse_json(line, len);
+        if (record == NULL) {
+            debug("ignoring incomplete journal record\n");
+            break;
+        }
+        if (json_object_object_get_ex(record, JOURNAL_KEY_BASE, &field_obj)) {
+            if (json_object_get_int(field_obj) != history_len) {
+                debug("journal \"%s\" is stale, ignoring it\n", fn);
+                json_object_put(record);
+                compact_pending = true;
+                break;
+            }
+        } else if (json_object_object_get_ex(record, JOURNAL_KEY_ADD, &field_obj)) {
+            add_entry(NULL, 0, json_object_get(field_obj));
+        } else if (json_object_object_get_ex(record, JOURNAL_KEY_SET, &field_obj)) {
+            json_object *value_obj = NULL;
+            json_object_object_get_ex(record, JOURNAL_KEY_VALUE, &value_obj);
+            json_object_object_add(context_obj, json_object_get_string(field_obj), json_object_get(value_obj));
+        } else if (json_object_object_get_ex(record, JOURNAL_KEY_DEL, &field_obj)) {
+            json_object_object_del(context_obj, json_object_get_string(field_obj));
+        }
+        json_object_put(record);
+    }
+    debug_return;
+}
+
+static void release_entry(int i) {
+    debug_enter();
+    history_entry_t *entry = &history[i];
+    size_t raw_len = 0;
+    bool binary = false;
+    if (entry->obj != NULL && get_entry_raw(i, &raw_len, &binary) != NULL) {
+        json_object_put(entry->obj);
+        entry->obj = NULL;
+        entry->prompt = NULL;
+        entry->response = NULL;
+    }
+    debug_return;
+}
+
+static void save_field_digests(void) {
+    debug_enter();
+    free_field_digests();
+    if (context_obj == NULL) {
+        debug_return;
+    }
+    field_digests = malloc((json_object_object_length(context_obj) + 1) * sizeof(field_digest_t));
+    if (field_digests == NULL) {
+        fprintf(stderr, "Error allocating memory for context field digests\n");
+        debug_return;
+    }
+    json_object_object_foreach(context_obj, key, val) {
+        field_digests[field_digest_count].key = strdup(key);
+        field_digests[field_digest_count].digest = digest(json_object_to_json_string_ext(val, JSON_C_TO_STRING_PLAIN));
+        field_digest_count++;
+    }
+    debug_return;
+}
+
+static char *buf_extend(char **buf, size_t *len, size_t n) {
+    debug_enter();
+    char *b = realloc(*buf, *len + n + 1);
+    if (b == NULL) {
+        fprintf(stderr, "Error allocating %zu bytes for context file\n", *len + n + 1);
+        debug_return NULL;
+    }
+    memset(b + *len, 0, n + 1);
+    *buf = b;
+    *len += n;
+    debug_return b + *len - n;
+}
+
+static char *build_index(const char *buf, size_t len, size_t *index_len) {
+    debug_enter();
+    const char *end = buf + len;
+    const char *p = scan_ws(buf, end);
+    index_header_t header;
+    index_entry_t *entries = NULL;
+    char *index = NULL;
+    int cap = 0;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.size = len;
+    if (p >= end || *p++ != '{') {
+        goto term;
+    }
+    while (1) {
+        p = scan_ws(p, end);
+        if (p < end && *p == '}') {
+            break;
+        }
+        if (p >= end || *p != '"') {
+            goto term;
+        }
+        const char *key = p + 1;
+        if ((p = scan_string(p, end)) == NULL) {
+            goto term;
+        }
+        size_t key_len = p - key - 1;
+        p = scan_ws(p, end);
+        if (p >= end || *p != ':') {
+            goto term;
+        }
+        p = scan_ws(p + 1, end);
+        if (key_len == sizeof(CONTEXT_KEY_HISTORY) - 1 && memcmp(key, CONTEXT_KEY_HISTORY, key_len) == 0 && p < end && *p == '[') {
+            header.span_start = p - buf;
+            p++;
+            while (1) {
+                p = scan_ws(p, end);
+                if (p < end && *p == ']') {
+                    p++;
+                    break;
+                }
+                const char *value = p;
+                if ((p = scan_value(p, end)) == NULL || p == value) {
+                    goto term;
+                }
+                if (add_index_entry(&entries, &cap, &header, value - buf, p - value)) {
+                    goto term;
+                }
+                p = scan_ws(p, end);
+                if (p < end && *p == ',') {
+                    p++;
+                } else if (p >= end || *p != ']') {
+                    goto term;
+                }
+            }
+            header.span_end = p - buf;
+        } else if ((p = scan_value(p, end)) == NULL) {
+            goto term;
+        }
+        p = scan_ws(p, end);
+        if (p < end && *p == ',') {
+            p++;
+        } else if (p >= end || *p != '}') {
+            goto term;
+        }
+    }
+    index = finish_index(&header, entries, index_len);
+term:
+    free(entries);
+    debug_return index;
+}
+
+static char *finish_index(const index_header_t *header, const index_entry_t *entries, size_t *index_len) {
+    debug_enter();
+    char *index = NULL;
+    *index_len = sizeof(index_header_t) + header->count * sizeof(index_entry_t);
+    index = malloc(*index_len);
+    if (index == NULL) {
+        fprintf(stderr, "Error allocating memory for context index\n");
+        debug_return NULL;
+    }
+    memcpy(index, header, sizeof(index_header_t));
+    if (header->count > 0) {
+        memcpy(index + sizeof(index_header_t), entries, header->count * sizeof(index_entry_t));
+    }
+    debug_return index;
+}
+
+static char *serialize_binary(size_t *len, int start) {
+    debug_enter();
+    char *buf = NULL;
+    char *p = NULL;
+    binary_file_header_t header;
+    *len = 0;
+    memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+    header.version = BINARY_VERSION;
+    if ((p = buf_extend(&buf, len, sizeof(header))) == NULL) {
+        goto err;
+    }
+    memcpy(p, &header, sizeof(header));
+    if (append_binary_header(&buf, len)) {
+        goto err;
+    }
+    for (int i = start; i < history_len; i++) {
+        const history_entry_t *entry = get_entry(i);
+        if (entry == NULL || append_binary_entry(&buf, len, entry)) {
+            goto err;
+        }
+    }
+    debug_return buf;
+err:
+    free(buf);
+    debug_return NULL;
+}
+
+static void update_binary(void) {
+    debug_enter();
+    index_header_t header = index_state;
+    index_entry_t *entries = NULL;
+    char *buf = NULL;
+    size_t len = 0;
+    int count = 0;
+    if (compact_pending || context_compressed || snapshot_size == 0 || index_state.garbage > snapshot_size / 2) {
+        compact();
+        debug_return;
+    }
+    if (fields_changed()) {
+        if (append_binary_header(&buf, &len)) {
+            goto term;
+        }
+        if (header.span_end > 0) {
+            header.garbage += BINARY_RECORD_SIZE(header.span_end - header.span_start);
+        }
+        header.span_start = snapshot_size + sizeof(binary_record_t);
+        header.span_end = header.span_start + ((const binary_record_t *)buf)->len;
+    }
+    if (history_len > history_committed) {
+        entries = malloc((history_len - history_committed) * sizeof(index_entry_t));
+        if (entries == NULL) {
+            fprintf(stderr, "Error allocating memory for context index\n");
+            goto term;
+        }
+    }
+    for (int i = history_committed; i < history_len; i++) {
+        const history_entry_t *entry = get_entry(i);
+        size_t offset = len;
+        if (entry == NULL || append_binary_entry(&buf, &len, entry)) {
+            goto term;
+        }
+        entries[count].offset = snapshot_size + offset;
+        entries[count].len = len - offset;
+        count++;
+    }
+    if (len == 0) {
+        debug("context file \"%s\" is up to date\n", context_fn);
+        goto term;
+    }
+    debug("appending %zu bytes to context file \"%s\"\n", len, context_fn);
+    if (file_append_data(context_fn, buf, len)) {
+        goto term;
+    }
+    snapshot_size += len;
+    history_committed = history_len;
+    save_field_digests();
+    if (index_fn != NULL && memcmp(index_state.magic, INDEX_MAGIC, sizeof(index_state.magic)) == 0) {
+        header.count += count;
+        header.size = snapshot_size;
+        header.mtime = file_get_mtime(context_fn);
+        if ((count > 0 && file_append_data(index_fn, entries, count * sizeof(index_entry_t))) ||
+            file_write_at(index_fn, 0, &header, sizeof(header))) {
+            file_remove(index_fn);
+            memset(&index_state, 0, sizeof(index_state));
+        } else {
+            index_state = header;
+        }
+    }
+term:
+    free(entries);
+    free(buf);
+    debug_return;
+}
+
+static char *build_binary_index(const char *buf, size_t len, size_t *index_len) {
+    debug_enter();
+    const char *end = buf + len;
+    const char *p = buf + sizeof(binary_file_header_t);
+    const binary_file_header_t *file_header = (const binary_file_header_t *)buf;
+    index_header_t header;
+    index_entry_t *entries = NULL;
+    char *index = NULL;
+    int cap = 0;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    if (len < sizeof(binary_file_header_t) ||
+        memcmp(file_header->magic, BINARY_MAGIC, sizeof(file_header->magic)) != 0 ||
+        file_header->version != BINARY_VERSION) {
+        goto term;
+    }
+    while ((size_t)(end - p) >= sizeof(binary_record_t)) {
+        const binary_record_t *record = (const binary_record_t *)p;
+        size_t size = BINARY_RECORD_SIZE(record->len);
+        if (size > (size_t)(end - p)) {
+            break;
+        }
+        if (record->type == BINARY_RECORD_HEADER) {
+            if (header.span_end > 0) {
+                header.garbage += BINARY_RECORD_SIZE(header.span_end - header.span_start);
+            }
+            header.span_start = p - buf + sizeof(binary_record_t);
+            header.span_end = header.span_start + record->len;
+        } else if (record->type == BINARY_RECORD_ENTRY) {
+            if (add_index_entry(&entries, &cap, &header, p - buf, size)) {
+                goto term;
+            }
+        }
+        p += size;
+    }
+    header.size = p - buf;
+    index = finish_index(&header, entries, index_len);
+term:
+    free(entries);
+    debug_return index;
+}
+
+static void write_compact_json(const char *s, size_t len) {
+    const char *end = s + len;
+    const char *run = s;
+    bool in_string = false;
+    for (; s < end; s++) {
+        if (in_string) {
+            if (*s == '\\') {
+                s++;
+            } else if (*s == '"') {
+                in_string = false;
+            }
+        } else if (*s == '"') {
+            in_string = true;
+        } else if (isspace((unsigned char)*s)) {
+            fwrite(run, 1, s - run, stdout);
+            run = s + 1;
+        }
+    }
+    if (run < end) {
+        fwrite(run, 1, end - run, stdout);
+    }
+}
+
+static int write_context_file(const char *fn, bool binary, int start) {
+    debug_enter();
+    json_object *history_obj = NULL;
+    json_object *parent_obj = NULL;
+    char *data = NULL;
+    const char *s = NULL;
+    size_t len = 0;
+    int result = 1;
+    if (fn == NULL) {
+        fprintf(stderr, "No context filename\n");
+        debug_return 1;
+    }
+    if (context_obj == NULL) {
+        fprintf(stderr, "No context object\n");
+        debug_return 1;
+    }
+    if (start == 0 && fn != context_fn && json_object_object_get_ex(context_obj, CONTEXT_KEY_PARENT, &parent_obj)) {
+        json_object_get(parent_obj);
+        json_object_object_del(context_obj, CONTEXT_KEY_PARENT);
+    }
+    if (binary) {
+        s = data = serialize_binary(&len, start);
+    } else {
+        history_obj = json_object_new_array();
+        if (history_obj == NULL) {
+            fprintf(stderr, "Error creating context history array\n");
+            goto term;
+        }
+        for (int i = start; i < history_len; i++) {
+            json_object *entry = get_entry_obj(i);
+            if (entry != NULL) {
+                json_object_array_add(history_obj, json_object_get(entry));
+            }
+        }
+        json_object_object_add(context_obj, CONTEXT_KEY_HISTORY, history_obj);
+        s = json_object_to_json_string_ext(context_obj, JSON_C_TO_STRING_PRETTY);
+        len = s != NULL ? strlen(s) : 0;
+    }
+    if (s == NULL) {
+        fprintf(stderr, "Error converting context object\n");
+        goto term;
+    }
+    if (file_write_data(fn, s, len)) {
+        goto term;
+    }
+    if (fn == context_fn) {
+        snapshot_size = len;
+        if (index_fn != NULL) {
+            size_t index_len = 0;
+            char *index = binary ? build_binary_index(s, len, &index_len) : build_index(s, len, &index_len);
+            if (index != NULL) {
+                write_index_file(index_fn, index, index_len, file_get_mtime(fn));
+                free(index);
+            }
+        }
+    }
+    result = 0;
+term:
+    if (history_obj != NULL) {
+        json_object_object_del(context_obj, CONTEXT_KEY_HISTORY);
+    }
+    if (parent_obj != NULL) {
+        json_object_object_add(context_obj, CONTEXT_KEY_PARENT, parent_obj);
+    }
+    free(data);
+    debug_return result;
+}
+
+static int write_history_entry(int i, bool jsonl) {
+    debug_enter();
+    const history_entry_t *entry = &history[i];
+    const char *raw = NULL;
+    size_t raw_len = 0;
+    bool binary = false;
+    if (jsonl && entry->prompt == NULL && entry->obj == NULL && (raw = get_entry_raw(i, &raw_len, &binary)) != NULL && !binary) {
+        const char *end = raw + raw_len;
+        const char *p = scan_ws(raw, end);
+        if (p < end && *p == '{') {
+            p = scan_ws(p + 1, end);
+            printf("{\"index\":%d%s", i, p < end && *p != '}' ? "," : "");
+            write_compact_json(p, end - p);
+            fputc('\n', stdout);
+            debug_return 0;
+        }
+    }
+    if ((entry = get_entry(i)) == NULL) {
+        debug_return 1;
+    }
+    if (jsonl) {
+        printf("{\"index\":%d,\"" CONTEXT_KEY_TIMESTAMP "\":%lld,\"" CONTEXT_KEY_PROMPT "\":", i, (long long)entry->timestamp);
+        write_json_string(entry->prompt);
+        fputs(",\"" CONTEXT_KEY_RESPONSE "\":", stdout);
+        write_json_string(entry->response);
+        if (entry->prompt_tokens >= 0 && entry->response_tokens >= 0) {
+            printf(",\"" CONTEXT_KEY_PROMPT_TOKENS "\":%d,\"" CONTEXT_KEY_RESPONSE_TOKENS "\":%d", entry->prompt_tokens, entry->response_tokens);
+        }
+        fputs("}\n", stdout);
+    } else {
+        char ts[64];
+        struct tm tm;
+        time_t t = entry->timestamp;
+        if (localtime_r(&t, &tm) == NULL || strftime(ts, sizeof(ts), "%a %b %e %H:%M:%S %Y\n", &tm) == 0) {
+            strcpy(ts, "?\n");
+        }
+        fputs(ts, stdout);
+        fputs("User: \"", stdout);
+        fputs(entry->prompt, stdout);
+        fputs("\"\nAI: ", stdout);
+        fputs(entry->response, stdout);
+        fputs("\n\n", stdout);
+    }
+    debug_return 0;
+}
+
+static void write_index_file(const char *fn, char *index, size_t len, int64_t mtime) {
+    debug_enter();
+    if (fn == NULL) {
+        debug_return;
+    }
+    ((index_header_t *)index)->mtime = mtime;
+    if (file_write_data(fn, index, len)) {
+        file_remove(fn);
+        memset(&index_state, 0, sizeof(index_state));
+    } else {
+        memcpy(&index_state, index, sizeof(index_header_t));
+    }
+    debug_return;
+}
+
+static void write_json_string(const char *s) {
+    const char *run = s;
+    fputc('"', stdout);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c != '"' && c != '\\' && c >= 0x20) {
+            continue;
+        }
+        fwrite(run, 1, s - run, stdout);
+        run = s + 1;
+        switch (c) {
+            case '"': fputs("\\\"", stdout); break;
+            case '\\': fputs("\\\\", stdout); break;
+            case '\n': fputs("\\n", stdout); break;
+            case '\r': fputs("\\r", stdout); break;
+            case '\t': fputs("\\t", stdout); break;
+            default: printf("\\u%04x", c); break;
+        }
+    }
+    fwrite(run, 1, s - run, stdout);
+    fputc('"', stdout);
+}
+
+static void write_summary(const char *summary, int end, bool jsonl) {
+    debug_enter();
+    if (jsonl) {
+        fputs("{\"" CONTEXT_KEY_SUMMARY "\":{\"" CONTEXT_KEY_SUMMARY_TEXT "\":", stdout);
+        write_json_string(summary);
+        printf(",\"" CONTEXT_KEY_SUMMARY_END "\":%d}}\n", end);
+    } else {
+        printf("Summary of the entries above: %s\n\n", summary);
+    }
+    debug_return;
+}
@@ -32,15 +32,93 @@
  * context_update(). Values in "updates_obj" will overwrite what is in the
  * context file when context_update() runs. Values in the context file that
  * are not in "updates_obj" will be left alone.
+ * 
+ * Changes are not written back by rewriting the whole context file. Instead,
+ * context_update() appends one JSON record per line to a journal file that
+ * sits next to the context file (the context filename with ".journal"
+ * appended). The journal starts with a "base" record holding the number of
+ * history entries in the context file it applies to, followed by "add"
+ * records for new history entries and "set"/"del" records for top-level
+ * fields that changed. context_load() replays the journal over the context
+ * file. Once the journal grows larger than the context file, it is compacted:
+ * the context file is rewritten with everything in it and the journal is
+ * removed.
+ * 
+ * Loading a context does not parse its history. The context file is mapped
+ * into memory and the location of each history entry is kept in an index
+ * file next to it (the context filename with ".idx" appended). The index is
+ * rebuilt whenever the context file's size or modification time doesn't match
+ * the index. Only the top-level fields are parsed at load time; a history
+ * entry is parsed the first time one of the context_get_history_*()
+ * functions asks for it. context_dump_history() goes further: it filters on
+ * timestamps read straight from the raw entries, writes JSON lines output by
+ * copying the raw entry text, and frees each entry it parsed once it has been
+ * printed, so dumping a long history doesn't build it up in memory.
+ * 
+ * A context file whose name ends in ".ctx" is stored in a binary format
+ * instead: a "CHWB" magic number and version, followed by length-prefixed
+ * records. Header records hold the top-level fields as JSON text; entry
+ * records hold the timestamp, prompt and response of one history entry. New
+ * records are appended to the file itself rather than to a journal, and the
+ * prompt and response strings returned for a binary context point straight
+ * into the mapped file. context_export() converts between the two formats
+ * without losing anything. The format of an existing file is recognized by
+ * its contents, not its name.
+ * 
+ * When a tokenizer vocabulary is set, context_add_history() stores the token
+ * counts of the prompt and response with the entry ("prompt-tokens" and
+ * "response-tokens"), so they don't have to be counted again each time the
+ * history is fitted into a model's context window.
+ * 
+ * Several processes can use the same context at once. Loading takes a shared
+ * lock, and context_update() an exclusive one, on a lock file next to the
+ * context file (the context filename with ".lock" appended); neither is held
+ * while a query runs. If the context file or journal changed on disk since it
+ * was loaded, context_update() loads it again and reapplies only this
+ * process's new history entries and changed fields before writing them, so
+ * concurrent queries don't lose each other's history. Whole files are only
+ * ever replaced by renaming a completed temporary file over them.
+ * 
+ * Old history entries can be folded into a summary, stored in the top-level
+ * "summary" field as its "text" and the number of history entries it covers
+ * ("end"). Those entries stay in "history" as an archive, so
+ * context_dump_history() still prints them, but the AI interfaces send the
+ * summary in their place.
+ * 
+ * context_fork() starts a new context that shares the history of the current
+ * one. The new file holds a copy of the top-level fields, no history, and a
+ * "parent" field with the absolute filename of the current context ("file")
+ * and the number of its history entries the new context inherits ("turns").
+ * When a context with a parent is loaded, those entries are taken from the
+ * parent (and its parent, and so on) the same way as the context's own, and
+ * come before them. New entries are only ever written to the child. Since
+ * history is only appended to, the parent can keep growing without changing
+ * what the child sees. context_export() writes a standalone copy with the
+ * inherited entries included.
  */
 
 #ifndef _CONTEXT_H
 #define _CONTEXT_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <json-c/json.h>
 
+/**
+ * @brief Selects the history entries printed by context_dump_history() and
+ * how they are printed. start and end are entry indexes, end exclusive;
+ * negative values count back from the end of the history. Entries whose
+ * timestamp is outside from..to are skipped.
+ */
+typedef struct context_history_filter_t {
+    int start;
+    int end;
+    int64_t from;
+    int64_t to;
+    bool jsonl;
+} context_history_filter_t;
+
 /** @brief Default context filename. */
 extern const char context_fn_default[];
 /** @brief Default context directory. */
@@ -48,14 +126,14 @@ extern const char context_dir_default[];
 
 /** @brief Add a query/response/timestamp to the context. */
 extern void context_add_history(const char *prompt, const char *response, const int64_t timestamp);
-/** @brief Load context from file into json object. */
-extern void context_load(const char *fn);
+/** @brief Load context from file into json object. Returns non-zero if the file exists but can't be loaded. */
+extern int context_load(const char *fn);
 /** @brief Create a new context. */
 extern void context_new(const char *fn);
 /** @brief Delete the system prompt from the context file. */
 extern int context_delete_system_prompt(void);
-/** @brief Dump the chat history from the context file. */
-extern int context_dump_history(void);
+/** @brief Print the history entries selected by the filter, as text or as one JSON object per line. */
+extern int context_dump_history(const context_history_filter_t *filter);
 /** @brief get an arbitrary object from a named field in the context. */
 extern json_object *context_get(const char *field);
 /** @brief get the AI host from the context.*/
@@ -64,18 +142,32 @@ extern const char *context_get_ai_host(void);
 extern const char *context_get_ai_provider(void);
 /** @brief Get the function filename from the context. */
 extern const char *context_get_function_filename(void);
+/** @brief Write the whole context to the given file, as binary if the name ends in ".ctx" and as JSON otherwise. */
+extern int context_export(const char *fn);
+/** @brief Write a new context to the given file that inherits the current history from this one. */
+extern int context_fork(const char *fn);
 /** @brief Get the model from the contest. */
 extern const char *context_get_model(void);
 /** @brief Get the system prompt from the context. */
 extern const char *context_get_system_prompt(void);
-/** @brief Read the chat history from the context file. */
-extern json_object *context_get_history(void);
-/** @brief Get the prompt from a given history entry. */
-extern const char *context_get_history_prompt(json_object *entry);
-/** @brief Get the response from a given history entry. */
-extern const char *context_get_history_response(json_object *entry);
-/** @brief Get the timestamp from a given history entry. */
-extern int64_t context_get_history_timestamp(json_object *entry);
+/** @brief Get the summary of the archived history entries, or NULL if there is none. */
+extern const char *context_get_summary(void);
+/** @brief Get the number of history entries covered by the summary. */
+extern int context_get_summary_end(void);
+/** @brief Get history entries start to end - 1 as "User:"/"AI:" text. The caller frees it. */
+extern char *context_get_transcript(int start, int end);
+/** @brief Get the number of entries in the chat history. */
+extern int context_get_history_length(void);
+/** @brief Get the prompt from the given history entry. */
+extern const char *context_get_history_prompt(int i);
+/** @brief Get the response from the given history entry. */
+extern const char *context_get_history_response(int i);
+/** @brief Get the number of tokens in the prompt and response of the given history entry. */
+extern int context_get_history_tokens(int i);
+/** @brief Get the timestamp from the given history entry. */
+extern int64_t context_get_history_timestamp(int i);
+/** @brief Parse a comma-separated history range ("N", "start:end", "from=time", "to=time", "jsonl") into a filter. */
+extern int context_parse_history_filter(const char *s, context_history_filter_t *filter);
 /** @brief Set an arbitrary field to a given json object. */
 extern int context_set(const char *field, json_object *obj);
 /** @brief Set the AI host in the context file. */
@@ -86,6 +178,8 @@ extern int context_set_ai_provider(const char *s);
 extern int context_set_function_filename(const char *s);
 /** @brief Set the model in the context file. */
 extern int context_set_model(const char *s);
+/** @brief Replace the summary with one covering the first "end" history entries. */
+extern int context_set_summary(const char *s, int end);
 /** @brief Set the system prompt in the context file. */
 extern int context_set_system_prompt(const char *s);
 /** @brief Update the context file with new history and embeddings. */
@@ -10,32 +10,62 @@
 #include <dirent.h> 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <zstd.h>
+
 #include "chewie.h"
 #include "file.h"
 
+/** @brief Suffix of the temporary file written before replacing a file. The X's are replaced by mkstemp(). */
+#define TMP_SUFFIX ".tmp.XXXXXX"
+/** @brief Suffix of files that are written zstd-compressed. */
+#define ZSTD_SUFFIX ".zst"
+
+static char *dictionary_fn = NULL;
+static bool dictionary_loaded = false;
+static ZSTD_CDict *cdict = NULL;
+static ZSTD_DDict *ddict = NULL;
+
+static void *compress(const char *filename, const void *data, size_t len, size_t *compressed_len);
+static int decompress(const char *filename, const void *data, size_t len, int fd, size_t *size);
 static int dir_exists(const char *path);
+static bool is_compressed(const void *data, size_t len);
+static bool is_compressed_fn(const char *filename);
+static void load_dictionary(void);
+static const char *map_decompressed(const char *filename, const void *data, size_t len, size_t *size);
 static int mk_dir(const char* path, mode_t mode);
 
-int file_append_tmp(FILE **f, const char *s) {
+int file_append(const char *filename, const char *data) {
     debug_enter();
-    if (*f == NULL) {
-        *f = tmpfile();
-        if (*f == NULL) {
-            perror("Error creating a temporary context file");
-            debug_return 1;
-        }
+    debug_return file_append_data(filename, data, strlen(data));
+}
+
+int file_append_data(const char *filename, const void *data, size_t len) {
+    debug_enter();
+    mode_t mode = 0;
+    int fd = -1;
+    mode |= S_IRUSR | S_IWUSR;
+    mode |= S_IRGRP | S_IWGRP;
+    mode |= S_IROTH;
+    fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, mode);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open/create file \"%s\" for appending\n", filename);
+        debug_return 1;
+    }
+    if (write(fd, data, len) != (ssize_t)len) {
+        fprintf(stderr, "Unable to append to file \"%s\"\n", filename);
+        close(fd);
+        debug_return 1;
     }
-    debug("appending \"%s\" to temporary context file\n", s);
-    fprintf(*f, "%s", s);
-    debug("flushing temporary context file\n");
-    fflush(*f);
-    debug("exiting\n");
+    close(fd);
     debug_return 0;
 }
 
@@ -68,6 +98,98 @@ out:
     debug_return result;
 }
 
+bool file_is_compressed(const char *filename) {
+    debug_enter();
+    unsigned char magic[4];
+    int fd = open(filename, O_RDONLY);
+    ssize_t n = 0;
+    if (fd == -1) {
+        debug_return false;
+    }
+    n = read(fd, magic, sizeof(magic));
+    close(fd);
+    debug_return is_compressed(magic, n > 0 ? n : 0);
+}
+
+int64_t file_get_mtime(const char *filename) {
+    debug_enter();
+    struct stat sb;
+    if (stat(filename, &sb) == -1) {
+        debug_return 0;
+    }
+    debug_return (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+}
+
+int file_get_version(const char *filename, file_version_t *version) {
+    debug_enter();
+    struct stat sb;
+    memset(version, 0, sizeof(file_version_t));
+    if (filename == NULL || stat(filename, &sb) == -1) {
+        debug_return 1;
+    }
+    version->inode = sb.st_ino;
+    version->size = sb.st_size;
+    version->mtime = (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+    debug_return 0;
+}
+
+int file_lock(const char *filename, bool exclusive) {
+    debug_enter();
+    mode_t mode = 0;
+    int fd = -1;
+    mode |= S_IRUSR | S_IWUSR;
+    mode |= S_IRGRP | S_IWGRP;
+    mode |= S_IROTH;
+    if (filename == NULL) {
+        debug_return -1;
+    }
+    fd = open(filename, O_RDWR | O_CREAT, mode);
+    if (fd == -1) {
+        debug("unable to open lock file \"%s\"\n", filename);
+        debug_return -1;
+    }
+    while (flock(fd, exclusive ? LOCK_EX : LOCK_SH) == -1) {
+        if (errno != EINTR) {
+            debug("unable to lock \"%s\"\n", filename);
+            close(fd);
+            debug_return -1;
+        }
+    }
+    debug_return fd;
+}
+
+const char *file_map(const char *filename, size_t *size) {
+    debug_enter();
+    struct stat sb;
+    void *map = NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        debug_return NULL;
+    }
+    if (fstat(fd, &sb) != 0) {
+        fprintf(stderr, "Unable to stat file \"%s\"\n", filename);
+        close(fd);
+        debug_return NULL;
+    }
+    if (sb.st_size == 0) {
+        close(fd);
+        debug_return NULL;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map file \"%s\"\n", filename);
+        debug_return NULL;
+    }
+    if (is_compressed(map, sb.st_size)) {
+        const char *data = map_decompressed(filename, map, sb.st_size, size);
+        munmap(map, sb.st_size);
+        debug_return data;
+    }
+    *size = sb.st_size;
+    debug_return map;
+}
+
 char *file_read(const char *filename) {
     debug_enter();
     char *c = NULL;
@@ -99,31 +221,57 @@ char *file_read(const char *filename) {
     }
     c[sb.st_size] = 0; // Null-terminate
     close(fd);
+    fd = -1;
+    if (is_compressed(c, sb.st_size)) {
+        size_t size = 0;
+        const char *map = map_decompressed(filename, c, sb.st_size, &size);
+        free(c);
+        c = NULL;
+        if (map == NULL) {
+            goto err;
+        }
+        c = malloc(size + 1);
+        if (c == NULL) {
+            fprintf(stderr, "Unable to allocate %zu byte buffer for reading file\n", size + 1);
+            file_unmap(map, size);
+            goto err;
+        }
+        memcpy(c, map, size);
+        c[size] = 0;
+        file_unmap(map, size);
+    }
     debug_return c;
 err:
     if (fd > -1) {
         close(fd);
     }
+    free(c);
     debug_return NULL;
 }
 
-extern char *file_read_tmp(FILE **f) {
+int file_remove(const char *filename) {
     debug_enter();
-    if (*f != NULL) {
-        if (fseek(*f, 0L, SEEK_END) == -1) {
-            perror("Unable to determine size of temporary context file");
-            debug_return NULL;
-        }
-        long len = ftell(*f);
-        rewind(*f);
-        char *result = malloc(len + 1);
-        fread(result, 1, len, *f);
-        result[len] = 0; // Null-terminate
-        fclose(*f);
-        *f = NULL;
-        debug_return result;
+    if (unlink(filename) == -1 && errno != ENOENT) {
+        fprintf(stderr, "Unable to remove file \"%s\"\n", filename);
+        debug_return 1;
     }
-    debug_return NULL;
+    debug_return 0;
+}
+
+void file_set_dictionary(const char *fn) {
+    debug_enter();
+    if (cdict != NULL) {
+        ZSTD_freeCDict(cdict);
+        cdict = NULL;
+    }
+    if (ddict != NULL) {
+        ZSTD_freeDDict(ddict);
+        ddict = NULL;
+    }
+    dictionary_loaded = false;
+    free(dictionary_fn);
+    dictionary_fn = fn != NULL && *fn != '\0' ? strdup(fn) : NULL;
+    debug_return;
 }
 
 void file_truncate(const char *filename) {
@@ -139,31 +287,172 @@ void file_truncate(const char *filename) {
     debug_return;
 }
 
+void file_unlock(int fd) {
+    debug_enter();
+    if (fd > -1) {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+    debug_return;
+}
+
+void file_unmap(const char *map, size_t size) {
+    debug_enter();
+    if (map != NULL) {
+        munmap((void *)map, size);
+    }
+    debug_return;
+}
+
 void file_write(const char *filename, const char *data) {
+    debug_enter();
+    file_write_data(filename, data, strlen(data));
+    debug_return;
+}
+
+int file_write_at(const char *filename, uint64_t offset, const void *data, size_t len) {
+    debug_enter();
+    int fd = open(filename, O_WRONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open file \"%s\"\n", filename);
+        debug_return 1;
+    }
+    if (pwrite(fd, data, len, offset) != (ssize_t)len) {
+        fprintf(stderr, "Unable to write file \"%s\"\n", filename);
+        close(fd);
+        debug_return 1;
+    }
+    close(fd);
+    debug_return 0;
+}
+
+int file_write_data(const char *filename, const void *data, size_t len) {
     debug_enter();
     mode_t mode = 0;
-    char *c = NULL;
-    struct stat sb;
+    mode_t mask = 0;
     int fd = -1;
+    char *tmp_fn = NULL;
+    void *compressed = NULL;
+    if (is_compressed_fn(filename)) {
+        compressed = compress(filename, data, len, &len);
+        if (compressed == NULL) {
+            goto err;
+        }
+        data = compressed;
+    }
     mode |= S_IRUSR | S_IWUSR;
     mode |= S_IRGRP | S_IWGRP;
     mode |= S_IROTH;
-    fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, mode);
+    tmp_fn = malloc(strlen(filename) + sizeof(TMP_SUFFIX));
+    if (tmp_fn == NULL) {
+        fprintf(stderr, "Unable to allocate memory for temporary filename\n");
+        goto err;
+    }
+    strcpy(tmp_fn, filename);
+    strcat(tmp_fn, TMP_SUFFIX);
+    fd = mkstemp(tmp_fn);
     if (fd == -1) {
-        fprintf(stderr, "Unable to open/create context file \"%s\"\n", filename);
+        fprintf(stderr, "Unable to open/create file \"%s\"\n", tmp_fn);
+        free(tmp_fn);
+        tmp_fn = NULL;
         goto err;
     }
-    if (write(fd, data, strlen(data)) == -1) {
-        fprintf(stderr, "Unable to write context file \"%s\"\n", filename);
+    mask = umask(0);
+    umask(mask);
+    fchmod(fd, mode & ~mask);
+    if (write(fd, data, len) != (ssize_t)len) {
+        fprintf(stderr, "Unable to write file \"%s\"\n", tmp_fn);
         goto err;
     }
     close(fd);
-    debug_return;
+    fd = -1;
+    if (rename(tmp_fn, filename) == -1) {
+        fprintf(stderr, "Unable to replace file \"%s\"\n", filename);
+        goto err;
+    }
+    free(tmp_fn);
+    free(compressed);
+    debug_return 0;
 err:
     if (fd > -1) {
         close(fd);
     }
-    debug_return;
+    if (tmp_fn != NULL) {
+        unlink(tmp_fn);
+        free(tmp_fn);
+    }
+    free(compressed);
+    debug_return 1;
+}
+
+static void *compress(const char *filename, const void *data, size_t len, size_t *compressed_len) {
+    debug_enter();
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    size_t cap = ZSTD_compressBound(len);
+    void *buf = malloc(cap);
+    size_t n = 0;
+    if (cctx == NULL || buf == NULL) {
+        fprintf(stderr, "Unable to allocate memory to compress file \"%s\"\n", filename);
+        goto err;
+    }
+    load_dictionary();
+    if (cdict != NULL) {
+        n = ZSTD_compress_usingCDict(cctx, buf, cap, data, len, cdict);
+    } else {
+        n = ZSTD_compressCCtx(cctx, buf, cap, data, len, ZSTD_CLEVEL_DEFAULT);
+    }
+    if (ZSTD_isError(n)) {
+        fprintf(stderr, "Unable to compress file \"%s\": %s\n", filename, ZSTD_getErrorName(n));
+        goto err;
+    }
+    ZSTD_freeCCtx(cctx);
+    *compressed_len = n;
+    debug_return buf;
+err:
+    ZSTD_freeCCtx(cctx);
+    free(buf);
+    debug_return NULL;
+}
+
+static int decompress(const char *filename, const void *data, size_t len, int fd, size_t *size) {
+    debug_enter();
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer in = { data, len, 0 };
+    ZSTD_outBuffer out = { NULL, ZSTD_DStreamOutSize(), 0 };
+    size_t r = 0;
+    int result = 1;
+    out.dst = malloc(out.size);
+    if (dctx == NULL || out.dst == NULL) {
+        fprintf(stderr, "Unable to allocate memory to decompress file \"%s\"\n", filename);
+        goto term;
+    }
+    load_dictionary();
+    if (ddict != NULL) {
+        ZSTD_DCtx_refDDict(dctx, ddict);
+    }
+    *size = 0;
+    do {
+        out.pos = 0;
+        r = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(r)) {
+            fprintf(stderr, "Unable to decompress file \"%s\": %s\n", filename, ZSTD_getErrorName(r));
+            goto term;
+        }
+        if (write(fd, out.dst, out.pos) != (ssize_t)out.pos) {
+            fprintf(stderr, "Unable to decompress file \"%s\"\n", filename);
+            goto term;
+        }
+        *size += out.pos;
+    } while (in.pos < in.size || out.pos == out.size);
+    if (r != 0) {
+        fprintf(stderr, "Unable to decompress file \"%s\": file is truncated\n", filename);
+        goto term;
+    }
+    result = 0;
+term:
+    ZSTD_freeDCtx(dctx);
+    free(out.dst);
+    debug_return result;
 }
 
 static int dir_exists(const char *path) {
@@ -176,6 +465,62 @@ static int dir_exists(const char *path) {
     debug_return 0;
 }
 
+static bool is_compressed(const void *data, size_t len) {
+    const unsigned char *p = data;
+    return len >= 4 && (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) == ZSTD_MAGICNUMBER;
+}
+
+static bool is_compressed_fn(const char *filename) {
+    size_t l = strlen(filename);
+    return l >= sizeof(ZSTD_SUFFIX) - 1 && strcmp(filename + l - (sizeof(ZSTD_SUFFIX) - 1), ZSTD_SUFFIX) == 0;
+}
+
+static void load_dictionary(void) {
+    debug_enter();
+    const char *map = NULL;
+    size_t size = 0;
+    if (dictionary_loaded || dictionary_fn == NULL) {
+        debug_return;
+    }
+    dictionary_loaded = true;
+    map = file_map(dictionary_fn, &size);
+    if (map == NULL) {
+        fprintf(stderr, "Unable to load compression dictionary \"%s\"\n", dictionary_fn);
+        debug_return;
+    }
+    cdict = ZSTD_createCDict(map, size, ZSTD_CLEVEL_DEFAULT);
+    ddict = ZSTD_createDDict(map, size);
+    if (cdict == NULL || ddict == NULL) {
+        fprintf(stderr, "Unable to load compression dictionary \"%s\"\n", dictionary_fn);
+    }
+    file_unmap(map, size);
+    debug_return;
+}
+
+static const char *map_decompressed(const char *filename, const void *data, size_t len, size_t *size) {
+    debug_enter();
+    FILE *f = tmpfile();
+    void *map = NULL;
+    size_t n = 0;
+    if (f == NULL) {
+        fprintf(stderr, "Unable to create a temporary file to decompress \"%s\"\n", filename);
+        debug_return NULL;
+    }
+    if (decompress(filename, data, len, fileno(f), &n) || n == 0) {
+        goto term;
+    }
+    map = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map decompressed file \"%s\"\n", filename);
+        map = NULL;
+        goto term;
+    }
+    *size = n;
+term:
+    fclose(f);
+    debug_return map;
+}
+
 static int mk_dir(const char* path, mode_t mode) {
     debug_enter();
     struct stat st;
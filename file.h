@@ -10,16 +10,37 @@
 #ifndef _FILE_H
 #define _FILE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+/** @brief Identifies one version of a file's contents. */
+typedef struct file_version_t {
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime;
+} file_version_t;
+
+/** 
+ * @brief Append the given data to the given file. The file is created if it
+ * does not exist. The data is written with a single write() call so that
+ * the record is either appended whole or not at all.
+ * @param filename The file to append to.
+ * @param data The data to append.
+ * @return 0 on success, 1 on failure.
+ */
+extern int file_append(const char *filename, const char *data);
+
 /** 
- * @brief Append the given string to the temporary file. The file is created if it
- * does not exist.
- * @param f The file to append to.
- * @param s The string to append.
+ * @brief Append the given number of bytes to the given file, with a single
+ * write() call, like file_append().
+ * @param filename The file to append to.
+ * @param data The data to append.
+ * @param len Number of bytes in data.
  * @return 0 on success, 1 on failure.
  */
-extern int file_append_tmp(FILE **f, const char *s);
+extern int file_append_data(const char *filename, const void *data, size_t len);
 
 /** 
  * @brief Create the given path. Programmatic version of `mkdir -p`.
@@ -29,18 +50,73 @@ extern int file_append_tmp(FILE **f, const char *s);
 extern int file_create_path(const char *s);
 
 /** 
- * @brief Read the contents of the given file.
+ * @brief Get the modification time of the given file.
+ * @param filename The file to check.
+ * @return Modification time in nanoseconds since the epoch, 0 on error.
+ */
+extern int64_t file_get_mtime(const char *filename);
+
+/** 
+ * @brief Get the version of the given file. The version changes when the file
+ * is appended to, rewritten or replaced.
+ * @param filename The file to check.
+ * @param version Receives the version, all zeros if the file doesn't exist.
+ * @return 0 on success, 1 if the file doesn't exist.
+ */
+extern int file_get_version(const char *filename, file_version_t *version);
+
+/** 
+ * @brief Check whether the given file is zstd-compressed.
+ * @param filename The file to check.
+ * @return true if the file starts with the zstd magic number.
+ */
+extern bool file_is_compressed(const char *filename);
+
+/** 
+ * @brief Take an advisory lock on the given file, waiting until it is
+ * available. The file is created if it does not exist.
+ * @param filename The file to lock.
+ * @param exclusive true for an exclusive (write) lock, false for a shared
+ * (read) lock.
+ * @return A descriptor to pass to file_unlock(), -1 if the lock couldn't be
+ * taken.
+ */
+extern int file_lock(const char *filename, bool exclusive);
+
+/** 
+ * @brief Map the given file into memory, read-only. The mapping stays valid
+ * until file_unmap() is called, even if the file is replaced on disk. A
+ * zstd-compressed file is decompressed into a temporary file and that is
+ * mapped instead.
+ * @param filename The file to map.
+ * @param size Receives the size of the file.
+ * @return Pointer to the mapped contents, NULL if the file does not exist, is
+ * empty or can't be mapped.
+ */
+extern const char *file_map(const char *filename, size_t *size);
+
+/** 
+ * @brief Read the contents of the given file, decompressing it if it is
+ * zstd-compressed.
  * @param filename The file to read.
  * @return The contents of the file.
  */
 extern char *file_read(const char *filename);
 
 /** 
- * @brief Get the contents of the temporary file and close the file.
- * @param f The file to read.
- * @return The contents of the file or NULL on error
+ * @brief Remove the given file. It is not an error if the file does not
+ * exist.
+ * @param filename The file to remove.
+ * @return 0 on success, 1 on failure.
+ */
+extern int file_remove(const char *filename);
+
+/** 
+ * @brief Set the zstd dictionary used to compress and decompress files. The
+ * dictionary is loaded the first time it is needed.
+ * @param fn The dictionary file, as made by `zstd --train`, or NULL for none.
  */
-extern char *file_read_tmp(FILE **f);
+extern void file_set_dictionary(const char *fn);
 
 /** 
  * @brief Truncate the given file.
@@ -48,6 +124,19 @@ extern char *file_read_tmp(FILE **f);
  */
 extern void file_truncate(const char *filename);
 
+/** 
+ * @brief Release a lock taken with file_lock().
+ * @param fd The descriptor returned by file_lock().
+ */
+extern void file_unlock(int fd);
+
+/** 
+ * @brief Unmap a file mapped with file_map().
+ * @param map The mapped contents.
+ * @param size Size of the mapping, as returned by file_map().
+ */
+extern void file_unmap(const char *map, size_t size);
+
 /** 
  * @brief Write the given data to the given file.
  * @param filename The file to write to.
@@ -55,4 +144,26 @@ extern void file_truncate(const char *filename);
  */
 extern void file_write(const char *filename, const char *data);
 
+/** 
+ * @brief Overwrite part of an existing file without truncating it.
+ * @param filename The file to write to.
+ * @param offset Offset in the file to write at.
+ * @param data The data to write.
+ * @param len Number of bytes in data.
+ * @return 0 on success, 1 on failure.
+ */
+extern int file_write_at(const char *filename, uint64_t offset, const void *data, size_t len);
+
+/** 
+ * @brief Write the given number of bytes to the given file. The data is
+ * written to a temporary file which then replaces the given file, so readers
+ * (and mappings made with file_map()) never see a partially written file. If
+ * the filename ends in ".zst", the data is zstd-compressed first.
+ * @param filename The file to write to.
+ * @param data The data to write.
+ * @param len Number of bytes in data.
+ * @return 0 on success, 1 on failure.
+ */
+extern int file_write_data(const char *filename, const void *data, size_t len);
+
 #endif // _FILE_H
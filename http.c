@@ -0,0 +1,1427 @@
+/**
+ * @file http.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Send HTTP requests to the AI providers.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+#include <zstd.h>
+
+#include "chewie.h"
+#include "buffer.h"
+#include "http.h"
+#include "ratelimit.h"
+#include "route.h"
+
+/** @brief zstd level used for request bodies. Low, since bodies are compressed on every request. */
+#define HTTP_COMPRESS_LEVEL             3
+/** @brief Longest host name that is remembered. */
+#define HTTP_HOST_MAX                   256
+/** @brief Longest URL whose times to start answering are remembered. */
+#define HTTP_URL_MAX                    512
+
+// libcurl can only hand out and take back TLS sessions from 8.12 on.
+#if LIBCURL_VERSION_NUM >= 0x080c00
+#define HTTP_TLS_CACHE
+#endif
+
+/**
+ * @brief An easy handle in the pool, and what it holds on to until its
+ * request is done. url is where the request goes, which is only not the
+ * request's own for the second copy of a hedged request. limit_key names the
+ * rate limits the request is kept under, and tokens is about how many of them
+ * it uses. failed is set when the response is one the request will be sent
+ * again after, and written once any of the response has gone to the write
+ * function. A request isn't sent, or sent again, before due_ms. twin is the
+ * other copy of a hedged request, while both are going, and connect_to sends
+ * the second copy to another address of the same host.
+ */
+typedef struct handle_t {
+    CURL *curl;
+    struct curl_slist *headers;
+    void *body;
+    const http_request_t *request;
+    const char *url;
+    char *hedge_url;
+    struct curl_slist *connect_to;
+    char limit_key[RATELIMIT_KEY_MAX];
+    long tokens;
+    ratelimit_info_t limits;
+    long status;
+    int retries;
+    bool failed;
+    bool written;
+    bool held;
+    int64_t due_ms;
+    int64_t sent_ms;
+    struct handle_t *twin;
+    bool busy;
+} handle_t;
+
+/** @brief The address a host was found at, and when to stop using it. */
+typedef struct host_t {
+    char name[HTTP_HOST_MAX];
+    long port;
+    char addr[64];
+    time_t expires;
+    bool cached;
+} host_t;
+
+/** @brief How many milliseconds the latest requests to a URL took to start answering, oldest first. */
+typedef struct latency_t {
+    char url[HTTP_URL_MAX];
+    long ms[HTTP_HEDGE_SAMPLES];
+    int count;
+} latency_t;
+
+static handle_t pool[HTTP_POOL_SIZE];
+static CURLSH *share = NULL;
+static CURLM *multi = NULL;
+static int started = 0;
+static bool initialized = false;
+static bool compress = false;
+static char *cache_fn = NULL;
+static host_t hosts[HTTP_CACHE_HOSTS];
+static int host_count = 0;
+static struct curl_slist *resolve = NULL;
+static struct curl_slist *stale = NULL;
+static latency_t latencies[HTTP_CACHE_HOSTS];
+static int latency_count = 0;
+static bool hedging = false;
+static char *hedge_host = NULL;
+static unsigned int jitter = 0;
+#ifdef HTTP_TLS_CACHE
+static bool sessions = false;
+#endif
+static pthread_t warmer;
+static bool warming = false;
+static atomic_bool warm_cancel = false;
+static char *warm_url = NULL;
+
+static handle_t *acquire(void);
+static int add_header(handle_t *h, const char *line);
+static void build_resolve(void);
+static void cache_load(void);
+static void cache_save(void);
+static void cache_write(const char *data, size_t len);
+static int compress_body(handle_t *h, const char *body, size_t len, size_t *compressed_len);
+static int compare_ms(const void *a, const void *b);
+static latency_t *find_latency(const char *url, bool add);
+static host_t *find_host(const char *name, long port);
+static bool forget_host(CURL *curl, const char *url);
+static const http_request_t *finish(handle_t *h, CURLcode *result);
+static handle_t *hedge(CURLM *m, handle_t *h);
+static long hedge_delay(const char *url);
+static char *hedge_target(const char *url, const char *host);
+static int init(void);
+static void load_host(const char *s, time_t now);
+static void load_latency(char *s);
+static void note_latency(const char *url, long ms);
+static int64_t now_ms(void);
+static struct curl_slist *other_address(handle_t *h);
+static CURLcode perform_hedged(handle_t **hp);
+static int prepare(handle_t *h, const http_request_t *request, const char *url);
+static bool proxied(void);
+static size_t read_header(char *buffer, size_t size, size_t nitems, void *user_data);
+static void release(handle_t *h);
+static void remember_host(CURL *curl, const char *url);
+static bool retry(handle_t *h, CURLcode result);
+static bool retryable(CURLcode result);
+static bool same_host(const char *url1, const char *url2);
+static int seek(void *user_data, curl_off_t offset, int origin);
+static handle_t *send_held(long *timeout);
+static void setup(handle_t *h, const char *url);
+static int url_host(const char *url, char *name, size_t size, long *port);
+static void wait_due(handle_t *h);
+static void wait_warm(void);
+static void *warm(void *arg);
+static size_t warm_discard(char *ptr, size_t size, size_t nmemb, void *user_data);
+static int warm_progress(void *user_data, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+static size_t write_body(char *ptr, size_t size, size_t nmemb, void *user_data);
+#ifdef HTTP_TLS_CACHE
+static void hex_append(buffer_t *text, const unsigned char *data, size_t len);
+static size_t hex_decode(char *s);
+static void load_session(CURL *curl, char *s, time_t now);
+static CURLcode save_session(CURL *handle, void *user_data, const char *session_key, const unsigned char *shmac, size_t shmac_len, const unsigned char *sdata, size_t sdata_len, curl_off_t valid_until, int ietf_tls_id, const char *alpn, size_t earlydata_max);
+#endif
+
+void http_cancel(const http_request_t *request) {
+    debug_enter();
+    for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+        handle_t *h = &pool[i];
+        if (h->busy && h->request == request) {
+            curl_multi_remove_handle(multi, h->curl);
+            release(h);
+            started--;
+            break;
+        }
+    }
+    debug_return;
+}
+
+void http_connect(const char *host) {
+    debug_enter();
+    size_t l = 0;
+    if (host == NULL || warming) {
+        debug_return;
+    }
+    // libcurl is set up here, on the main thread, so the warm-up thread only
+    // has the HEAD to do.
+    if (!initialized && init()) {
+        debug_return;
+    }
+    l = strlen(host) + 2;
+    warm_url = malloc(l);
+    if (warm_url == NULL) {
+        debug_return;
+    }
+    snprintf(warm_url, l, "%s/", host);
+    atomic_store(&warm_cancel, false);
+    if (pthread_create(&warmer, NULL, warm, NULL) != 0) {
+        free(warm_url);
+        warm_url = NULL;
+        debug_return;
+    }
+    warming = true;
+    debug_return;
+}
+
+void http_exit(void) {
+    debug_enter();
+    atomic_store(&warm_cancel, true);
+    wait_warm();
+    if (!initialized) {
+        debug_return;
+    }
+    cache_save();
+    if (multi != NULL) {
+        for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+            if (pool[i].request != NULL) {
+                curl_multi_remove_handle(multi, pool[i].curl);
+            }
+        }
+        curl_multi_cleanup(multi);
+        multi = NULL;
+        started = 0;
+    }
+    for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+        if (pool[i].curl != NULL) {
+            curl_easy_cleanup(pool[i].curl);
+        }
+        curl_slist_free_all(pool[i].headers);
+        free(pool[i].body);
+        free(pool[i].hedge_url);
+        curl_slist_free_all(pool[i].connect_to);
+    }
+    memset(pool, 0, sizeof(pool));
+    curl_slist_free_all(resolve);
+    resolve = NULL;
+    curl_slist_free_all(stale);
+    stale = NULL;
+    host_count = 0;
+    latency_count = 0;
+    if (share != NULL) {
+        curl_share_cleanup(share);
+        share = NULL;
+    }
+    curl_global_cleanup();
+    initialized = false;
+    debug_return;
+}
+
+CURLcode http_perform(const http_request_t *request) {
+    debug_enter();
+    CURLcode res = CURLE_FAILED_INIT;
+    handle_t *h = NULL;
+    wait_warm();
+    if ((h = acquire()) == NULL) {
+        debug_return res;
+    }
+    if (prepare(h, request, request->url)) {
+        goto term;
+    }
+    do {
+        wait_due(h);
+        h->sent_ms = now_ms();
+        res = hedging && request->read == NULL ? perform_hedged(&h) : curl_easy_perform(h->curl);
+        if (res == CURLE_COULDNT_CONNECT && forget_host(h->curl, h->url)) {
+            debug("couldn't connect to remembered address for %s, looking it up again\n", h->url);
+            if (request->read == NULL || (request->rewind != NULL && request->rewind(request->read_data) == 0)) {
+                res = curl_easy_perform(h->curl);
+            }
+        }
+        if (res == CURLE_OK) {
+            remember_host(h->curl, h->url);
+            if (!h->failed) {
+                curl_off_t us = 0;
+                if (curl_easy_getinfo(h->curl, CURLINFO_STARTTRANSFER_TIME_T, &us) == CURLE_OK) {
+                    note_latency(h->url, (long)(us / 1000));
+                }
+            }
+        }
+    } while (retry(h, res));
+term:
+    release(h);
+    debug_return res;
+}
+
+void http_set_cache(const char *filename) {
+    debug_enter();
+    wait_warm();
+    free(cache_fn);
+    cache_fn = filename != NULL ? strdup(filename) : NULL;
+    debug_return;
+}
+
+void http_set_compress(bool c) {
+    wait_warm();
+    compress = c;
+}
+
+void http_set_hedge(bool hedge, const char *host) {
+    debug_enter();
+    wait_warm();
+    hedging = hedge;
+    free(hedge_host);
+    hedge_host = host != NULL ? strdup(host) : NULL;
+    debug_return;
+}
+
+int http_start(const http_request_t *request) {
+    debug_enter();
+    handle_t *h = NULL;
+    wait_warm();
+    if ((h = acquire()) == NULL) {
+        debug_return 1;
+    }
+    if (multi == NULL) {
+        if ((multi = curl_multi_init()) == NULL) {
+            fprintf(stderr, "API request error: couldn't initialize curl\n");
+            release(h);
+            debug_return 1;
+        }
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    }
+    if (prepare(h, request, request->url)) {
+        release(h);
+        debug_return 1;
+    }
+    long ms = ratelimit_acquire(h->limit_key, h->tokens);
+    if (ms > 0) {
+        debug("holding request to %s back %ld ms for the rate limits\n", request->url, ms);
+        h->held = true;
+        h->due_ms = now_ms() + ms;
+    } else if (curl_multi_add_handle(multi, h->curl) != CURLM_OK) {
+        fprintf(stderr, "API request error: couldn't start request\n");
+        release(h);
+        debug_return 1;
+    }
+    started++;
+    debug_return 0;
+}
+
+const http_request_t *http_wait(CURLcode *result) {
+    debug_enter();
+    CURLMsg *msg = NULL;
+    CURLMcode mc = CURLM_OK;
+    bool performed = false;
+    int running = 0;
+    int left = 0;
+    while (started > 0) {
+        // Hand out whatever has finished before waiting for anything else.
+        while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            const http_request_t *request = NULL;
+            handle_t *h = NULL;
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            *result = msg->data.result;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&h);
+            if ((request = finish(h, result)) != NULL) {
+                debug_return request;
+            }
+        }
+        long timeout = 1000;
+        handle_t *h = send_held(&timeout);
+        if (h != NULL) {
+            const http_request_t *request = h->request;
+            fprintf(stderr, "API request error: couldn't start request\n");
+            *result = CURLE_FAILED_INIT;
+            release(h);
+            started--;
+            debug_return request;
+        }
+        if (performed) {
+            mc = curl_multi_poll(multi, NULL, 0, (int)timeout, NULL);
+        }
+        if (mc == CURLM_OK) {
+            mc = curl_multi_perform(multi, &running);
+        }
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "API request error: %s\n", curl_multi_strerror(mc));
+            debug_return NULL;
+        }
+        performed = true;
+    }
+    debug_return NULL;
+}
+
+static handle_t *acquire(void) {
+    if (!initialized && init()) {
+        return NULL;
+    }
+    for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+        handle_t *h = &pool[i];
+        if (h->busy) {
+            continue;
+        }
+        if (h->curl == NULL && (h->curl = curl_easy_init()) == NULL) {
+            fprintf(stderr, "API request error: couldn't initialize curl\n");
+            return NULL;
+        }
+        h->busy = true;
+        return h;
+    }
+    fprintf(stderr, "API request error: more than %d requests at once\n", HTTP_POOL_SIZE);
+    return NULL;
+}
+
+static int add_header(handle_t *h, const char *line) {
+    struct curl_slist *headers = curl_slist_append(h->headers, line);
+    if (headers == NULL) {
+        fprintf(stderr, "Error allocating HTTP header\n");
+        return 1;
+    }
+    h->headers = headers;
+    return 0;
+}
+
+/**
+ * @brief Make the list of remembered addresses to hand to libcurl, in the
+ * form CURLOPT_RESOLVE takes. The "+" lets them expire from libcurl's DNS
+ * cache like any address it looked up itself.
+ */
+static void build_resolve(void) {
+    char line[HTTP_HOST_MAX + 96];
+    curl_slist_free_all(resolve);
+    resolve = NULL;
+    for (int i = 0; i < host_count; i++) {
+        const host_t *h = &hosts[i];
+        bool v6 = strchr(h->addr, ':') != NULL;
+        if (!h->cached) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "+%s:%ld:%s%s%s", h->name, h->port, v6 ? "[" : "", h->addr, v6 ? "]" : "");
+        struct curl_slist *list = curl_slist_append(resolve, line);
+        if (list == NULL) {
+            break;
+        }
+        resolve = list;
+    }
+}
+
+/**
+ * @brief Read the addresses and TLS sessions saved by an earlier run,
+ * skipping any that have expired. A missing or unreadable cache just means
+ * starting from nothing.
+ */
+static void cache_load(void) {
+    debug_enter();
+    FILE *f = NULL;
+    CURL *curl = NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    time_t now = time(NULL);
+    if (cache_fn == NULL || (f = fopen(cache_fn, "r")) == NULL) {
+        debug_return;
+    }
+    while (getline(&line, &cap, f) != -1) {
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "dns ", 4) == 0) {
+            load_host(line + 4, now);
+        }
+        if (strncmp(line, "lat ", 4) == 0) {
+            load_latency(line + 4);
+        }
+#ifdef HTTP_TLS_CACHE
+        // Sessions are imported through an easy handle into the cache it
+        // shares with the pool.
+        if (sessions && strncmp(line, "tls ", 4) == 0) {
+            if (curl == NULL && (curl = curl_easy_init()) != NULL) {
+                curl_easy_setopt(curl, CURLOPT_SHARE, share);
+            }
+            if (curl != NULL) {
+                load_session(curl, line + 4, now);
+            }
+        }
+#endif
+    }
+    if (curl != NULL) {
+        curl_easy_cleanup(curl);
+    }
+    free(line);
+    fclose(f);
+    build_resolve();
+    debug("loaded %d host addresses from %s\n", host_count, cache_fn);
+    debug_return;
+}
+
+/**
+ * @brief Save the addresses and TLS sessions that are still good for the
+ * next run, and the times the URLs took to start answering. Each address
+ * line is "dns host port address expires", each time line "lat url ms...",
+ * each session line "tls expires hmac data key", with the binary fields in
+ * hex.
+ */
+static void cache_save(void) {
+    debug_enter();
+    buffer_t text = {.spill_size = SIZE_MAX};
+    char line[HTTP_HOST_MAX + 128];
+    time_t now = time(NULL);
+    if (cache_fn == NULL) {
+        debug_return;
+    }
+    for (int i = 0; i < host_count; i++) {
+        const host_t *h = &hosts[i];
+        if (h->expires > now) {
+            int len = snprintf(line, sizeof(line), "dns %s %ld %s %lld\n", h->name, h->port, h->addr, (long long)h->expires);
+            buffer_append(&text, line, len);
+        }
+    }
+    for (int i = 0; i < latency_count; i++) {
+        const latency_t *l = &latencies[i];
+        buffer_append(&text, "lat ", 4);
+        buffer_append(&text, l->url, strlen(l->url));
+        for (int j = 0; j < l->count; j++) {
+            int len = snprintf(line, sizeof(line), " %ld", l->ms[j]);
+            buffer_append(&text, line, len);
+        }
+        buffer_append(&text, "\n", 1);
+    }
+#ifdef HTTP_TLS_CACHE
+    if (sessions && share != NULL) {
+        CURL *curl = curl_easy_init();
+        if (curl != NULL) {
+            curl_easy_setopt(curl, CURLOPT_SHARE, share);
+            curl_easy_ssls_export(curl, save_session, &text);
+            curl_easy_cleanup(curl);
+        }
+    }
+#endif
+    cache_write(text.data != NULL ? text.data : "", text.len);
+    buffer_free(&text);
+    debug_return;
+}
+
+/**
+ * @brief Replace the cache file. It's written to a temporary file first so
+ * that another chewie starting at the same time never reads half of it, and
+ * it's only readable by the user, since it holds TLS session secrets.
+ */
+static void cache_write(const char *data, size_t len) {
+    size_t l = strlen(cache_fn) + sizeof(".XXXXXX");
+    char *tmp_fn = malloc(l);
+    int fd = -1;
+    if (tmp_fn == NULL) {
+        return;
+    }
+    snprintf(tmp_fn, l, "%s.XXXXXX", cache_fn);
+    fd = mkstemp(tmp_fn);
+    if (fd == -1) {
+        debug("unable to create %s\n", tmp_fn);
+        free(tmp_fn);
+        return;
+    }
+    if (write(fd, data, len) != (ssize_t)len || close(fd) != 0 || rename(tmp_fn, cache_fn) != 0) {
+        debug("unable to write %s\n", cache_fn);
+        unlink(tmp_fn);
+    }
+    free(tmp_fn);
+}
+
+static int compress_body(handle_t *h, const char *body, size_t len, size_t *compressed_len) {
+    size_t cap = ZSTD_compressBound(len);
+    h->body = malloc(cap);
+    if (h->body == NULL) {
+        return 1;
+    }
+    *compressed_len = ZSTD_compress(h->body, cap, body, len, HTTP_COMPRESS_LEVEL);
+    if (ZSTD_isError(*compressed_len) || *compressed_len >= len) {
+        free(h->body);
+        h->body = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+static int compare_ms(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Find the times kept for url. If there are none yet and add is true,
+ * a place is made for them, in place of the URL that was least recently
+ * added to if there's no room. Returns NULL if there are none and add is
+ * false.
+ */
+static latency_t *find_latency(const char *url, bool add) {
+    latency_t *l = NULL;
+    for (int i = 0; i < latency_count; i++) {
+        if (strcmp(latencies[i].url, url) == 0) {
+            return &latencies[i];
+        }
+    }
+    if (!add || strlen(url) >= HTTP_URL_MAX || strchr(url, ' ') != NULL) {
+        return NULL;
+    }
+    if (latency_count == HTTP_CACHE_HOSTS) {
+        memmove(latencies, latencies + 1, (HTTP_CACHE_HOSTS - 1) * sizeof(latency_t));
+        latency_count--;
+    }
+    l = &latencies[latency_count++];
+    memset(l, 0, sizeof(latency_t));
+    snprintf(l->url, sizeof(l->url), "%s", url);
+    return l;
+}
+
+static host_t *find_host(const char *name, long port) {
+    for (int i = 0; i < host_count; i++) {
+        if (hosts[i].port == port && strcmp(hosts[i].name, name) == 0) {
+            return &hosts[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Drop the remembered address for the host in url, if there is one,
+ * and have the handle remove it from libcurl's DNS cache on its next request.
+ * Returns true if an address was dropped.
+ */
+static bool forget_host(CURL *curl, const char *url) {
+    char name[HTTP_HOST_MAX];
+    char line[HTTP_HOST_MAX + 32];
+    long port = 0;
+    host_t *h = NULL;
+    if (url_host(url, name, sizeof(name), &port) || (h = find_host(name, port)) == NULL || !h->cached) {
+        return false;
+    }
+    memmove(h, h + 1, (&hosts[host_count] - (h + 1)) * sizeof(host_t));
+    host_count--;
+    build_resolve();
+    snprintf(line, sizeof(line), "-%s:%ld", name, port);
+    struct curl_slist *list = curl_slist_append(stale, line);
+    if (list != NULL) {
+        stale = list;
+    }
+    curl_easy_setopt(curl, CURLOPT_RESOLVE, stale);
+    return true;
+}
+
+/**
+ * @brief Take a finished request off the multi handle. A request that
+ * couldn't connect to a remembered address is sent again, as http_perform()
+ * would, and a request that is to be retried is held until it's due, in
+ * which cases NULL is returned.
+ */
+static const http_request_t *finish(handle_t *h, CURLcode *result) {
+    const http_request_t *request = h->request;
+    curl_multi_remove_handle(multi, h->curl);
+    if (*result == CURLE_COULDNT_CONNECT && forget_host(h->curl, h->url) &&
+        (request->read == NULL || (request->rewind != NULL && request->rewind(request->read_data) == 0)) &&
+        curl_multi_add_handle(multi, h->curl) == CURLM_OK) {
+        debug("couldn't connect to remembered address for %s, looking it up again\n", h->url);
+        return NULL;
+    }
+    if (*result == CURLE_OK) {
+        remember_host(h->curl, h->url);
+    }
+    if (retry(h, *result)) {
+        h->held = true;
+        return NULL;
+    }
+    release(h);
+    started--;
+    return request;
+}
+
+/**
+ * @brief Send a second copy of the request h is sending, on the multi handle
+ * m, to the hedge host, the next host of the pool, or another address of its
+ * own host. Returns the copy's handle, or NULL if there's nowhere else to send
+ * it, it couldn't be sent, or the rate limits don't leave room for it.
+ */
+static handle_t *hedge(CURLM *m, handle_t *h) {
+    const char *host = hedge_host != NULL ? hedge_host : route_next_host(h->url);
+    struct curl_slist *connect_to = NULL;
+    char *url = NULL;
+    handle_t *twin = NULL;
+    // A copy sent to the same server as the first would only double the work
+    // of a server that's already slow.
+    if (host != NULL) {
+        url = hedge_target(h->url, host);
+    } else if ((connect_to = other_address(h)) != NULL) {
+        url = strdup(h->url);
+    } else {
+        debug("%s hasn't answered, but there's nowhere else to send the request\n", h->url);
+        return NULL;
+    }
+    if (url == NULL || (twin = acquire()) == NULL) {
+        free(url);
+        curl_slist_free_all(connect_to);
+        return NULL;
+    }
+    twin->hedge_url = url;
+    twin->connect_to = connect_to;
+    if (prepare(twin, h->request, url) || ratelimit_acquire(twin->limit_key, twin->tokens) > 0) {
+        release(twin);
+        return NULL;
+    }
+    // A hedge host that's the request's own, behind a load balancer, is
+    // reached over a new connection, which can land on another replica.
+    if (connect_to != NULL) {
+        curl_easy_setopt(twin->curl, CURLOPT_CONNECT_TO, connect_to);
+    } else if (same_host(h->url, url)) {
+        curl_easy_setopt(twin->curl, CURLOPT_FRESH_CONNECT, 1L);
+    }
+    if (curl_multi_add_handle(m, twin->curl) != CURLM_OK) {
+        release(twin);
+        return NULL;
+    }
+    debug("%s hasn't answered in %ld ms, sending the request to %s as well\n", h->url, (long)(now_ms() - h->sent_ms), url);
+    twin->retries = h->retries;
+    twin->sent_ms = now_ms();
+    twin->twin = h;
+    h->twin = twin;
+    return twin;
+}
+
+/**
+ * @brief Get how long to wait for url to start answering before hedging, the
+ * HTTP_HEDGE_PERCENTILE percentile of the times kept for it. Returns -1 if
+ * too few are kept to tell.
+ */
+static long hedge_delay(const char *url) {
+    const latency_t *l = find_latency(url, false);
+    long ms[HTTP_HEDGE_SAMPLES];
+    if (l == NULL || l->count < HTTP_HEDGE_SAMPLES_MIN) {
+        return -1;
+    }
+    memcpy(ms, l->ms, l->count * sizeof(long));
+    qsort(ms, l->count, sizeof(long), compare_ms);
+    return ms[(l->count * HTTP_HEDGE_PERCENTILE + 99) / 100 - 1];
+}
+
+/**
+ * @brief Make the URL the second copy of a request to url goes to, its path
+ * and query on host. Returns NULL on error.
+ */
+static char *hedge_target(const char *url, const char *host) {
+    CURLU *u = NULL;
+    char *path = NULL;
+    char *query = NULL;
+    char *target = NULL;
+    size_t l = 0;
+    u = curl_url();
+    if (u != NULL && curl_url_set(u, CURLUPART_URL, url, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_PATH, &path, 0) == CURLUE_OK) {
+        curl_url_get(u, CURLUPART_QUERY, &query, 0);
+        l = strlen(host) + strlen(path) + (query != NULL ? strlen(query) + 1 : 0) + 1;
+        if ((target = malloc(l)) != NULL) {
+            size_t n = strlen(host);
+            while (n > 0 && host[n - 1] == '/') {
+                n--;
+            }
+            snprintf(target, l, "%.*s%s%s%s", (int)n, host, path, query != NULL ? "?" : "", query != NULL ? query : "");
+        }
+    }
+    curl_free(path);
+    curl_free(query);
+    curl_url_cleanup(u);
+    return target;
+}
+
+#ifdef HTTP_TLS_CACHE
+static void hex_append(buffer_t *text, const unsigned char *data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    char pair[2];
+    for (size_t i = 0; i < len; i++) {
+        pair[0] = digits[data[i] >> 4];
+        pair[1] = digits[data[i] & 0x0f];
+        buffer_append(text, pair, 2);
+    }
+}
+
+/**
+ * @brief Turn the hex string s into the bytes it spells, in place. Returns
+ * the number of bytes.
+ */
+static size_t hex_decode(char *s) {
+    size_t len = strlen(s) / 2;
+    for (size_t i = 0; i < len; i++) {
+        char pair[3] = {s[2 * i], s[2 * i + 1], 0};
+        s[i] = (char)strtoul(pair, NULL, 16);
+    }
+    return len;
+}
+#endif
+
+static int init(void) {
+    debug_enter();
+    CURLcode res = curl_global_init(CURL_GLOBAL_DEFAULT);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
+        debug_return 1;
+    }
+    // Without a share handle, each easy handle still keeps its own
+    // connections, so it's not an error if this fails.
+    share = curl_share_init();
+    if (share != NULL) {
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+#ifdef HTTP_TLS_CACHE
+    sessions = share != NULL && (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_SSLS_EXPORT) != 0;
+#endif
+    jitter = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    cache_load();
+    initialized = true;
+    debug_return 0;
+}
+
+static void load_host(const char *s, time_t now) {
+    host_t h = {.cached = true};
+    long long expires = 0;
+    if (host_count == HTTP_CACHE_HOSTS) {
+        return;
+    }
+    if (sscanf(s, "%255s %ld %63s %lld", h.name, &h.port, h.addr, &expires) != 4 || expires <= now) {
+        return;
+    }
+    h.expires = (time_t)expires;
+    hosts[host_count++] = h;
+}
+
+static void load_latency(char *s) {
+    char *url = strtok(s, " ");
+    char *ms = NULL;
+    latency_t *l = NULL;
+    if (url == NULL || (l = find_latency(url, true)) == NULL) {
+        return;
+    }
+    l->count = 0;
+    while (l->count < HTTP_HEDGE_SAMPLES && (ms = strtok(NULL, " ")) != NULL) {
+        l->ms[l->count++] = strtol(ms, NULL, 10);
+    }
+}
+
+#ifdef HTTP_TLS_CACHE
+static void load_session(CURL *curl, char *s, time_t now) {
+    char *fields[3];
+    char *key = s;
+    for (int i = 0; i < 3; i++) {
+        fields[i] = key;
+        if ((key = strchr(key, ' ')) == NULL) {
+            return;
+        }
+        *key++ = 0;
+    }
+    if (strtoll(fields[0], NULL, 10) <= now) {
+        return;
+    }
+    size_t shmac_len = hex_decode(fields[1]);
+    size_t sdata_len = hex_decode(fields[2]);
+    curl_easy_ssls_import(curl, key, (unsigned char *)fields[1], shmac_len, (unsigned char *)fields[2], sdata_len);
+}
+#endif
+
+/**
+ * @brief Keep how long a request to url took to start answering, in place of
+ * the oldest time kept for it if there's no room.
+ */
+static void note_latency(const char *url, long ms) {
+    latency_t *l = find_latency(url, true);
+    if (l == NULL) {
+        return;
+    }
+    if (l->count == HTTP_HEDGE_SAMPLES) {
+        memmove(l->ms, l->ms + 1, (HTTP_HEDGE_SAMPLES - 1) * sizeof(long));
+        l->count--;
+    }
+    l->ms[l->count++] = ms;
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Find an address of the host h's request went to that it isn't
+ * connected to, if the host has more than one, and make the CURLOPT_CONNECT_TO
+ * entry that sends a request there. Returns NULL if it only has the one.
+ */
+static struct curl_slist *other_address(handle_t *h) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *list = NULL;
+    struct curl_slist *entry = NULL;
+    char name[HTTP_HOST_MAX];
+    char addr[INET6_ADDRSTRLEN];
+    char *primary = NULL;
+    long port = 0;
+    if (url_host(h->url, name, sizeof(name), &port) || getaddrinfo(name, NULL, &hints, &list) != 0) {
+        return NULL;
+    }
+    // Before it has connected, the request is taken to be on the first
+    // address.
+    if (curl_easy_getinfo(h->curl, CURLINFO_PRIMARY_IP, &primary) != CURLE_OK || (primary != NULL && *primary == 0)) {
+        primary = NULL;
+    }
+    for (const struct addrinfo *a = list; a != NULL && entry == NULL; a = a->ai_next) {
+        char s[HTTP_HOST_MAX + INET6_ADDRSTRLEN + 48];
+        const void *ip = a->ai_family == AF_INET6 ? (const void *)&((struct sockaddr_in6 *)a->ai_addr)->sin6_addr : (const void *)&((struct sockaddr_in *)a->ai_addr)->sin_addr;
+        bool v6 = a->ai_family == AF_INET6;
+        if ((a->ai_family != AF_INET && !v6) || inet_ntop(a->ai_family, ip, addr, sizeof(addr)) == NULL ||
+            (primary != NULL ? strcmp(addr, primary) == 0 : a == list)) {
+            continue;
+        }
+        snprintf(s, sizeof(s), "%s:%ld:%s%s%s:%ld", name, port, v6 ? "[" : "", addr, v6 ? "]" : "", port);
+        entry = curl_slist_append(NULL, s);
+    }
+    freeaddrinfo(list);
+    return entry;
+}
+
+/**
+ * @brief Send a request on a multi handle of its own, and send a second copy
+ * if it's slow to start answering. Whichever copy writes first wins, and the
+ * other is dropped. A copy that fails before either has written drops out,
+ * leaving the other to finish. *hp is left at the handle of the copy that
+ * finished, whose result is returned.
+ */
+static CURLcode perform_hedged(handle_t **hp) {
+    handle_t *h = *hp;
+    handle_t *twin = NULL;
+    CURLM *m = NULL;
+    CURLMsg *msg = NULL;
+    CURLMcode mc = CURLM_OK;
+    CURLcode res = CURLE_OK;
+    long delay = hedge_delay(h->url);
+    int running = 0;
+    int left = 0;
+    bool done = false;
+    if (delay < 0 || (m = curl_multi_init()) == NULL) {
+        return curl_easy_perform(h->curl);
+    }
+    if (curl_multi_add_handle(m, h->curl) != CURLM_OK) {
+        curl_multi_cleanup(m);
+        return curl_easy_perform(h->curl);
+    }
+    while (!done) {
+        if ((mc = curl_multi_perform(m, &running)) != CURLM_OK) {
+            fprintf(stderr, "API request error: %s\n", curl_multi_strerror(mc));
+            res = CURLE_FAILED_INIT;
+            break;
+        }
+        while ((msg = curl_multi_info_read(m, &left)) != NULL) {
+            handle_t *f = NULL;
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&f);
+            // A copy that failed before either wrote leaves the other
+            // running, if there is one.
+            if (twin != NULL && !f->written && (msg->data.result != CURLE_OK || f->failed)) {
+                handle_t *other = f == h ? twin : h;
+                debug("copy of hedged request to %s failed, waiting for %s\n", f->url, other->url);
+                if (msg->data.result == CURLE_OK) {
+                    ratelimit_update(f->limit_key, &f->limits, f->status == 429);
+                }
+                curl_multi_remove_handle(m, f->curl);
+                f->twin = NULL;
+                other->twin = NULL;
+                release(f);
+                h = other;
+                twin = NULL;
+                continue;
+            }
+            res = msg->data.result;
+            h = f;
+            done = true;
+            break;
+        }
+        if (done) {
+            break;
+        }
+        // Once a copy has written, the other has lost.
+        if (twin != NULL && (h->written || twin->written)) {
+            handle_t *loser = h->written ? twin : h;
+            handle_t *winner = loser->twin;
+            debug("%s answered first, dropping %s\n", winner->url, loser->url);
+            if (loser == *hp) {
+                note_latency(loser->url, (long)(now_ms() - loser->sent_ms));
+            }
+            curl_multi_remove_handle(m, loser->curl);
+            winner->twin = NULL;
+            release(loser);
+            h = winner;
+            twin = NULL;
+        }
+        long timeout = 1000;
+        if (twin == NULL && delay >= 0) {
+            long ms = (long)(h->sent_ms + delay - now_ms());
+            if (ms <= 0) {
+                delay = -1;
+                twin = h->written ? NULL : hedge(m, h);
+            } else if (ms < timeout) {
+                timeout = ms;
+            }
+        }
+        if ((mc = curl_multi_poll(m, NULL, 0, (int)timeout, NULL)) != CURLM_OK) {
+            fprintf(stderr, "API request error: %s\n", curl_multi_strerror(mc));
+            res = CURLE_FAILED_INIT;
+            break;
+        }
+    }
+    if (twin != NULL) {
+        handle_t *other = h == twin ? twin->twin : twin;
+        curl_multi_remove_handle(m, other->curl);
+        h->twin = NULL;
+        release(other);
+    }
+    curl_multi_remove_handle(m, h->curl);
+    curl_multi_cleanup(m);
+    *hp = h;
+    return res;
+}
+
+/**
+ * @brief Set a handle up to send a request, with the options every request is
+ * made with, the request's body and its headers. The response goes through
+ * read_header() and write_body() on its way to the request's write function.
+ */
+static int prepare(handle_t *h, const http_request_t *request, const char *url) {
+    CURL *curl = h->curl;
+    char name[HTTP_HOST_MAX];
+    long port = 0;
+    setup(h, url);
+    h->request = request;
+    h->url = url;
+    if (url_host(url, name, sizeof(name), &port)) {
+        snprintf(name, sizeof(name), "-");
+    }
+    snprintf(h->limit_key, sizeof(h->limit_key), "%s:%ld/%s", name, port, request->model != NULL ? request->model : "-");
+    h->tokens = request->body_len != SIZE_MAX ? (long)(request->body_len / RATELIMIT_BYTES_PER_TOKEN) : 0;
+    ratelimit_reset(&h->limits);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, h);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_body);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, h);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, h);
+    if (request->header != NULL && add_header(h, request->header)) {
+        return 1;
+    }
+    if (request->read != NULL) {
+        if (add_header(h, "Content-Type: application/json") || add_header(h, "Expect:")) {
+            return 1;
+        }
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, request->read);
+        curl_easy_setopt(curl, CURLOPT_READDATA, request->read_data);
+        if (request->body_len == SIZE_MAX) {
+            // HTTP/1.1 needs this to send a body of unknown length. libcurl
+            // leaves it out over HTTP/2, which doesn't.
+            if (add_header(h, "Transfer-Encoding: chunked")) {
+                return 1;
+            }
+        } else {
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)request->body_len);
+        }
+        if (request->rewind != NULL) {
+            curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seek);
+            curl_easy_setopt(curl, CURLOPT_SEEKDATA, (void *)request);
+        }
+    } else if (request->body != NULL) {
+        const char *body = request->body;
+        size_t len = request->body_len;
+        size_t compressed_len = 0;
+        // Don't wait for "100 Continue" before sending a large body.
+        if (add_header(h, "Content-Type: application/json") || add_header(h, "Expect:")) {
+            return 1;
+        }
+        if (compress && len >= HTTP_COMPRESS_MIN && compress_body(h, body, len, &compressed_len) == 0) {
+            if (add_header(h, "Content-Encoding: zstd")) {
+                return 1;
+            }
+            debug("compressed %zu byte request body to %zu bytes\n", len, compressed_len);
+            body = h->body;
+            len = compressed_len;
+        }
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)len);
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    }
+    if (h->headers != NULL) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, h->headers);
+    }
+    return 0;
+}
+
+/**
+ * @brief Check for a proxy in the environment. Through a proxy, the address
+ * libcurl connects to is the proxy's, not the host's.
+ */
+static bool proxied(void) {
+    static const char *names[] = {"http_proxy", "https_proxy", "HTTPS_PROXY", "all_proxy", "ALL_PROXY", NULL};
+    for (int i = 0; names[i] != NULL; i++) {
+        const char *s = getenv(names[i]);
+        if (s != NULL && *s != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Note the status of a response, and what its headers say about the
+ * rate limits. A 429 or 5xx response that the request will be sent again
+ * after is kept from the write function.
+ */
+static size_t read_header(char *buffer, size_t size, size_t nitems, void *user_data) {
+    handle_t *h = (handle_t *)user_data;
+    size_t len = size * nitems;
+    if (len > 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+        const char *s = memchr(buffer, ' ', len);
+        h->status = s != NULL ? strtol(s + 1, NULL, 10) : 0;
+        h->failed = (h->status == 429 || h->status >= 500) && h->retries < HTTP_RETRIES && (h->request->read == NULL || h->request->rewind != NULL);
+        ratelimit_reset(&h->limits);
+    } else {
+        ratelimit_header(&h->limits, buffer, len);
+    }
+    return len;
+}
+
+static void release(handle_t *h) {
+    curl_easy_reset(h->curl);
+    curl_slist_free_all(h->headers);
+    h->headers = NULL;
+    free(h->body);
+    h->body = NULL;
+    free(h->hedge_url);
+    h->hedge_url = NULL;
+    curl_slist_free_all(h->connect_to);
+    h->connect_to = NULL;
+    h->request = NULL;
+    h->url = NULL;
+    h->status = 0;
+    h->retries = 0;
+    h->failed = false;
+    h->written = false;
+    h->held = false;
+    h->due_ms = 0;
+    h->twin = NULL;
+    h->busy = false;
+}
+
+/**
+ * @brief Note the address a request connected to, if libcurl had to look the
+ * host up to find it. Addresses taken from the cache keep the expiry they
+ * were saved with, so that the host is looked up again once it has passed.
+ */
+static void remember_host(CURL *curl, const char *url) {
+    char name[HTTP_HOST_MAX];
+    char *addr = NULL;
+    long port = 0;
+    host_t *h = NULL;
+    if (cache_fn == NULL || url_host(url, name, sizeof(name), &port) || name[0] == '[') {
+        return;
+    }
+    if (curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &addr) != CURLE_OK || addr == NULL || *addr == 0 || strcmp(addr, name) == 0) {
+        return;
+    }
+    if ((h = find_host(name, port)) != NULL) {
+        if (h->cached || strcmp(h->addr, addr) == 0) {
+            return;
+        }
+    } else {
+        if (host_count == HTTP_CACHE_HOSTS || proxied()) {
+            return;
+        }
+        h = &hosts[host_count++];
+    }
+    snprintf(h->name, sizeof(h->name), "%s", name);
+    snprintf(h->addr, sizeof(h->addr), "%s", addr);
+    h->port = port;
+    h->expires = time(NULL) + HTTP_DNS_TTL;
+    h->cached = false;
+}
+
+/**
+ * @brief Pass on what the response said about the rate limits, and decide
+ * whether the request is sent again. Returns true if it is, with its body
+ * started over and due_ms set to when it may go. The wait doubles with each
+ * retry, and is somewhere between half and all of that, or as long as a
+ * Retry-After header asks if that's longer.
+ */
+static bool retry(handle_t *h, CURLcode result) {
+    const http_request_t *request = h->request;
+    bool again = false;
+    long ms = HTTP_RETRY_MAX_MS;
+    if (result == CURLE_OK) {
+        ratelimit_update(h->limit_key, &h->limits, h->status == 429);
+        again = h->failed;
+    } else {
+        again = !h->written && h->retries < HTTP_RETRIES && retryable(result);
+    }
+    h->failed = false;
+    if (!again || (request->read != NULL && (request->rewind == NULL || request->rewind(request->read_data) != 0))) {
+        return false;
+    }
+    h->retries++;
+    if (h->retries <= 6 && (HTTP_RETRY_BASE_MS << (h->retries - 1)) < HTTP_RETRY_MAX_MS) {
+        ms = HTTP_RETRY_BASE_MS << (h->retries - 1);
+    }
+    ms = ms / 2 + rand_r(&jitter) % (ms / 2 + 1);
+    if (result == CURLE_OK && h->limits.retry_after_ms > ms) {
+        ms = h->limits.retry_after_ms;
+    }
+    h->due_ms = now_ms() + ms;
+    if (result == CURLE_OK) {
+        debug("%s answered %ld, sending the request again in %ld ms (%d of %d)\n", h->url, h->status, ms, h->retries, HTTP_RETRIES);
+    } else {
+        debug("request to %s failed: %s, sending it again in %ld ms (%d of %d)\n", h->url, curl_easy_strerror(result), ms, h->retries, HTTP_RETRIES);
+    }
+    return true;
+}
+
+/**
+ * @brief Check whether a request that failed with result might get through
+ * if it's sent again: the connection couldn't be made, or timed out, or
+ * broke.
+ */
+static bool retryable(CURLcode result) {
+    switch (result) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_GOT_NOTHING:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_RECV_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_SSL_CONNECT_ERROR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool same_host(const char *url1, const char *url2) {
+    char name1[HTTP_HOST_MAX];
+    char name2[HTTP_HOST_MAX];
+    long port1 = 0;
+    long port2 = 0;
+    return url_host(url1, name1, sizeof(name1), &port1) == 0 && url_host(url2, name2, sizeof(name2), &port2) == 0 &&
+        port1 == port2 && strcasecmp(name1, name2) == 0;
+}
+
+#ifdef HTTP_TLS_CACHE
+static CURLcode save_session(CURL *handle, void *user_data, const char *session_key, const unsigned char *shmac, size_t shmac_len, const unsigned char *sdata, size_t sdata_len, curl_off_t valid_until, int ietf_tls_id, const char *alpn, size_t earlydata_max) {
+    buffer_t *text = (buffer_t *)user_data;
+    char line[32];
+    (void)handle;
+    (void)ietf_tls_id;
+    (void)alpn;
+    (void)earlydata_max;
+    if (valid_until <= time(NULL) || strchr(session_key, '\n') != NULL) {
+        return CURLE_OK;
+    }
+    int len = snprintf(line, sizeof(line), "tls %lld ", (long long)valid_until);
+    buffer_append(text, line, len);
+    hex_append(text, shmac, shmac_len);
+    buffer_append(text, " ", 1);
+    hex_append(text, sdata, sdata_len);
+    buffer_append(text, " ", 1);
+    buffer_append(text, session_key, strlen(session_key));
+    buffer_append(text, "\n", 1);
+    return CURLE_OK;
+}
+#endif
+
+static int seek(void *user_data, curl_off_t offset, int origin) {
+    const http_request_t *request = (const http_request_t *)user_data;
+    if (offset != 0 || origin != SEEK_SET) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    return request->rewind(request->read_data) == 0 ? CURL_SEEKFUNC_OK : CURL_SEEKFUNC_FAIL;
+}
+
+/**
+ * @brief Send the held back requests whose time has come, if the rate limits
+ * let them go now, and lower timeout to when the next one is due. Returns a
+ * request that couldn't be sent, or NULL.
+ */
+static handle_t *send_held(long *timeout) {
+    int64_t now = now_ms();
+    for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+        handle_t *h = &pool[i];
+        if (!h->busy || !h->held) {
+            continue;
+        }
+        if (h->due_ms <= now) {
+            long ms = ratelimit_acquire(h->limit_key, h->tokens);
+            if (ms == 0) {
+                h->held = false;
+                if (curl_multi_add_handle(multi, h->curl) != CURLM_OK) {
+                    return h;
+                }
+                continue;
+            }
+            h->due_ms = now + ms;
+        }
+        if (h->due_ms - now < *timeout) {
+            *timeout = (long)(h->due_ms - now);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Set the options every request is made with. A connection is only
+ * reused by a request made with the same options, so the warm-up request
+ * uses them as well.
+ */
+static void setup(handle_t *h, const char *url) {
+    CURL *curl = h->curl;
+    if (share != NULL) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    }
+    if (resolve != NULL) {
+        curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+static int url_host(const char *url, char *name, size_t size, long *port) {
+    CURLU *u = curl_url();
+    char *host = NULL;
+    char *p = NULL;
+    int result = 1;
+    if (u != NULL && curl_url_set(u, CURLUPART_URL, url, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_PORT, &p, CURLU_DEFAULT_PORT) == CURLUE_OK && strlen(host) < size) {
+        strcpy(name, host);
+        *port = strtol(p, NULL, 10);
+        result = 0;
+    }
+    curl_free(host);
+    curl_free(p);
+    curl_url_cleanup(u);
+    return result;
+}
+
+/**
+ * @brief Sleep until the request is due, and the rate limits let it go.
+ */
+static void wait_due(handle_t *h) {
+    long ms = (long)(h->due_ms - now_ms());
+    if (ms > 0) {
+        struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000};
+        nanosleep(&ts, NULL);
+    }
+    while ((ms = ratelimit_acquire(h->limit_key, h->tokens)) > 0) {
+        debug("waiting %ld ms for the rate limits of %s\n", ms, h->limit_key);
+        struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * @brief Wait for the warm-up request, if one was started. Everything that
+ * touches the pool or the cache waits for it first, so the warm-up thread
+ * never runs alongside anything else in this module.
+ */
+static void wait_warm(void) {
+    if (!warming) {
+        return;
+    }
+    pthread_join(warmer, NULL);
+    warming = false;
+    free(warm_url);
+    warm_url = NULL;
+}
+
+/**
+ * @brief Send a HEAD request to the host, so that its address has been looked
+ * up and a connection made by the time the first real request goes out. The
+ * connection is left open in the shared connection cache.
+ */
+static void *warm(void *arg) {
+    handle_t *h = acquire();
+    CURLcode res;
+    if (h == NULL) {
+        return NULL;
+    }
+    setup(h, warm_url);
+    curl_easy_setopt(h->curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(h->curl, CURLOPT_WRITEFUNCTION, warm_discard);
+    curl_easy_setopt(h->curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(h->curl, CURLOPT_XFERINFOFUNCTION, warm_progress);
+    res = curl_easy_perform(h->curl);
+    if (res == CURLE_COULDNT_CONNECT && forget_host(h->curl, warm_url)) {
+        res = curl_easy_perform(h->curl);
+    }
+    if (res == CURLE_OK) {
+        remember_host(h->curl, warm_url);
+    }
+    release(h);
+    return NULL;
+}
+
+static size_t warm_discard(char *ptr, size_t size, size_t nmemb, void *user_data) {
+    return size * nmemb;
+}
+
+static int warm_progress(void *user_data, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    return atomic_load(&warm_cancel) ? 1 : 0;
+}
+
+/**
+ * @brief Hand a piece of the response to the request's write function,
+ * unless it's the body of a response the request will be sent again after,
+ * or the other copy of a hedged request has already written.
+ */
+static size_t write_body(char *ptr, size_t size, size_t nmemb, void *user_data) {
+    handle_t *h = (handle_t *)user_data;
+    if (h->failed || h->request->write == NULL || (h->twin != NULL && h->twin->written)) {
+        return size * nmemb;
+    }
+    h->written = true;
+    return h->request->write(ptr, size, nmemb, h->request->user_data);
+}
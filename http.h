@@ -0,0 +1,162 @@
+/**
+ * @file http.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Send HTTP requests to the AI providers.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * All requests to the AI providers go through http_perform(). libcurl is
+ * initialized the first time a request is made and cleaned up by http_exit()
+ * when chewie exits, not around each request.
+ *
+ * Requests are made with easy handles taken from a small pool. A handle is
+ * reset, not destroyed, when it is given back, so it keeps its open
+ * connections. The handles also share one connection cache, DNS cache and TLS
+ * session cache, so a request made with any of them reuses a connection
+ * another one left open. A query that runs through a tool loop, or a query
+ * followed by a summary, only connects to the server once.
+ *
+ * Every request asks for HTTP/2 over TLS, falling back to HTTP/1.1, keeps its
+ * TCP connection alive, and offers every content encoding libcurl can decode
+ * (gzip, and zstd or brotli if libcurl was built with them). Responses are
+ * decoded before they reach the write function.
+ *
+ * Request bodies can be compressed with zstd as well. This is off by default,
+ * since neither OpenAI nor ollama accept compressed requests; it is meant for
+ * servers or proxies that do. Bodies smaller than HTTP_COMPRESS_MIN, and bodies
+ * that are read a piece at a time, are always sent as they are.
+ *
+ * Since every run of chewie is a new process, the first request of each run
+ * would otherwise have to look the host up and do a full TLS handshake. The
+ * addresses hosts were found at are saved in a cache file for HTTP_DNS_TTL
+ * seconds and handed back to libcurl by the next run, and so are the TLS
+ * sessions, until the server says they expire, if libcurl is recent enough
+ * (8.12 or later) to give them out. If a saved address can't be connected to,
+ * it's dropped and the host is looked up again. Nothing is saved for requests
+ * made through a proxy.
+ *
+ * http_connect() can be called as soon as the provider's host is known. It
+ * sends a HEAD request to the host on a thread of its own, which looks the
+ * host up, connects and does the TLS handshake while chewie goes on loading
+ * and reading stdin. The first real request waits for it and then goes out
+ * on the connection it left open. Nothing else in this module runs until the
+ * warm-up is done, and http_exit() cuts it short if it's still going.
+ *
+ * Several requests can be in flight at once by starting each with
+ * http_start() and collecting them with http_wait() as they finish. They run
+ * together on one multi handle, on the same pool, connections and caches as
+ * http_perform(), and requests to the same host over HTTP/2 share a single
+ * connection. All of it runs on the calling thread, inside http_wait().
+ *
+ * Every request is paced by the rate limits of its host and model (see
+ * ratelimit.h). http_perform() sleeps until the limits let its request go,
+ * and a request started with http_start() is held back, without holding up
+ * the others, and sent from http_wait() once it may go.
+ *
+ * A request that fails in a way that sending it again might fix is sent
+ * again, up to HTTP_RETRIES times: after a 429 or 5xx response, or after the
+ * connection failed, timed out or broke before any of the response reached
+ * the write function. A request whose response has started reaching it is
+ * never sent again, since what it was given can't be taken back. The wait
+ * before each retry doubles from HTTP_RETRY_BASE_MS up to HTTP_RETRY_MAX_MS,
+ * with a random part so that requests that failed together don't retry
+ * together, and is at least what a Retry-After header asks for. The write
+ * function doesn't see the failed responses, only the last one if every
+ * retry fails.
+ *
+ * http_set_hedge() turns on hedging of the requests made with
+ * http_perform(). How long each URL takes to start answering is kept in the
+ * cache file, and a request that hasn't started answering by the
+ * HTTP_HEDGE_PERCENTILE percentile of that is sent a second time: to the
+ * hedge host if one was given, or else to the next host of its pool, or to
+ * another address of its own host if it has more than one. Without any of
+ * these it isn't sent again, since a second copy on the same server only
+ * doubles its work. A hedge host that's the request's own host is reached
+ * over a new connection, which only helps behind a load balancer. Whichever
+ * copy starts answering first wins and the other is dropped, so only the
+ * winner's response reaches the write function and is kept in the context.
+ * Requests whose body is read a piece at a time aren't hedged, nor are those
+ * to a URL with fewer than HTTP_HEDGE_SAMPLES_MIN times kept.
+ */
+
+#ifndef _HTTP_H
+#define _HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <curl/curl.h>
+
+/** @brief Name of the cache file, kept in chewie's cache directory. */
+#define HTTP_CACHE_FILENAME             "http_cache"
+/** @brief Number of host addresses kept in the cache. */
+#define HTTP_CACHE_HOSTS                8
+/** @brief Smallest request body that is compressed. */
+#define HTTP_COMPRESS_MIN               1024
+/** @brief Number of seconds a host address is kept in the cache. */
+#define HTTP_DNS_TTL                    300
+/** @brief Percentile of the times a URL takes to start answering after which a request to it is hedged. */
+#define HTTP_HEDGE_PERCENTILE           95
+/** @brief Number of times to start answering kept for each URL. */
+#define HTTP_HEDGE_SAMPLES              32
+/** @brief Fewest times to start answering a URL needs before its requests are hedged. */
+#define HTTP_HEDGE_SAMPLES_MIN          8
+/** @brief Number of easy handles kept for reuse, and so the most requests in flight at once. */
+#define HTTP_POOL_SIZE                  32
+/** @brief Milliseconds before the first retry of a failed request. */
+#define HTTP_RETRY_BASE_MS              250
+/** @brief Most milliseconds between retries of a failed request. */
+#define HTTP_RETRY_MAX_MS               8000
+/** @brief Number of times a failed request is sent again. */
+#define HTTP_RETRIES                    5
+
+/** @brief Called for the next piece of the request body, as with CURLOPT_READFUNCTION. */
+typedef size_t (*http_read_func_t)(char *buf, size_t size, size_t nitems, void *user_data);
+/** @brief Called to start the request body over, if the request has to be sent again. Returns 0 on success. */
+typedef int (*http_rewind_func_t)(void *user_data);
+/** @brief Called with each piece of the response body, as with CURLOPT_WRITEFUNCTION. */
+typedef size_t (*http_write_func_t)(char *ptr, size_t size, size_t nmemb, void *user_data);
+
+/**
+ * @brief A request to send. A request with no body is sent as a GET, one
+ * with a body as a POST of JSON. The body is either given whole in body, or
+ * read a piece at a time with read, in which case body_len is still its full
+ * length, or SIZE_MAX if that isn't known until it has all been read. Such a
+ * body is sent in chunks. header is an extra header line, such as the
+ * authorization, or NULL. model is the model the request is for, whose rate
+ * limits it's kept under, or NULL.
+ */
+typedef struct http_request_t {
+    const char *url;
+    const char *header;
+    const char *model;
+    const char *body;
+    size_t body_len;
+    http_read_func_t read;
+    http_rewind_func_t rewind;
+    void *read_data;
+    http_write_func_t write;
+    void *user_data;
+} http_request_t;
+
+/** @brief Stop a request started with http_start() that hasn't finished. */
+extern void http_cancel(const http_request_t *request);
+/** @brief Start connecting to host in the background, ahead of the first request. */
+extern void http_connect(const char *host);
+/** @brief Close all connections and release libcurl. */
+extern void http_exit(void);
+/** @brief Send a request and wait for the whole response. */
+extern CURLcode http_perform(const http_request_t *request);
+/** @brief Start sending a request without waiting for it. request must stay valid until http_wait() gives it back. */
+extern int http_start(const http_request_t *request);
+/** @brief Wait for the next request started with http_start() to finish. Returns NULL when none are left. */
+extern const http_request_t *http_wait(CURLcode *result);
+/** @brief Set the file that host addresses and TLS sessions are kept in between runs. NULL keeps nothing. */
+extern void http_set_cache(const char *filename);
+/** @brief Turn compression of request bodies on or off. */
+extern void http_set_compress(bool compress);
+/** @brief Turn hedging of slow requests on or off. host is where the second copy goes, or NULL for the next host of the pool or another address of the request's own host. */
+extern void http_set_hedge(bool hedge, const char *host);
+
+#endif // _HTTP_H
@@ -7,22 +7,48 @@
  * @copyright Copyright (c) 2024
  */
  
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "chewie.h"
-#include "file.h"
+#include "buffer.h"
 #include "input.h"
 
-#define INPUT_BUFFER_SIZE 1024
+static buffer_t input = {0};
+static pthread_t reader;
+static bool reading = false;
+static int read_result = 0;
+
+static void *read_input(void *arg);
 
 char *input_get(void) {
     debug_enter();
-    static char input_buffer[INPUT_BUFFER_SIZE];
-    FILE *tmp_file = NULL;
-    while (fgets(input_buffer, INPUT_BUFFER_SIZE, stdin) != NULL) {
-        file_append_tmp(&tmp_file, input_buffer);
+    char *s = NULL;
+    if (reading) {
+        pthread_join(reader, NULL);
+        reading = false;
+    } else {
+        read_result = buffer_read_file(&input, stdin);
+    }
+    if (read_result == 0) {
+        s = buffer_take(&input);
+    }
+    buffer_free(&input);
+    debug_return s;
+}
+
+void input_start(void) {
+    debug_enter();
+    if (!reading && pthread_create(&reader, NULL, read_input, NULL) == 0) {
+        reading = true;
     }
-    debug_return file_read_tmp(&tmp_file);
+    debug_return;
+}
+
+static void *read_input(void *arg) {
+    read_result = buffer_read_file(&input, stdin);
+    return NULL;
 }
@@ -5,6 +5,12 @@
  * @version 0.1.0
  * @date 2024-04-27
  * @copyright Copyright (c) 2024
+ * @details
+ * stdin can be read on a thread of its own, started with input_start() as
+ * soon as it's known that the prompt will come from stdin. The context and
+ * the Lua functions are then loaded while whatever feeds stdin is still
+ * writing. input_get() waits for the thread to reach the end of stdin, or
+ * reads stdin itself if no thread was started.
  */
 
 #ifndef _INPUT_H
@@ -12,5 +18,7 @@
 
 /// Get input from stdin.
 extern char *input_get(void);
+/// Start reading stdin in the background.
+extern void input_start(void);
 
 #endif // _INPUT_H
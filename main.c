@@ -28,8 +28,11 @@
 #include "context.h"
 #include "file.h"
 #include "function.h"
+#include "http.h"
 #include "input.h"
 #include "option.h"
+#include "output.h"
+#include "route.h"
 #include "setting.h"
 #include "ollama.h"
 #include "openai.h"
@@ -54,6 +57,17 @@ int main(int ac, char **av) {
     if (configure(actions_obj, settings_obj, ac, av)) {
         goto term;
     }
+    // If a request is going to be sent, connect to the provider while the Lua
+    // functions load and stdin is read, or with a pool of hosts, find out
+    // which of them are up.
+    if (action_sends_request(actions_obj)) {
+        const char *host = json_object_get_string(json_object_object_get(settings_obj, SETTING_KEY_AI_HOST));
+        if (route_is_pool(host)) {
+            route_start(host);
+        } else {
+            http_connect(host);
+        }
+    }
     json_object *api_opt = NULL;
     if (json_object_object_get_ex(settings_obj, SETTING_KEY_AI_PROVIDER, &api_opt)) {
         const api_id_t api = api_name_to_id(json_object_get_string(api_opt));
@@ -72,9 +86,12 @@ int main(int ac, char **av) {
         goto term;
     }
 term:
+    output_exit();
     if (result == 0) {
         context_update();
     }
+    route_exit();
+    http_exit();
     if (actions_obj != NULL) {
         json_object_put(actions_obj);
     }
@@ -11,47 +11,75 @@
 #include <json-c/json.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "chewie.h"
 #include "action.h"
 #include "api.h"
+#include "buffer.h"
 #include "context.h"
 #include "file.h"
+#include "http.h"
+#include "input.h"
 #include "ollama.h"
+#include "output.h"
+#include "route.h"
+#include "scan.h"
 #include "setting.h"
+#include "stream.h"
 
-typedef size_t (*curl_callback_t)(char *ptr, size_t size, size_t nmemb, void *userdata);
 
 static const char default_host[] = "http://localhost:11434";
 static const char api_query_endpoint[] = "/api/generate";
 static const char api_listmodels_endpoint[] = "/api/tags";
 static const char api_embeddings_endpoint[] = "/api/embeddings";
 static const char default_model[] = "codellama:7b-instruct";
+static const char summary_prefix[] = "Summary of the earlier conversation:\n";
 
-static CURL *curl = NULL; 
-static struct json_tokener *json = NULL;
-static const char *prompt_str = NULL;
-static json_object *query_obj = NULL;
-static int64_t timestamp = 0;
+/**
+ * @brief Everything one request needs while it's going. Each query,
+ * completion or started request has its own, handed to the write callbacks
+ * as their user data, so any number of them can be going at once.
+ */
+typedef struct request_t {
+    api_request_t api;
+    struct json_tokener *json;
+    const char *prompt;
+    int64_t timestamp;
+    char *url;
+    char *body;
+    stream_t stream;
+    char *text;
+    size_t text_cap;
+    buffer_t response;
+    buffer_t context;
+} request_t;
 
 static action_t **get_actions(void);
+static char *complete(json_object *options, const char *system_prompt, const char *prompt);
+static size_t complete_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
 static option_t **get_options(void);
 static const char *get_api_name(void);
 static const char *get_default_host(void);
 static const char *get_default_model(void);
+static int finish(api_request_t *request, json_object *result);
 static char *get_endpoint(const char *host, const char *endpoint);
+static char *join_history(const char *prompt, int start);
 static size_t list_models_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
 static int get_embeddings(json_object *options);
 static size_t get_embeddings_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
-static void ollama_exit(void);
-static int ollama_init(void);
-static size_t print_curl_data(char *data, size_t len);
 static int print_model_list(json_object *options);
 static const char *query(json_object *json_obj);
 static size_t query_callback(char *ptr, size_t size, size_t nmemb, void *user_data);
-static void setup_curl(json_object *query_obj, const char *endpoint, curl_callback_t callback);
+static int query_record(const char *record, size_t len, void *user_data);
+static void request_free(request_t *r);
+static int request_init(request_t *r);
+static CURLcode send_request(request_t *r, json_object *query_obj, const char *endpoint, http_write_func_t callback);
+static api_request_t *start(json_object *options, void *user_data);
+static size_t start_callback(char *ptr, size_t size, size_t nmemb, void *user_data);
+static int start_request(request_t *r, json_object *options);
 static int string_compare(const void *a, const void *b);
 
 static api_interface_t ollama_api_interface = {
@@ -62,7 +90,10 @@ static api_interface_t ollama_api_interface = {
     .get_api_name = get_api_name,
     .get_embeddings = get_embeddings,
     .print_model_list = print_model_list,
-    .query = query
+    .query = query,
+    .complete = complete,
+    .start = start,
+    .finish = finish
 };
 
 const api_interface_t *ollama_get_aip_interface(void) {
@@ -85,6 +116,118 @@ static option_t **get_options(void) {
     debug_return NULL;
 }
 
+static char *complete(json_object *options, const char *system_prompt, const char *prompt) {
+    debug_enter();
+    CURLcode res;
+    request_t r = {0};
+    char *endpoint = NULL;
+    char *result = NULL;
+    json_object *field_obj = NULL;
+    json_object *options_obj = NULL;
+    json_object *query_obj = NULL;
+    const char *host = default_host;
+    const char *model = default_model;
+    if (request_init(&r)) {
+        debug_return NULL;
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_AI_HOST, &field_obj)) {
+        host = json_object_get_string(field_obj);
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_AI_MODEL, &field_obj)) {
+        model = json_object_get_string(field_obj);
+    }
+    if ((endpoint = get_endpoint(host, api_query_endpoint)) == NULL) {
+        goto term;
+    }
+    query_obj = json_object_new_object();
+    options_obj = json_object_new_object();
+    if (query_obj == NULL || options_obj == NULL) {
+        fprintf(stderr, "Error constructing JSON query object\n");
+        goto term;
+    }
+    json_object_object_add(options_obj, "num_ctx", json_object_new_int(4096));
+    json_object_object_add(query_obj, "model", json_object_new_string(model));
+    json_object_object_add(query_obj, "prompt", json_object_new_string(prompt));
+    json_object_object_add(query_obj, "options", options_obj);
+    json_object_object_add(query_obj, "stream", json_object_new_boolean(false));
+    if (system_prompt != NULL) {
+        json_object_object_add(query_obj, "system", json_object_new_string(system_prompt));
+    }
+    debug("complete() post data: %s\n", json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PRETTY));
+    res = send_request(&r, query_obj, endpoint, complete_callback);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
+    } else {
+        result = buffer_take(&r.response);
+    }
+term:
+    if (query_obj != NULL) {
+        json_object_put(query_obj);
+    }
+    free(endpoint);
+    request_free(&r);
+    debug_return result;
+}
+
+static size_t complete_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    debug_enter();
+    request_t *r = (request_t *)userdata;
+    json_object *json_obj = NULL;
+    json_object *data = NULL;
+    enum json_tokener_error jerr;
+    json_obj = json_tokener_parse_ex(r->json, ptr, nmemb);
+    jerr = json_tokener_get_error(r->json);
+    if (jerr == json_tokener_continue) {
+        debug_return nmemb;
+    }
+    if (jerr != json_tokener_success) {
+        fprintf(stderr, "Error parsing JSON response: %s\n", json_tokener_error_desc(jerr));
+        debug_return 0;
+    }
+    if (json_object_object_get_ex(json_obj, "error", &data)) {
+        fprintf(stderr, "API error: %s\n", json_object_get_string(data));
+        debug_return 0;
+    }
+    if (json_object_object_get_ex(json_obj, "response", &data)) {
+        buffer_reset(&r->response);
+        if (buffer_append(&r->response, json_object_get_string(data), json_object_get_string_len(data))) {
+            debug_return 0;
+        }
+    }
+    debug_return nmemb;
+}
+
+static int finish(api_request_t *request, json_object *result) {
+    debug_enter();
+    request_t *r = (request_t *)request;
+    json_object *response_obj = NULL;
+    json_object *field_obj = NULL;
+    const char *s = buffer_get(&r->response);
+    int rc = 1;
+    if (result == NULL) {
+        goto term;
+    }
+    if (request->res != CURLE_OK) {
+        json_object_object_add(result, "error", json_object_new_string(curl_easy_strerror(request->res)));
+    } else if (s == NULL || (response_obj = json_tokener_parse(s)) == NULL) {
+        json_object_object_add(result, "error", json_object_new_string("Error parsing JSON response"));
+    } else if (json_object_object_get_ex(response_obj, "error", &field_obj)) {
+        json_object_object_add(result, "error", json_object_get(field_obj));
+    } else if (json_object_object_get_ex(response_obj, "response", &field_obj)) {
+        json_object_object_add(result, "response", json_object_get(field_obj));
+        rc = 0;
+    } else {
+        json_object_object_add(result, "error", json_object_new_string("No response in API response"));
+    }
+    if (response_obj != NULL) {
+        json_object_put(response_obj);
+    }
+term:
+    request_free(r);
+    free(r);
+    debug_return rc;
+}
+
 static const char *get_default_host(void) {
     debug_enter();
     char *host = NULL;
@@ -115,6 +258,7 @@ static const char *get_default_model(void) {
 static char *get_endpoint(const char *host, const char *api_endpoint) {
     debug_enter();
     char *endpoint = NULL;
+    host = route_host(host);
     long int endpoint_size = strlen(host) + strlen(api_endpoint) + 1;
     endpoint = malloc(endpoint_size);
     if (endpoint == NULL) {
@@ -126,12 +270,32 @@ static char *get_endpoint(const char *host, const char *api_endpoint) {
     debug_return endpoint;
 }
 
+static char *join_history(const char *prompt, int start) {
+    debug_enter();
+    char *transcript = context_get_transcript(start, context_get_history_length());
+    char *s = NULL;
+    size_t l = 0;
+    if (transcript == NULL) {
+        debug_return NULL;
+    }
+    l = strlen(transcript) + strlen(prompt) + 1;
+    s = malloc(l);
+    if (s == NULL) {
+        fprintf(stderr, "Error allocating memory for prompt\n");
+    } else {
+        snprintf(s, l, "%s%s", transcript, prompt);
+    }
+    free(transcript);
+    debug_return s;
+}
+
 static size_t list_models_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
     debug_enter();
-    static json_object *json_obj = NULL;
+    request_t *r = (request_t *)userdata;
+    json_object *json_obj = NULL;
     enum json_tokener_error jerr;
-    json_obj = json_tokener_parse_ex(json, ptr, nmemb);
-    jerr = json_tokener_get_error(json);
+    json_obj = json_tokener_parse_ex(r->json, ptr, nmemb);
+    jerr = json_tokener_get_error(r->json);
     if (jerr == json_tokener_continue) {
         debug_return nmemb;
     }
@@ -181,115 +345,83 @@ static size_t list_models_callback(char *ptr, size_t size, size_t nmemb, void *u
     debug_return nmemb;
 }
 
-static void ollama_exit(void) {
-    debug_enter();
-    if (json != NULL) {
-        json_tokener_free(json);
-        json = NULL;
-    }
-    if (curl != NULL) {
-        curl_easy_cleanup(curl);
-        curl = NULL;
-    }
-    curl_global_cleanup();
-    debug_return;
-}
-
-static int ollama_init(void) {
-    debug_enter();
-    CURLcode res;
-    res = curl_global_init(CURL_GLOBAL_DEFAULT);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
-        debug_return 1;
-    }
-    curl = curl_easy_init();
-    if (curl == NULL) {
-        fprintf(stderr, "API request error: couldn't initialize curl\n");
-        debug_return 1;
-    }
-    json = json_tokener_new();
-    if (json == NULL) {
-        fprintf(stderr, "JSON parser error: couldn't initialize JSON parser\n");
-        debug_return 1;
-    }
-    debug_return 0;
-}
-
-static size_t print_curl_data(char *data, size_t len) {
-    debug_enter();
-    char *s = malloc(len + 1);
-    if (s == NULL) {
-        fprintf(stderr, "Error allocating buffer for input\n");
-        debug_return 0;
-    }
-    memcpy(s, data, len);
-    s[len] = 0;
-    fprintf(stdout, "%s", s);
-    fflush(stdout);
-    free(s);
-    debug_return len;
-}
-
 static int print_model_list(json_object *options) {
     debug_enter();
     CURLcode res;
     json_object *field_obj = NULL;
     const char *host = default_host;
     char *endpoint = NULL;
-    if (ollama_init()) {
+    request_t r = {0};
+    int result = 1;
+    if (request_init(&r)) {
         debug_return 1;
     }
     if (json_object_object_get_ex(options, SETTING_KEY_AI_HOST, &field_obj)) {
         host = json_object_get_string(field_obj);
     }
     if ((endpoint = get_endpoint(host, api_listmodels_endpoint)) == NULL) {
-        debug_return 1;
+        goto term;
     }
-    setup_curl(NULL, endpoint, list_models_callback);
     printf("Models available at %s:\n", host);
-    res = curl_easy_perform(curl);
+    res = send_request(&r, NULL, endpoint, list_models_callback);
     if (res != CURLE_OK) {
         fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
-        debug_return 1;
+        goto term;
     }
-    ollama_exit();
-    debug_return 0;
+    result = 0;
+term:
+    free(endpoint);
+    request_free(&r);
+    debug_return result;
 }
 
 static const char *query(json_object *options) {
     debug_enter();
     CURLcode res;
+    request_t r = {0};
     char *endpoint = NULL;
     char *response = NULL;
     json_object *ollama_obj = NULL;
     json_object *embeddings_obj = NULL;
     json_object *field_obj = NULL;
     json_object *options_obj = NULL;
+    json_object *query_obj = NULL;
     json_object *system_prompt_obj = NULL;
     const char *host = default_host;
     const char *model = default_model;
     const char *embeddings = NULL;
     const char *system_prompt = NULL;
+    const char *summary = context_get_summary();
+    char *replay_prompt = NULL;
+    char *replay_system = NULL;
+    int summary_end = context_get_summary_end();
     enum json_tokener_error jerr;
     debug("options: %s\n", json_object_to_json_string_ext(options, JSON_C_TO_STRING_PRETTY));
-    if (ollama_init()) {
+    if (request_init(&r)) {
         debug_return NULL;
     }
     if (json_object_object_get_ex(options, SETTING_KEY_AI_HOST, &field_obj)) {
         host = json_object_get_string(field_obj);
     }
+    // ollama is always sent the whole prompt, so with pip it's read here.
+    if (!json_object_object_get_ex(options, SETTING_KEY_PROMPT, NULL) && json_object_object_get_ex(options, SETTING_KEY_PIPE, NULL)) {
+        char *s = input_get();
+        if (s != NULL) {
+            json_object_object_add(options, SETTING_KEY_PROMPT, json_object_new_string(s));
+            free(s);
+        }
+    }
     if (json_object_object_get_ex(options, SETTING_KEY_PROMPT, &field_obj)) {
         if (field_obj != NULL) {
             debug("prompt found\n");
-            prompt_str = json_object_get_string(field_obj);
+            r.prompt = json_object_get_string(field_obj);
         } else {
-            jerr = json_tokener_get_error(json);
+            jerr = json_tokener_get_error(r.json);
             fprintf(stderr, "JSON parse error: %s\n", json_tokener_error_desc(jerr));
             goto term;
         }
     } else {
-        jerr = json_tokener_get_error(json);
+        jerr = json_tokener_get_error(r.json);
         fprintf(stderr, "JSON parse error: %s\n", json_tokener_error_desc(jerr));
         goto term;
     }
@@ -302,6 +434,18 @@ static const char *query(json_object *options) {
         if (embeddings_obj) {
             embeddings = json_object_get_string(embeddings_obj);
         }
+        field_obj = json_object_object_get(ollama_obj, "summary-end");
+        if (summary != NULL && json_object_get_int(field_obj) == summary_end) {
+            summary = NULL;
+        }
+    }
+    if (summary != NULL) {
+        debug("history summarized through entry %d, replaying the rest without embeddings\n", summary_end);
+        embeddings = NULL;
+        replay_prompt = join_history(r.prompt, summary_end);
+        if (replay_prompt == NULL) {
+            goto term;
+        }
     }
     options_obj = json_object_new_object();
     json_object_object_add(options_obj, "num_ctx", json_object_new_int(4096));
@@ -311,10 +455,10 @@ static const char *query(json_object *options) {
         goto term;
     }
     json_object_object_add(query_obj, "model", json_object_new_string(model));
-    json_object_object_add(query_obj, "prompt", json_object_new_string(prompt_str));
+    json_object_object_add(query_obj, "prompt", json_object_new_string(replay_prompt != NULL ? replay_prompt : r.prompt));
     json_object_object_add(query_obj, "options", options_obj);
     if (embeddings != NULL && embeddings[0] == '[') {
-        field_obj = json_tokener_parse_ex(json, embeddings, strlen(embeddings));
+        field_obj = json_tokener_parse_ex(r.json, embeddings, strlen(embeddings));
         json_object_object_add(query_obj, "context", field_obj);
     }
     if (json_object_object_get_ex(options, SETTING_KEY_BUFFERED, &field_obj)) {
@@ -326,85 +470,132 @@ static const char *query(json_object *options) {
     }
     if (json_object_object_get_ex(options, SETTING_KEY_SYSTEM_PROMPT, &system_prompt_obj)) {
         system_prompt = json_object_get_string(system_prompt_obj);
-        if (system_prompt != NULL) {
-            json_object_object_add(query_obj, "system", json_object_new_string(system_prompt));
+    }
+    if (summary != NULL) {
+        size_t l = (system_prompt != NULL ? strlen(system_prompt) + 2 : 0) + sizeof(summary_prefix) + strlen(summary);
+        replay_system = malloc(l);
+        if (replay_system == NULL) {
+            fprintf(stderr, "Error allocating memory for system prompt\n");
+            goto term;
         }
+        snprintf(replay_system, l, "%s%s%s%s", system_prompt != NULL ? system_prompt : "", system_prompt != NULL ? "\n\n" : "", summary_prefix, summary);
+        system_prompt = replay_system;
+    }
+    if (system_prompt != NULL) {
+        json_object_object_add(query_obj, "system", json_object_new_string(system_prompt));
     }
     debug("query() post data: %s\n", json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PRETTY));
-    setup_curl(query_obj, endpoint, query_callback);
-    timestamp = time(NULL);
-    res = curl_easy_perform(curl);
+    stream_init(&r.stream, stream_format_ndjson);
+    r.timestamp = time(NULL);
+    res = send_request(&r, query_obj, endpoint, query_callback);
     if (res != CURLE_OK) {
         fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
         goto term;
     }
-    fprintf(stdout, "\n");
+    if (stream_finish(&r.stream, query_record, &r)) {
+        goto term;
+    }
+    output_write("\n", 1);
 term:
-    ollama_exit();
+    if (query_obj != NULL) {
+        json_object_put(query_obj);
+    }
+    free(endpoint);
+    free(replay_prompt);
+    free(replay_system);
+    output_flush();
+    request_free(&r);
     debug_return NULL;
 }
 
 static size_t query_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
     debug_enter();
-    static json_object *json_obj = NULL;
-    enum json_tokener_error jerr;
-    static FILE *tmp_response = NULL;
-    static FILE *tmp_context = NULL;
-    json_obj = json_tokener_parse_ex(json, ptr, nmemb);
-    jerr = json_tokener_get_error(json);
-    if (jerr == json_tokener_continue) {
-        debug_return nmemb;
-    }
-    if (jerr != json_tokener_success) {
-        fprintf(stderr, "Error parsing JSON response: %s\n", json_tokener_error_desc(jerr));
+    request_t *r = (request_t *)userdata;
+    if (stream_feed(&r->stream, ptr, size * nmemb, query_record, r)) {
         debug_return 0;
     }
-    enum json_type type = json_object_get_type(json_obj);
-    if (type == json_type_object) {
-        json_object *data = NULL;
-        if (json_object_object_get_ex(json_obj, "response", &data)) {
-            const char *response = json_object_get_string(data);
-            fprintf(stdout, "%s", response);
-            fflush(stdout);
-            file_append_tmp(&tmp_response, response);
+    debug_return size * nmemb;
+}
+
+static int query_record(const char *record, size_t len, void *user_data) {
+    debug_enter();
+    request_t *r = (request_t *)user_data;
+    json_object *json_obj = NULL;
+    json_object *data = NULL;
+    const char *end = record + len;
+    const char *p = NULL;
+    const char *e = NULL;
+    int result = 0;
+    // Every record but the last just carries the next piece of the response,
+    // which is picked out of the text directly. Anything else goes through
+    // json-c.
+    if ((p = scan_member(record, end, "done", &e)) != NULL && scan_bool(p, e) == 0 &&
+        (p = scan_member(record, end, "response", &e)) != NULL) {
+        const char *response = scan_unescape(p, e, &r->text, &r->text_cap);
+        if (response != NULL) {
+            size_t n = strlen(response);
+            output_write(response, n);
+            buffer_append(&r->response, response, n);
+            debug_return 0;
         }
-        if (json_object_object_get_ex(json_obj, "context", &data)) {
-            const char *embeddings = json_object_get_string(data);
-            file_append_tmp(&tmp_context, embeddings);
+    }
+    json_tokener_reset(r->json);
+    json_obj = json_tokener_parse_ex(r->json, record, len);
+    if (json_tokener_get_error(r->json) != json_tokener_success || json_obj == NULL) {
+        fprintf(stderr, "Error parsing JSON response: %.*s\n", (int)len, record);
+        debug_return 1;
+    }
+    if (json_object_get_type(json_obj) != json_type_object) {
+        goto term;
+    }
+    if (json_object_object_get_ex(json_obj, "response", &data)) {
+        const char *response = json_object_get_string(data);
+        output_write(response, json_object_get_string_len(data));
+        buffer_append(&r->response, response, json_object_get_string_len(data));
+    }
+    if (json_object_object_get_ex(json_obj, "context", &data)) {
+        buffer_append(&r->context, json_object_get_string(data), json_object_get_string_len(data));
+    }
+    if (json_object_object_get_ex(json_obj, "done", &data) && json_object_get_boolean(data)) {
+        json_object *ollama_obj = json_object_new_object();
+        if (!ollama_obj) {
+            fprintf(stderr, "Error constructing JSON updates object\n");
+            result = 1;
+            goto term;
         }
-        if (json_object_object_get_ex(json_obj, "done", &data)) {
-            if (json_object_get_boolean(data)) {
-                json_object *ollama_obj = json_object_new_object();
-                if (!ollama_obj) {
-                    fprintf(stderr, "Error constructing JSON updates object\n");
-                    debug_return 0;
-                }
-                const char *response = file_read_tmp(&tmp_response);
-                const char *embeddings = file_read_tmp(&tmp_context);
-                json_object_object_add(ollama_obj, "embeddings", json_tokener_parse_ex(json, embeddings, strlen(embeddings)));
-                context_add_history(prompt_str, response, timestamp);
-                context_set("ollama", ollama_obj);
-                context_update();
-                debug_return nmemb;
-            }
-
+        const char *response = buffer_get(&r->response);
+        const char *embeddings = buffer_get(&r->context);
+        if (embeddings != NULL) {
+            json_tokener_reset(r->json);
+            json_object_object_add(ollama_obj, "embeddings", json_tokener_parse_ex(r->json, embeddings, strlen(embeddings)));
         }
-        if (json_object_object_get_ex(json_obj, "error", &data)) {
-            printf("\n>> Error: %s\n", json_object_get_string(data));
-            debug_return nmemb;
-        } 
+        json_object_object_add(ollama_obj, "summary-end", json_object_new_int(context_get_summary_end()));
+        context_add_history(r->prompt, response, r->timestamp);
+        context_set("ollama", ollama_obj);
+        context_update();
+        buffer_reset(&r->response);
+        buffer_reset(&r->context);
+        goto term;
     }
-    debug_return nmemb;
+    if (json_object_object_get_ex(json_obj, "error", &data)) {
+        output_flush();
+        printf("\n>> Error: %s\n", json_object_get_string(data));
+    }
+term:
+    json_object_put(json_obj);
+    debug_return result;
 }
 
 static int get_embeddings(json_object *settings) {
     debug_enter();
     CURLcode res;
+    request_t r = {0};
     char *endpoint = NULL;
     char *response = NULL;
     json_object *ollama_obj = NULL;
     json_object *embeddings_obj = NULL;
     json_object *field_obj = NULL;
+    json_object *query_obj = NULL;
     json_object *settings_obj = NULL;
     json_object *system_prompt_obj = NULL;
     const char *host = default_host;
@@ -412,18 +603,19 @@ static int get_embeddings(json_object *settings) {
     const char *embeddings = NULL;
     const char *system_prompt = NULL;
     enum json_tokener_error jerr;
-    if (ollama_init()) {
+    int result = 1;
+    if (request_init(&r)) {
         debug_return 1;
     } 
     if (json_object_object_get_ex(settings, SETTING_KEY_AI_HOST, &field_obj)) {
         host = json_object_get_string(field_obj);
     }
     if (json_object_object_get_ex(settings, SETTING_KEY_PROMPT, &field_obj)) {
-        prompt_str = json_object_get_string(field_obj);
+        r.prompt = json_object_get_string(field_obj);
     } else {
-        jerr = json_tokener_get_error(json);
+        jerr = json_tokener_get_error(r.json);
         fprintf(stderr, "JSON parse error: %s\n", json_tokener_error_desc(jerr));
-        debug_return 1;
+        goto term;
     }
     if (json_object_object_get_ex(settings, SETTING_KEY_AI_MODEL, &field_obj)) {
         model = json_object_get_string(field_obj);
@@ -431,33 +623,37 @@ static int get_embeddings(json_object *settings) {
     query_obj = json_object_new_object();
     if (query_obj == NULL) {
         fprintf(stderr, "Error constructing JSON query object\n");
-        debug_return 1;;
+        goto term;
     }
     json_object_object_add(query_obj, "model", json_object_new_string(model));
-    json_object_object_add(query_obj, "prompt", json_object_new_string(prompt_str));
+    json_object_object_add(query_obj, "prompt", json_object_new_string(r.prompt));
     if ((endpoint = get_endpoint(host, api_embeddings_endpoint)) == NULL) {
-        debug_return 1;
+        goto term;
     }
     debug("get_embeddings() post data: %s\n", json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PRETTY));
-    setup_curl(query_obj, endpoint, get_embeddings_callback);
-    timestamp = time(NULL);
-    res = curl_easy_perform(curl);
+    res = send_request(&r, query_obj, endpoint, get_embeddings_callback);
     if (res != CURLE_OK) {
         fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
-        debug_return 1;
+        goto term;
     }
     fprintf(stdout, "\n");
+    result = 0;
 term:
-    ollama_exit();
-    debug_return 0;
+    if (query_obj != NULL) {
+        json_object_put(query_obj);
+    }
+    free(endpoint);
+    request_free(&r);
+    debug_return result;
 }
 
 static size_t get_embeddings_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
     debug_enter();
-    static json_object *json_obj = NULL;
+    request_t *r = (request_t *)userdata;
+    json_object *json_obj = NULL;
     enum json_tokener_error jerr;
-    json_obj = json_tokener_parse_ex(json, ptr, nmemb);
-    jerr = json_tokener_get_error(json);
+    json_obj = json_tokener_parse_ex(r->json, ptr, nmemb);
+    jerr = json_tokener_get_error(r->json);
     if (jerr == json_tokener_continue) {
         debug_return nmemb;
     }
@@ -485,22 +681,151 @@ static size_t get_embeddings_callback(char *ptr, size_t size, size_t nmemb, void
     debug_return nmemb;
 }
 
-static void setup_curl(json_object *query_obj, const char *endpoint, curl_callback_t callback) {
+static void request_free(request_t *r) {
     debug_enter();
-    if (query_obj) {
-        const char *s = json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PLAIN);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, s);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strlen(s));
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    }
-    curl_easy_setopt(curl, CURLOPT_URL, endpoint);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
+    buffer_free(&r->response);
+    buffer_free(&r->context);
+    stream_free(&r->stream);
+    free(r->text);
+    free(r->url);
+    free(r->body);
+    if (r->json != NULL) {
+        json_tokener_free(r->json);
+    }
+    memset(r, 0, sizeof(request_t));
     debug_return;
 }
 
+static int request_init(request_t *r) {
+    debug_enter();
+    memset(r, 0, sizeof(request_t));
+    r->json = json_tokener_new();
+    if (r->json == NULL) {
+        fprintf(stderr, "JSON parser error: couldn't initialize JSON parser\n");
+        debug_return 1;
+    }
+    debug_return 0;
+}
+
+static CURLcode send_request(request_t *r, json_object *query_obj, const char *endpoint, http_write_func_t callback) {
+    debug_enter();
+    http_request_t request = {
+        .url = endpoint,
+        .write = callback,
+        .user_data = r
+    };
+    if (query_obj) {
+        request.body = json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PLAIN);
+        request.body_len = strlen(request.body);
+    }
+    debug_return http_perform(&request);
+}
+
+static api_request_t *start(json_object *options, void *user_data) {
+    debug_enter();
+    request_t *r = malloc(sizeof(request_t));
+    if (r == NULL) {
+        fprintf(stderr, "Error allocating memory for request\n");
+        debug_return NULL;
+    }
+    if (request_init(r) || start_request(r, options)) {
+        goto term;
+    }
+    r->api.api = &ollama_api_interface;
+    r->api.user_data = user_data;
+    r->api.http = (http_request_t){
+        .url = r->url,
+        .body = r->body,
+        .body_len = strlen(r->body),
+        .write = start_callback,
+        .user_data = r
+    };
+    if (http_start(&r->api.http) == 0) {
+        debug_return &r->api;
+    }
+term:
+    request_free(r);
+    free(r);
+    debug_return NULL;
+}
+
+static size_t start_callback(char *ptr, size_t size, size_t nmemb, void *user_data) {
+    request_t *r = (request_t *)user_data;
+    if (buffer_append(&r->response, ptr, size * nmemb)) {
+        return 0;
+    }
+    return size * nmemb;
+}
+
+/**
+ * @brief Make a non-streaming /api/generate request for the prompt in
+ * options. Earlier turns given with it are sent in front of the prompt as a
+ * transcript, the same way a summarized history is replayed.
+ */
+static int start_request(request_t *r, json_object *options) {
+    debug_enter();
+    buffer_t prompt = {0};
+    json_object *field_obj = NULL;
+    json_object *query_obj = NULL;
+    json_object *options_obj = NULL;
+    const char *host = default_host;
+    const char *model = default_model;
+    int result = 1;
+    if (json_object_object_get_ex(options, SETTING_KEY_AI_HOST, &field_obj)) {
+        host = json_object_get_string(field_obj);
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_AI_MODEL, &field_obj)) {
+        model = json_object_get_string(field_obj);
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_HISTORY, &field_obj)) {
+        for (size_t i = 0, n = json_object_array_length(field_obj); i < n; i++) {
+            json_object *turn_obj = json_object_array_get_idx(field_obj, i);
+            const char *p = json_object_get_string(json_object_object_get(turn_obj, "prompt"));
+            const char *r = json_object_get_string(json_object_object_get(turn_obj, "response"));
+            if (buffer_append(&prompt, "User: ", 6) || buffer_append(&prompt, p != NULL ? p : "", p != NULL ? strlen(p) : 0) ||
+                buffer_append(&prompt, "\nAI: ", 5) || buffer_append(&prompt, r != NULL ? r : "", r != NULL ? strlen(r) : 0) ||
+                buffer_append(&prompt, "\n\n", 2)) {
+                goto term;
+            }
+        }
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_PROMPT, &field_obj)) {
+        const char *p = json_object_get_string(field_obj);
+        if (buffer_append(&prompt, p, strlen(p))) {
+            goto term;
+        }
+    }
+    query_obj = json_object_new_object();
+    options_obj = json_object_new_object();
+    if (query_obj == NULL || options_obj == NULL) {
+        fprintf(stderr, "Error constructing JSON query object\n");
+        json_object_put(options_obj);
+        goto term;
+    }
+    json_object_object_add(options_obj, "num_ctx", json_object_new_int(4096));
+    json_object_object_add(query_obj, "model", json_object_new_string(model));
+    json_object_object_add(query_obj, "prompt", json_object_new_string(prompt.data != NULL ? prompt.data : ""));
+    json_object_object_add(query_obj, "options", options_obj);
+    json_object_object_add(query_obj, "stream", json_object_new_boolean(false));
+    if (json_object_object_get_ex(options, SETTING_KEY_SYSTEM_PROMPT, &field_obj) && field_obj != NULL) {
+        json_object_object_add(query_obj, "system", json_object_get(field_obj));
+    }
+    if ((r->url = get_endpoint(host, api_query_endpoint)) == NULL) {
+        goto term;
+    }
+    if ((r->body = strdup(json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PLAIN))) == NULL) {
+        fprintf(stderr, "Error allocating memory for request body\n");
+        goto term;
+    }
+    result = 0;
+term:
+    if (query_obj != NULL) {
+        json_object_put(query_obj);
+    }
+    buffer_free(&prompt);
+    debug_return result;
+}
+
 static int string_compare(const void *a, const void *b) {
     debug_enter();
     debug_return strcmp(*(char **)a, *(char **)b);
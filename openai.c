@@ -9,7 +9,9 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <curl/curl.h>
 #include <json-c/json.h>
@@ -17,16 +19,54 @@
 #include "chewie.h"
 #include "action.h"
 #include "api.h"
+#include "body.h"
+#include "buffer.h"
 #include "context.h"
 #include "file.h"
 #include "function.h"
+#include "http.h"
 #include "option.h"
 #include "openai.h"
+#include "output.h"
+#include "scan.h"
 #include "setting.h"
+#include "stream.h"
+#include "tokenizer.h"
 
 #define SETTING_KEY_EMBEDDING_MODEL    "embedding_model"
+#define SETTING_KEY_MAX_CONTEXT_TOKENS "max_context_tokens"
+#define CONTEXT_KEY_WINDOW_START       "window_start"
+
+/** @brief Context window size of a model, in tokens. */
+typedef struct model_limit_t {
+    const char *prefix;
+    int tokens;
+} model_limit_t;
+
+/**
+ * @brief Everything one request needs while it's going. Each query,
+ * completion or started request has its own, handed to the write callbacks
+ * as their user data, so any number of them can be going at once.
+ * response_obj collects the content and tool calls of the response, and
+ * messages the messages added by the tool loop. model is the model the
+ * request is for, whose rate limits it's kept under.
+ */
+typedef struct request_t {
+    api_request_t api;
+    struct json_tokener *json;
+    json_object *response_obj;
+    json_object *messages;
+    char *model;
+    char *url;
+    char *header;
+    char *body;
+    buffer_t response;
+    stream_t stream;
+    bool stream_plain;
+    char *text;
+    size_t text_cap;
+} request_t;
 
-typedef size_t (*setup_curl_callback_t)(void *, size_t, size_t, void *);
 
 static const char default_host[] = "https://api.openai.com";
 static const char api_query_endpoint[] = "/v1/chat/completions";
@@ -36,36 +76,69 @@ static const char default_model[] = "gpt-3.5-turbo";
 static const char auth_prefix[] = "Authorization: Bearer ";
 static const char default_embedding_model[] = "text-embedding-ada-002";
 static const char ai_provider[] = "openai";
-
-static CURL *curl = NULL;
-
-static struct json_tokener *json = NULL;
-static const char *context_fn = NULL;
-static char *auth_header = NULL;
-static FILE *tmp_response = NULL;
-static int64_t timestamp = 0;
-static json_object *messages_obj = NULL;
+/** @brief Known context window sizes. The longest matching model name prefix wins. */
+static const model_limit_t model_limits[] = {
+    { "gpt-3.5-turbo", 16385 },
+    { "gpt-4", 8192 },
+    { "gpt-4-32k", 32768 },
+    { "gpt-4-turbo", 128000 },
+    { "gpt-4-1106", 128000 },
+    { "gpt-4-0125", 128000 },
+    { "gpt-4o", 128000 },
+    { "gpt-4.1", 1047576 },
+    { "o1", 200000 },
+    { "o3", 200000 },
+    { "o4", 200000 },
+    { NULL, 0 }
+};
+/** @brief Context window assumed for models that aren't in model_limits. */
+static const int default_model_tokens = 4096;
+/** @brief Most tokens kept free for the response. */
+static const int response_reserve_tokens = 4096;
+/** @brief Tokens each message costs on top of its content. */
+static const int message_overhead_tokens = 4;
+/** @brief Introduces the summary of archived history entries. */
+static const char summary_prefix[] = "Summary of the earlier conversation:\n";
+static const char sse_done[] = "[DONE]";
 
 static const char *get_access_token(void);
 static const char *get_api_name(void);
 static const char *get_default_host(void);
 static const char *get_default_model(void);
 static action_t **get_actions(void);
+static char *complete(json_object *options, const char *system_prompt, const char *prompt);
+static size_t complete_callback(char *contents, size_t size, size_t nmemb, void *user_data);
 static option_t **get_options(void);
+static int finish(api_request_t *request, json_object *result);
 static int get_embeddings(json_object *settings);
-static size_t get_embeddings_callback(void *contents, size_t size, size_t nmemb, void *user_data);
+static int get_token_budget(json_object *options, const char *model);
+static size_t get_embeddings_callback(char *contents, size_t size, size_t nmemb, void *user_data);
 static char *get_endpoint(const char *host, const char *endpoint);
-static void openai_exit(void);
-static int openai_init(void);
 static int print_model_list(json_object *options);
-static size_t print_model_list_callback(void *contents, size_t size, size_t nmemb, void *user_data);
+static size_t print_model_list_callback(char *contents, size_t size, size_t nmemb, void *user_data);
 static const char *query(json_object *options);
-static size_t query_callback(void *contents, size_t size, size_t nmemb, void *user_data);
-static json_object *query_get_history(json_object *options);
-static void setup_curl(json_object *json_obj, const char *endpoint, setup_curl_callback_t callback, json_object *response_obj);
+static size_t query_callback(char *contents, size_t size, size_t nmemb, void *user_data);
+static size_t query_stream_callback(char *contents, size_t size, size_t nmemb, void *user_data);
+static int query_add_input(body_t *body, bool *first, buffer_t *input);
+static int query_add_message(body_t *body, bool *first, const char *role, const char *prefix, const char *content);
+static int query_body(request_t *r, body_t *body, json_object *options, const char *model, bool streaming, int start, buffer_t *input);
+static int query_get_window(json_object *options, const char *model);
+static void request_free(request_t *r);
+static int request_init(request_t *r);
+static CURLcode send_request(request_t *r, json_object *query_obj, body_t *body, const char *endpoint, http_write_func_t callback);
+static int set_auth_header(request_t *r);
+static api_request_t *start(json_object *options, void *user_data);
+static int start_add_message(json_object *messages, const char *role, const char *content);
+static size_t start_callback(char *contents, size_t size, size_t nmemb, void *user_data);
+static int start_request(request_t *r, json_object *options);
+static int stream_event(const char *data, size_t len, void *user_data);
+static int stream_tool_calls(json_object *response_obj, json_object *deltas);
 static int string_compare(const void *a, const void *b);
+static int count_tokens(const char *s);
 static int option_emd_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int option_mct_validate(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static int set_missing_emd(option_t *option, json_object *actions_obj, json_object *settings_obj);
+static int set_missing_mct(option_t *option, json_object *actions_obj, json_object *settings_obj);
 static json_object *use_tool(json_object *tool_response);
 
 static api_interface_t openai_api_interface = {
@@ -76,7 +149,10 @@ static api_interface_t openai_api_interface = {
     .get_embeddings = get_embeddings,
     .get_api_name = get_api_name,
     .print_model_list = print_model_list,
-    .query = query
+    .query = query,
+    .complete = complete,
+    .start = start,
+    .finish = finish
 };
 
 static option_t option_emd = {
@@ -89,8 +165,19 @@ static option_t option_emd = {
     .api = ai_provider
 };
 
+static option_t option_mct = {
+    .name = "mct",
+    .description = "Set the most tokens of context history to send with a query.",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = option_mct_validate,
+    .set_missing = set_missing_mct,
+    .api = ai_provider
+};
+
 static option_t *options[] = {
     &option_emd,
+    &option_mct,
     NULL
 };
 
@@ -119,6 +206,147 @@ static option_t **get_options(void) {
     debug_return options;
 }
 
+static char *complete(json_object *options, const char *system_prompt, const char *prompt) {
+    debug_enter();
+    CURLcode res;
+    request_t r = {0};
+    json_object *query_obj = NULL;
+    json_object *json_obj = NULL;
+    json_object *messages_obj = NULL;
+    json_object *message_obj = NULL;
+    json_object *content_obj = NULL;
+    char *endpoint = NULL;
+    char *result = NULL;
+    const char *host = default_host;
+    const char *model = default_model;
+    if (request_init(&r)) {
+        debug_return NULL;
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_AI_HOST, &json_obj)) {
+        host = json_object_get_string(json_obj);
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_AI_MODEL, &json_obj)) {
+        model = json_object_get_string(json_obj);
+    }
+    if ((endpoint = get_endpoint(host, api_query_endpoint)) == NULL) {
+        goto term;
+    }
+    r.model = strdup(model);
+    query_obj = json_object_new_object();
+    messages_obj = json_object_new_array();
+    r.response_obj = json_object_new_object();
+    if (query_obj == NULL || messages_obj == NULL || r.response_obj == NULL) {
+        fprintf(stderr, "Error creating new JSON object\n");
+        json_object_put(messages_obj);
+        goto term;
+    }
+    if (system_prompt != NULL) {
+        message_obj = json_object_new_object();
+        json_object_object_add(message_obj, "role", json_object_new_string("system"));
+        json_object_object_add(message_obj, "content", json_object_new_string(system_prompt));
+        json_object_array_add(messages_obj, message_obj);
+    }
+    message_obj = json_object_new_object();
+    json_object_object_add(message_obj, "role", json_object_new_string("user"));
+    json_object_object_add(message_obj, "content", json_object_new_string(prompt));
+    json_object_array_add(messages_obj, message_obj);
+    json_object_object_add(query_obj, "model", json_object_new_string(model));
+    json_object_object_add(query_obj, "messages", messages_obj);
+    debug("openai complete: %s\n", json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PLAIN));
+    res = send_request(&r, query_obj, NULL, endpoint, complete_callback);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
+        goto term;
+    }
+    if (json_object_object_get_ex(r.response_obj, "content", &content_obj)) {
+        result = strdup(json_object_get_string(content_obj));
+    }
+term:
+    if (query_obj != NULL) {
+        json_object_put(query_obj);
+    }
+    free(endpoint);
+    request_free(&r);
+    debug_return result;
+}
+
+static size_t complete_callback(char *contents, size_t size, size_t nmemb, void *user_data) {
+    debug_enter();
+    request_t *r = (request_t *)user_data;
+    json_object *json_obj = NULL;
+    json_object *choices = NULL;
+    json_object *message = NULL;
+    json_object *content = NULL;
+    json_object *error = NULL;
+    enum json_tokener_error jerr;
+    json_obj = json_tokener_parse_ex(r->json, contents, nmemb);
+    jerr = json_tokener_get_error(r->json);
+    if (jerr == json_tokener_continue) {
+        debug_return nmemb;
+    }
+    if (jerr != json_tokener_success) {
+        fprintf(stderr, "Error parsing JSON response: %s\n", json_tokener_error_desc(jerr));
+        debug_return 0;
+    }
+    if (json_object_get_type(json_obj) != json_type_object) {
+        fprintf(stderr, "Response doesn't appear to be a JSON object\n");
+        debug_return 0;
+    }
+    if (json_object_object_get_ex(json_obj, "error", &error)) {
+        json_object *message_obj = json_object_object_get(error, "message");
+        fprintf(stderr, "API error: %s\n", message_obj != NULL ? json_object_get_string(message_obj) : "unknown");
+        debug_return 0;
+    }
+    if (json_object_object_get_ex(json_obj, "choices", &choices)
+        && json_object_object_get_ex(json_object_array_get_idx(choices, 0), "message", &message)
+        && json_object_object_get_ex(message, "content", &content)) {
+        json_object_object_add(r->response_obj, "content", json_object_get(content));
+    } else {
+        fprintf(stderr, "Error getting content from response\n");
+        debug_return 0;
+    }
+    debug_return nmemb;
+}
+
+static int finish(api_request_t *request, json_object *result) {
+    debug_enter();
+    request_t *r = (request_t *)request;
+    json_object *response_obj = NULL;
+    json_object *field_obj = NULL;
+    json_object *content_obj = NULL;
+    const char *s = buffer_get(&r->response);
+    int rc = 1;
+    if (result == NULL) {
+        goto term;
+    }
+    if (request->res != CURLE_OK) {
+        json_object_object_add(result, "error", json_object_new_string(curl_easy_strerror(request->res)));
+    } else if (s == NULL || (response_obj = json_tokener_parse(s)) == NULL) {
+        json_object_object_add(result, "error", json_object_new_string("Error parsing JSON response"));
+    } else if (json_object_object_get_ex(response_obj, "error", &field_obj)) {
+        if (json_object_object_get_ex(field_obj, "message", &content_obj)) {
+            field_obj = content_obj;
+        }
+        json_object_object_add(result, "error", json_object_get(field_obj));
+    } else if (json_object_object_get_ex(response_obj, "choices", &field_obj) &&
+               (field_obj = json_object_array_get_idx(field_obj, 0)) != NULL &&
+               json_object_object_get_ex(field_obj, "message", &field_obj) &&
+               json_object_object_get_ex(field_obj, "content", &content_obj)) {
+        json_object_object_add(result, "response", json_object_get(content_obj));
+        rc = 0;
+    } else {
+        json_object_object_add(result, "error", json_object_new_string("No response in API response"));
+    }
+    if (response_obj != NULL) {
+        json_object_put(response_obj);
+    }
+term:
+    request_free(r);
+    free(r);
+    debug_return rc;
+}
+
+
 static const char *get_default_host(void) {
     debug_enter();
     char *host = NULL;
@@ -148,43 +376,51 @@ static const char *get_default_model(void) {
 static int get_embeddings(json_object *settings) {
     debug_enter();
     CURLcode res;
+    request_t r = {0};
     json_object *query_obj = NULL; 
     json_object *json_obj = NULL;
     char *endpoint = NULL;
     const char *host = default_host;
-    if (openai_init()) {
+    int result = 1;
+    if (request_init(&r)) {
         debug_return 1;
     }
     if (json_object_object_get_ex(settings, SETTING_KEY_AI_HOST, &json_obj)) {
         host = json_object_get_string(json_obj);
     }
     if ((endpoint = get_endpoint(host, api_get_embeddings_endpoint)) == NULL) {
-        debug_return 1;
+        goto term;
     }
     query_obj = json_object_new_object();
     if (query_obj == NULL) {
         fprintf(stderr, "Error creating new JSON object\n");
-        debug_return 1;
+        goto term;
     }
     json_object_object_add(query_obj, "input", json_object_object_get(settings, SETTING_KEY_PROMPT));
     json_object_object_add(query_obj, "model", json_object_object_get(settings, SETTING_KEY_EMBEDDING_MODEL));
-    setup_curl(query_obj, endpoint, get_embeddings_callback, NULL);
+    if (json_object_object_get_ex(settings, SETTING_KEY_EMBEDDING_MODEL, &json_obj) && json_object_get_string(json_obj) != NULL) {
+        r.model = strdup(json_object_get_string(json_obj));
+    }
     debug("openai get_embeddings: %s\n", json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PLAIN));
-    res = curl_easy_perform(curl);
+    res = send_request(&r, query_obj, NULL, endpoint, get_embeddings_callback);
     if (res != CURLE_OK) {
         fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
-        debug_return 1;
+        goto term;
     }
-    openai_exit();
-    debug_return 0;
+    result = 0;
+term:
+    free(endpoint);
+    request_free(&r);
+    debug_return result;
 }
 
-static size_t get_embeddings_callback(void *contents, size_t size, size_t nmemb, void *user_data) {
+static size_t get_embeddings_callback(char *contents, size_t size, size_t nmemb, void *user_data) {
     debug_enter();
-    static json_object *json_obj = NULL;
+    request_t *r = (request_t *)user_data;
+    json_object *json_obj = NULL;
     enum json_tokener_error jerr;
-    json_obj = json_tokener_parse_ex(json, contents, nmemb);
-    jerr = json_tokener_get_error(json);
+    json_obj = json_tokener_parse_ex(r->json, contents, nmemb);
+    jerr = json_tokener_get_error(r->json);
     if (jerr == json_tokener_continue) {
         debug_return nmemb;
     }
@@ -236,39 +472,29 @@ static char *get_endpoint(const char *host, const char *api_endpoint) {
     debug_return endpoint;
 }
 
-static void openai_exit(void) {
-    debug_enter();
-    if (json != NULL) {
-        json_tokener_free(json);
-        json = NULL;
-    }
-    if (curl != NULL) {
-        curl_easy_cleanup(curl);
-        curl = NULL;
-    }
-    curl_global_cleanup();
-    debug_return;
-}
-
-static int openai_init(void) {
+static int get_token_budget(json_object *options, const char *model) {
     debug_enter();
-    CURLcode res;
-    res = curl_global_init(CURL_GLOBAL_DEFAULT);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
-        debug_return 1;
+    json_object *value = NULL;
+    const model_limit_t *limit = NULL;
+    size_t limit_len = 0;
+    int tokens = default_model_tokens;
+    int reserve = 0;
+    if (json_object_object_get_ex(options, SETTING_KEY_MAX_CONTEXT_TOKENS, &value) && value != NULL) {
+        debug_return json_object_get_int(value);
     }
-    curl = curl_easy_init();
-    if (curl == NULL) {
-        fprintf(stderr, "Error initializing curl\n");
-        debug_return 1;
+    for (const model_limit_t *l = model_limits; l->prefix != NULL; l++) {
+        size_t len = strlen(l->prefix);
+        if (len > limit_len && strncmp(model, l->prefix, len) == 0) {
+            limit = l;
+            limit_len = len;
+        }
     }
-    json = json_tokener_new();
-    if (json == NULL) {
-        fprintf(stderr, "JSON parser error: couldn't initialize JSON parser\n");
-        debug_return 1;
+    if (limit != NULL) {
+        tokens = limit->tokens;
     }
-    debug_return 0;
+    reserve = tokens / 4 < response_reserve_tokens ? tokens / 4 : response_reserve_tokens;
+    debug("context window of %s is %d tokens, keeping %d for the response\n", model, tokens, reserve);
+    debug_return tokens - reserve;
 }
 
 static int print_model_list(json_object *options) {
@@ -277,33 +503,38 @@ static int print_model_list(json_object *options) {
     json_object *field_obj = NULL;
     const char *host = default_host;
     char *endpoint = NULL;
-    if (openai_init()) {
+    request_t r = {0};
+    int result = 1;
+    if (request_init(&r)) {
         debug_return 1;
     }
     if (json_object_object_get_ex(options, SETTING_KEY_AI_HOST, &field_obj)) {
         host = json_object_get_string(field_obj);
     }
     if ((endpoint = get_endpoint(host, api_listmodels_endpoint)) == NULL) {
-        debug_return 1;
+        goto term;
     }
     printf("ENDPOINT: %s\n", endpoint);
-    setup_curl(NULL, endpoint, print_model_list_callback, NULL);
     printf("Models available at %s:\n", host);
-    res = curl_easy_perform(curl);
+    res = send_request(&r, NULL, NULL, endpoint, print_model_list_callback);
     if (res != CURLE_OK) {
         fprintf(stderr, "API request error: %s\n", curl_easy_strerror(res));
-        debug_return 1;
+        goto term;
     }
-    openai_exit();
-    debug_return 0;
+    result = 0;
+term:
+    free(endpoint);
+    request_free(&r);
+    debug_return result;
 }
 
-static size_t print_model_list_callback(void *contents, size_t size, size_t nmemb, void *user_data) {
+static size_t print_model_list_callback(char *contents, size_t size, size_t nmemb, void *user_data) {
     debug_enter();
-    static json_object *json_obj = NULL;
+    request_t *r = (request_t *)user_data;
+    json_object *json_obj = NULL;
     enum json_tokener_error jerr;
-    json_obj = json_tokener_parse_ex(json, contents, nmemb);
-    jerr = json_tokener_get_error(json);
+    json_obj = json_tokener_parse_ex(r->json, contents, nmemb);
+    jerr = json_tokener_get_error(r->json);
     if (jerr == json_tokener_continue) {
         debug_return nmemb;
     }
@@ -348,129 +579,205 @@ static size_t print_model_list_callback(void *contents, size_t size, size_t nmem
 static const char *query(json_object *options) {
     debug_enter();
     CURLcode res;
-    json_object *query_obj = NULL; 
+    request_t r = {0};
     json_object *json_obj = NULL;
-    json_object *field_obj = NULL;
     json_object *prompt_obj = NULL;
-    json_object *response_obj = NULL;
     json_object *tool_outputs = NULL;
-    json_object *user_obj = NULL;
-    json_object *tools = NULL;
+    body_t body = {0};
+    buffer_t input = {0};
     const char *response = NULL;
     const char *prompt_str = NULL;
-    const char *endpoint = NULL;
+    char *endpoint = NULL;
     const char *host = default_host;
     const char *model = default_model;
-    if (openai_init()) {
+    int64_t timestamp = 0;
+    bool streaming = true;
+    bool piping = false;
+    int start = 0;
+    if (request_init(&r)) {
         debug_return NULL;
     }
-    messages_obj = query_get_history(options);
-    if (messages_obj == NULL) {
-        messages_obj = json_object_new_array();
-    }
+    piping = !json_object_object_get_ex(options, SETTING_KEY_PROMPT, NULL) && json_object_object_get_ex(options, SETTING_KEY_PIPE, NULL);
     if (json_object_object_get_ex(options, SETTING_KEY_AI_HOST, &json_obj)) {
         host = json_object_get_string(json_obj);
     }
+    if (json_object_object_get_ex(options, SETTING_KEY_BUFFERED, &json_obj)) {
+        streaming = !json_object_get_boolean(json_obj);
+    }
     if (json_object_object_get_ex(options, SETTING_KEY_AI_MODEL, &json_obj)) {
         model = json_object_get_string(json_obj);
     }
+    start = query_get_window(options, model);
     if ((endpoint = get_endpoint(host, api_query_endpoint)) == NULL) {
         goto term;
     }
-    if (json_object_object_get_ex(options, SETTING_KEY_PROMPT, &prompt_obj)) {
-        response_obj = json_object_new_object();
-        if (response_obj == NULL) {
-            fprintf(stderr, "Error creating new JSON object\n");
-            goto term;
-        }
-        user_obj = json_object_new_object();
-        if (user_obj == NULL) {
-            fprintf(stderr, "Error creating new JSON object\n");
-            goto term;
-        }
-        if (json_object_object_add(user_obj, "role", json_object_new_string("user")) != 0) {
-            fprintf(stderr, "Error adding role to JSON object\n");
-            goto term;
-        }
-        if (json_object_object_add(user_obj, "content", prompt_obj) != 0) {
-            fprintf(stderr, "Error adding content to JSON object\n");
-            goto term;
-        }
-        if (json_object_array_add(messages_obj, user_obj) != 0) {
-            fprintf(stderr, "Error adding user message to JSON object\n");
-            goto term;
-        }
+    r.model = strdup(model);
+    r.response_obj = json_object_new_object();
+    r.messages = json_object_new_array();
+    if (r.response_obj == NULL || r.messages == NULL) {
+        fprintf(stderr, "Error creating new JSON object\n");
+        goto term;
     }
+    stream_init(&r.stream, stream_format_sse);
     while (1) {
         json_object *tool_calls;
-        query_obj = json_object_new_object();
-        if (query_obj == NULL) {
-            fprintf(stderr, "Error creating new JSON object\n");
-            goto term;
-        }
-        json_object_object_add(query_obj, "model", json_object_new_string(model));
         if (tool_outputs != NULL) {
             json_object *new_entry = json_object_new_object();
             json_object_object_add(new_entry, "role", json_object_new_string("assistant"));
             json_object_object_add(new_entry, "content", NULL);
             json_object_object_add(new_entry, "tool_calls", tool_calls);
-            json_object_array_add(messages_obj, new_entry);
+            json_object_array_add(r.messages, new_entry);
             size_t array_len = json_object_array_length(tool_outputs);
             for (size_t i = 0; i < array_len; i++) {
                 json_object *tool_output = json_object_array_get_idx(tool_outputs, i);
                 if (tool_output != NULL) {
-                    json_object_array_add(messages_obj, json_object_get(tool_output));
+                    json_object_array_add(r.messages, json_object_get(tool_output));
                 }
             }
-        } 
-        json_object_object_add(query_obj, "messages", messages_obj);
-        if (json_object_object_get_ex(options, SETTING_KEY_TOOLS, &tools)) {
-            if (tools == NULL) {
-                fprintf(stderr, "Error getting tools from options\n");
-                goto term;
-            }
-            json_object_object_add(query_obj, "tools", tools);
         }
-        setup_curl(query_obj, endpoint, query_callback, response_obj);
-        res = curl_easy_perform(curl);
+        body_free(&body);
+        if (query_body(&r, &body, options, model, streaming, start, piping ? &input : NULL)) {
+            goto term;
+        }
+        r.stream_plain = false;
+        res = send_request(&r, NULL, &body, endpoint, streaming ? query_stream_callback : query_callback);
+        if (piping) {
+            // stdin has been read by now. Requests made by the tool loop send
+            // the prompt as it is, and it goes into the history.
+            const char *s = buffer_get(&input);
+            json_object_object_add(options, SETTING_KEY_PROMPT, json_object_new_string(s != NULL ? s : ""));
+            piping = false;
+        }
+        if (streaming && !r.stream_plain && res == CURLE_OK && stream_finish(&r.stream, stream_event, &r)) {
+            goto term;
+        }
+        if (json_object_object_get_ex(r.response_obj, "tool_calls", &tool_calls) && tool_calls != NULL) {
+            json_object_get(tool_calls);
+            json_object_object_del(r.response_obj, "tool_calls");
+            tool_outputs = use_tool(tool_calls);
+            continue;
+        }
         if (res != CURLE_OK) {
-            if (json_object_object_get_ex(response_obj, "tool_calls", &tool_calls)) {
-                if (tool_calls != NULL) {
-                    tool_outputs = use_tool(tool_calls);
-                    curl_easy_reset(curl);
-                    continue;
-                }
-            }
             goto term;
         }
         break;
     }
+    if (streaming && !r.stream_plain) {
+        output_write("\n", 1);
+    }
     timestamp = time(NULL);
     if (json_object_object_get_ex(options, SETTING_KEY_PROMPT, &prompt_obj)) {
         prompt_str = json_object_get_string(prompt_obj);
     }
-    if (json_object_object_get_ex(options, SETTING_KEY_SYSTEM_PROMPT, &field_obj)) {
-        json_object_object_add(query_obj, SETTING_KEY_SYSTEM_PROMPT, field_obj);
-    }
-    response = file_read_tmp(&tmp_response);
+    response = buffer_get(&r.response);
     if (response == NULL) {
-        fprintf(stderr, "Error getting response from temporary file\n");
+        fprintf(stderr, "Error getting response\n");
         goto term;
     }
     context_add_history(prompt_str, response, timestamp);
     context_update();
 term:
-    openai_exit();
+    body_free(&body);
+    buffer_free(&input);
+    free(endpoint);
+    output_flush();
+    request_free(&r);
     debug_return NULL;
 }
 
-static size_t query_callback(void *contents, size_t size, size_t nmemb, void *user_data) {
+/**
+ * @brief Append the user's message to the "messages" array of a request body,
+ * with the content read from stdin as the body is sent. What is read is kept
+ * in input.
+ */
+static int query_add_input(body_t *body, bool *first, buffer_t *input) {
+    const char *head = *first ? "{\"role\":\"user\",\"content\":\"" : ",{\"role\":\"user\",\"content\":\"";
+    *first = false;
+    return body_add(body, head, strlen(head)) || body_add_input(body, STDIN_FILENO, input) || body_add(body, "\"}", 2);
+}
+
+/**
+ * @brief Append a message to the "messages" array of a request body. prefix,
+ * if not NULL, is put in front of the content. Neither is copied.
+ */
+static int query_add_message(body_t *body, bool *first, const char *role, const char *prefix, const char *content) {
+    char head[64];
+    int len = snprintf(head, sizeof(head), "%s{\"role\":\"%s\",\"content\":\"", *first ? "" : ",", role);
+    *first = false;
+    if (body_add(body, head, len)) {
+        return 1;
+    }
+    if (prefix != NULL && body_add_escaped(body, prefix, strlen(prefix))) {
+        return 1;
+    }
+    return body_add_escaped(body, content, strlen(content)) || body_add(body, "\"}", 2);
+}
+
+static int query_body(request_t *r, body_t *body, json_object *options, const char *model, bool streaming, int start, buffer_t *input) {
+    debug_enter();
+    json_object *field_obj = NULL;
+    const char *system_prompt_str = context_get_system_prompt();
+    const char *summary_str = context_get_summary();
+    const char *stream_str = streaming ? ",\"stream\":true" : ",\"stream\":false";
+    int context_history_count = context_get_history_length();
+    bool first = true;
+    if (body_add(body, "{\"model\":", 9) || body_add_string(body, model) ||
+        body_add(body, stream_str, strlen(stream_str)) || body_add(body, ",\"messages\":[", 13)) {
+        debug_return 1;
+    }
+    if (system_prompt_str != NULL && query_add_message(body, &first, "system", NULL, system_prompt_str)) {
+        debug_return 1;
+    }
+    if (summary_str != NULL && query_add_message(body, &first, "system", summary_prefix, summary_str)) {
+        debug_return 1;
+    }
+    for (int i = start; i < context_history_count; i++) {
+        const char *prompt_str = context_get_history_prompt(i);
+        const char *response_str = context_get_history_response(i);
+        if (prompt_str != NULL && query_add_message(body, &first, "user", NULL, prompt_str)) {
+            debug_return 1;
+        }
+        if (response_str != NULL && query_add_message(body, &first, "assistant", NULL, response_str)) {
+            debug_return 1;
+        }
+    }
+    if (input != NULL) {
+        if (query_add_input(body, &first, input)) {
+            debug_return 1;
+        }
+    } else if (json_object_object_get_ex(options, SETTING_KEY_PROMPT, &field_obj) && field_obj != NULL &&
+        query_add_message(body, &first, "user", NULL, json_object_get_string(field_obj))) {
+        debug_return 1;
+    }
+    // Messages added by the tool loop are small and only exist as objects.
+    for (size_t i = 0, n = json_object_array_length(r->messages); i < n; i++) {
+        if ((!first && body_add(body, ",", 1)) || body_add_json(body, json_object_array_get_idx(r->messages, i))) {
+            debug_return 1;
+        }
+        first = false;
+    }
+    if (body_add(body, "]", 1)) {
+        debug_return 1;
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_TOOLS, &field_obj)) {
+        if (field_obj == NULL) {
+            fprintf(stderr, "Error getting tools from options\n");
+            debug_return 1;
+        }
+        if (body_add(body, ",\"tools\":", 9) || body_add_json(body, field_obj)) {
+            debug_return 1;
+        }
+    }
+    debug_return body_add(body, "}", 1);
+}
+
+static size_t query_callback(char *contents, size_t size, size_t nmemb, void *user_data) {
     debug_enter();
-    static json_object *json_obj = NULL;
-    json_object *response_obj = (json_object *)user_data;
+    request_t *r = (request_t *)user_data;
+    json_object *json_obj = NULL;
     enum json_tokener_error jerr;
-    json_obj = json_tokener_parse_ex(json, contents, nmemb);
-    jerr = json_tokener_get_error(json);
+    json_obj = json_tokener_parse_ex(r->json, contents, nmemb);
+    jerr = json_tokener_get_error(r->json);
     if (jerr == json_tokener_continue) {
         debug("Response: %s\n", (char *)contents);
         debug_return nmemb;
@@ -495,15 +802,16 @@ static size_t query_callback(void *contents, size_t size, size_t nmemb, void *us
             }
             if (json_object_object_get_ex(choice, "message", &message)) {
                 if (json_object_object_get_ex(message, "tool_calls", &tools)) {
-                    json_object_object_add(response_obj, "tool_calls", tools);
+                    json_object_object_add(r->response_obj, "tool_calls", json_object_get(tools));
                     debug("Received: %s\n", json_object_to_json_string_ext(json_obj, JSON_C_TO_STRING_PLAIN));
                     debug("Received tool call: %s\n", json_object_to_json_string_ext(tools, JSON_C_TO_STRING_PLAIN));
                     debug_return 0;
                 }
                 if (json_object_object_get_ex(message, "content", &content)) {
                     const char *s = (char *)json_object_get_string(content);
-                    printf("%s\n", s);
-                    file_append_tmp(&tmp_response, s);
+                    output_write(s, json_object_get_string_len(content));
+                    output_write("\n", 1);
+                    buffer_append(&r->response, s, json_object_get_string_len(content));
                 } else {
                     fprintf(stderr, "Error getting content from response\n");
                     debug_return 0;
@@ -531,120 +839,383 @@ static size_t query_callback(void *contents, size_t size, size_t nmemb, void *us
     debug_return nmemb;
 }
 
-static json_object *query_get_history(json_object *options) {
+static size_t query_stream_callback(char *contents, size_t size, size_t nmemb, void *user_data) {
     debug_enter();
-    json_object *history_obj = NULL;
-    json_object *system_prompt_obj = NULL;
-    json_object *context_history_obj = NULL;
-    json_object *new_entry;
-    json_object *context_fn_obj = NULL;
+    request_t *r = (request_t *)user_data;
+    size_t n = size * nmemb;
+    if (r->stream.len == 0 && n > 0 && *(const char *)contents == '{') {
+        // Not an event stream, most likely an error response.
+        r->stream_plain = true;
+    }
+    if (r->stream_plain) {
+        debug_return query_callback(contents, size, nmemb, r);
+    }
+    if (stream_feed(&r->stream, contents, n, stream_event, r)) {
+        debug_return 0;
+    }
+    debug_return n;
+}
+
+static int query_get_window(json_object *options, const char *model) {
+    debug_enter();
+    json_object *prompt_obj = NULL;
+    json_object *openai_obj = NULL;
     int context_history_count = 0;
-    const char *system_prompt_str = NULL;
-    if (context_fn == NULL) {
-        if (!json_object_object_get_ex(options, SETTING_KEY_CONTEXT_FILENAME, &context_fn_obj)) {
-            fprintf(stderr, "Error getting context file name from options\n");
-            debug_return NULL;
-        }
-        context_fn = json_object_get_string(context_fn_obj);
+    int budget = get_token_budget(options, model);
+    int used = 0;
+    int start = 0;
+    int summary_end = context_get_summary_end();
+    const char *system_prompt_str = context_get_system_prompt();
+    const char *summary_str = context_get_summary();
+    if (system_prompt_str != NULL) {
+        used += count_tokens(system_prompt_str);
     }
-    if (context_fn != NULL) {
-        debug("Loading context from %s\n", context_fn);
-        context_load(context_fn);
-    } else {
-        fprintf(stderr, "Error getting context file name\n");
-        debug_return NULL;
+    if (summary_str != NULL) {
+        size_t l = sizeof(summary_prefix) + strlen(summary_str);
+        char *s = malloc(l);
+        if (s == NULL) {
+            fprintf(stderr, "Error allocating memory for summary\n");
+            debug_return 0;
+        }
+        snprintf(s, l, "%s%s", summary_prefix, summary_str);
+        used += count_tokens(s);
+        free(s);
     }
-    history_obj = json_object_new_array();
-    if (history_obj == NULL) {
-        fprintf(stderr, "Error creating new JSON object\n");
-        debug_return NULL;
+    if (json_object_object_get_ex(options, SETTING_KEY_PROMPT, &prompt_obj)) {
+        used += count_tokens(json_object_get_string(prompt_obj));
     }
-    system_prompt_str = context_get_system_prompt();
-    system_prompt_obj = json_object_new_string(system_prompt_str);
-    if (system_prompt_obj != NULL) {
-        new_entry = json_object_new_object();
-        if (new_entry == NULL) {
-            fprintf(stderr, "Error creating new JSON object\n");
-            debug_return NULL;
-        }
-        json_object_object_add(new_entry, "role", json_object_new_string("system"));
-        json_object_object_add(new_entry, "content", system_prompt_obj);
-        json_object_array_add(history_obj, new_entry);
-    }
-    context_history_obj = context_get_history();
-    if (context_history_obj == NULL) {
-        debug_return history_obj;
-    }
-    context_history_count = json_object_array_length(context_history_obj);
-    for (int i = 0; i < context_history_count; i++) {
-        json_object *entry = json_object_array_get_idx(context_history_obj, i);
-        const char *prompt_str = NULL;
-        const char *response_str = NULL;
-        if (entry != NULL) {
-            json_object *role_obj = NULL;
-            json_object_object_get_ex(entry, "role", &role_obj);
-            if (role_obj != NULL) {
-                if (strcmp(json_object_get_string(role_obj), "system") != 0) {
-                    prompt_str = context_get_history_prompt(entry);
-                    response_str = context_get_history_response(entry);
-                    if (prompt_str != NULL) {
-                        new_entry = json_object_new_object();
-                        if (new_entry == NULL) {
-                            fprintf(stderr, "Error creating new JSON object\n");
-                            debug_return NULL;
-                        }
-                        if (system_prompt_obj != NULL && json_object_get_boolean(system_prompt_obj)) {
-                            json_object_object_add(new_entry, "role", json_object_new_string("system"));
-                        } else {
-                            json_object_object_add(new_entry, "role", json_object_new_string("user"));
-                        }
-                        json_object_object_add(new_entry, "content", json_object_new_string(prompt_str));
-                        json_object_array_add(history_obj, new_entry);
-                    }
-                    if (response_str != NULL) {
-                        new_entry = json_object_new_object();
-                        if (new_entry == NULL) {
-                            fprintf(stderr, "Error creating new JSON object\n");
-                            debug_return NULL;
-                        }
-                        json_object_object_add(new_entry, "role", json_object_new_string("assistant"));
-                        json_object_object_add(new_entry, "content", json_object_new_string(response_str));
-                        json_object_array_add(history_obj, new_entry);
-                    }
-                }
-            }
+    context_history_count = context_get_history_length();
+    start = context_history_count;
+    while (start > summary_end) {
+        int tokens = context_get_history_tokens(start - 1) + 2 * message_overhead_tokens;
+        if (used + tokens > budget) {
+            break;
         }
+        used += tokens;
+        start--;
+    }
+    if (start > summary_end) {
+        debug("leaving out history entries %d to %d to stay within %d tokens\n", summary_end, start - 1, budget);
+    }
+    openai_obj = context_get(ai_provider);
+    if (openai_obj == NULL) {
+        openai_obj = json_object_new_object();
+    }
+    if (openai_obj != NULL) {
+        json_object_object_add(openai_obj, CONTEXT_KEY_WINDOW_START, json_object_new_int(start));
+        context_set(ai_provider, openai_obj);
+    }
+    debug_return start;
+}
+
+static void request_free(request_t *r) {
+    debug_enter();
+    if (r->response_obj != NULL) {
+        json_object_put(r->response_obj);
     }
-    debug_return history_obj;
+    if (r->messages != NULL) {
+        json_object_put(r->messages);
+    }
+    buffer_free(&r->response);
+    stream_free(&r->stream);
+    free(r->text);
+    free(r->model);
+    free(r->url);
+    free(r->header);
+    free(r->body);
+    if (r->json != NULL) {
+        json_tokener_free(r->json);
+    }
+    memset(r, 0, sizeof(request_t));
+    debug_return;
 }
 
-static void setup_curl(json_object *query_obj, const char *endpoint, setup_curl_callback_t callback, json_object *response_obj) {
+static int request_init(request_t *r) {
     debug_enter();
+    memset(r, 0, sizeof(request_t));
+    r->json = json_tokener_new();
+    if (r->json == NULL) {
+        fprintf(stderr, "JSON parser error: couldn't initialize JSON parser\n");
+        debug_return 1;
+    }
+    debug_return 0;
+}
+
+static CURLcode send_request(request_t *r, json_object *query_obj, body_t *body, const char *endpoint, http_write_func_t callback) {
+    debug_enter();
+    if (set_auth_header(r)) {
+        exit(1);
+    }
+    http_request_t request = {
+        .url = endpoint,
+        .header = r->header,
+        .model = r->model,
+        .write = callback,
+        .user_data = r
+    };
+    if (body != NULL) {
+        request.read = body_read;
+        request.rewind = body_rewind;
+        request.read_data = body;
+        request.body_len = body_length(body);
+    } else if (query_obj) {
+        request.body = json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PLAIN);
+        request.body_len = strlen(request.body);
+    }
+    debug_return http_perform(&request);
+}
+
+static int set_auth_header(request_t *r) {
+    debug_enter();
+    if (r->header != NULL) {
+        debug_return 0;
+    }
     const char *token = get_access_token();
     if (token == NULL) {
         fprintf(stderr, "Error getting access token\n");
-        exit(1);
+        debug_return 1;
     }
     int auth_header_size = sizeof(auth_prefix) + strlen(token);
-    auth_header = malloc(auth_header_size);
-    if (auth_header == NULL) {
+    r->header = malloc(auth_header_size);
+    if (r->header == NULL) {
         fprintf(stderr, "Error allocating %d bytes of memory for auth header\n", auth_header_size);
-        exit(1);
+        debug_return 1;
     }
-    sprintf(auth_header, "%s%s", auth_prefix, token);
-    struct curl_slist *headers = curl_slist_append(NULL, auth_header);
-    if (query_obj) {
-        const char *s = json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PLAIN);
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, s);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strlen(s));
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    } 
-    curl_easy_setopt(curl, CURLOPT_URL, endpoint);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)response_obj);
-    debug_return;
+    snprintf(r->header, auth_header_size, "%s%s", auth_prefix, token);
+    debug_return 0;
+}
+
+static api_request_t *start(json_object *options, void *user_data) {
+    debug_enter();
+    request_t *r = malloc(sizeof(request_t));
+    if (r == NULL) {
+        fprintf(stderr, "Error allocating memory for request\n");
+        debug_return NULL;
+    }
+    if (request_init(r) || start_request(r, options)) {
+        goto term;
+    }
+    r->api.api = &openai_api_interface;
+    r->api.user_data = user_data;
+    r->api.http = (http_request_t){
+        .url = r->url,
+        .header = r->header,
+        .model = r->model,
+        .body = r->body,
+        .body_len = strlen(r->body),
+        .write = start_callback,
+        .user_data = r
+    };
+    if (http_start(&r->api.http) == 0) {
+        debug_return &r->api;
+    }
+term:
+    request_free(r);
+    free(r);
+    debug_return NULL;
+}
+
+static int start_add_message(json_object *messages, const char *role, const char *content) {
+    json_object *message_obj = json_object_new_object();
+    if (message_obj == NULL) {
+        fprintf(stderr, "Error creating new JSON object\n");
+        return 1;
+    }
+    json_object_object_add(message_obj, "role", json_object_new_string(role));
+    json_object_object_add(message_obj, "content", json_object_new_string(content != NULL ? content : ""));
+    json_object_array_add(messages, message_obj);
+    return 0;
+}
+
+static size_t start_callback(char *contents, size_t size, size_t nmemb, void *user_data) {
+    request_t *r = (request_t *)user_data;
+    if (buffer_append(&r->response, contents, size * nmemb)) {
+        return 0;
+    }
+    return size * nmemb;
+}
+
+/**
+ * @brief Make a non-streaming chat completion request for the prompt in
+ * options. Earlier turns given with it are sent as user and assistant
+ * messages.
+ */
+static int start_request(request_t *r, json_object *options) {
+    debug_enter();
+    json_object *field_obj = NULL;
+    json_object *query_obj = NULL;
+    json_object *messages = NULL;
+    const char *host = default_host;
+    const char *model = default_model;
+    int result = 1;
+    if (set_auth_header(r)) {
+        debug_return 1;
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_AI_HOST, &field_obj)) {
+        host = json_object_get_string(field_obj);
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_AI_MODEL, &field_obj)) {
+        model = json_object_get_string(field_obj);
+    }
+    query_obj = json_object_new_object();
+    messages = json_object_new_array();
+    if (query_obj == NULL || messages == NULL) {
+        fprintf(stderr, "Error creating new JSON object\n");
+        json_object_put(messages);
+        goto term;
+    }
+    json_object_object_add(query_obj, "model", json_object_new_string(model));
+    json_object_object_add(query_obj, "stream", json_object_new_boolean(false));
+    json_object_object_add(query_obj, "messages", messages);
+    if (json_object_object_get_ex(options, SETTING_KEY_SYSTEM_PROMPT, &field_obj) && field_obj != NULL &&
+        start_add_message(messages, "system", json_object_get_string(field_obj))) {
+        goto term;
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_HISTORY, &field_obj)) {
+        for (size_t i = 0, n = json_object_array_length(field_obj); i < n; i++) {
+            json_object *turn_obj = json_object_array_get_idx(field_obj, i);
+            if (start_add_message(messages, "user", json_object_get_string(json_object_object_get(turn_obj, "prompt"))) ||
+                start_add_message(messages, "assistant", json_object_get_string(json_object_object_get(turn_obj, "response")))) {
+                goto term;
+            }
+        }
+    }
+    if (json_object_object_get_ex(options, SETTING_KEY_PROMPT, &field_obj) &&
+        start_add_message(messages, "user", json_object_get_string(field_obj))) {
+        goto term;
+    }
+    if ((r->url = get_endpoint(host, api_query_endpoint)) == NULL) {
+        goto term;
+    }
+    r->model = strdup(model);
+    if ((r->body = strdup(json_object_to_json_string_ext(query_obj, JSON_C_TO_STRING_PLAIN))) == NULL) {
+        fprintf(stderr, "Error allocating memory for request body\n");
+        goto term;
+    }
+    result = 0;
+term:
+    if (query_obj != NULL) {
+        json_object_put(query_obj);
+    }
+    debug_return result;
+}
+
+static int stream_event(const char *data, size_t len, void *user_data) {
+    debug_enter();
+    request_t *r = (request_t *)user_data;
+    json_object *event_obj = NULL;
+    json_object *choice = NULL;
+    json_object *delta = NULL;
+    json_object *field_obj = NULL;
+    const char *end = data + len;
+    const char *p = NULL;
+    const char *e = NULL;
+    int result = 1;
+    if (len == sizeof(sse_done) - 1 && memcmp(data, sse_done, len) == 0) {
+        debug_return 0;
+    }
+    // Most events only carry the next piece of content, which is picked out
+    // of the text directly. Anything else goes through json-c.
+    if ((p = scan_member(data, end, "choices", &e)) != NULL &&
+        (p = scan_element(p, e, 0, &e)) != NULL &&
+        (p = scan_member(p, e, "delta", &e)) != NULL &&
+        scan_member(p, e, "tool_calls", &end) == NULL) {
+        const char *s = NULL;
+        if ((p = scan_member(p, e, "content", &e)) == NULL || *p != '"') {
+            debug_return 0;
+        }
+        if ((s = scan_unescape(p, e, &r->text, &r->text_cap)) != NULL) {
+            size_t n = strlen(s);
+            output_write(s, n);
+            buffer_append(&r->response, s, n);
+            debug_return 0;
+        }
+    }
+    json_tokener_reset(r->json);
+    event_obj = json_tokener_parse_ex(r->json, data, len);
+    if (json_tokener_get_error(r->json) != json_tokener_success || event_obj == NULL) {
+        fprintf(stderr, "Error parsing JSON response: %.*s\n", (int)len, data);
+        goto term;
+    }
+    if (json_object_object_get_ex(event_obj, "error", &field_obj)) {
+        json_object *message = NULL;
+        if (json_object_object_get_ex(field_obj, "message", &message)) {
+            fprintf(stderr, "API error: %s\n", json_object_get_string(message));
+        } else {
+            fprintf(stderr, "Error getting message from response\n");
+        }
+        goto term;
+    }
+    result = 0;
+    if (!json_object_object_get_ex(event_obj, "choices", &field_obj) || (choice = json_object_array_get_idx(field_obj, 0)) == NULL) {
+        goto term;
+    }
+    if (json_object_object_get_ex(choice, "delta", &delta)) {
+        if (json_object_object_get_ex(delta, "content", &field_obj) && field_obj != NULL) {
+            const char *s = json_object_get_string(field_obj);
+            output_write(s, json_object_get_string_len(field_obj));
+            buffer_append(&r->response, s, json_object_get_string_len(field_obj));
+        }
+        if (json_object_object_get_ex(delta, "tool_calls", &field_obj) && field_obj != NULL) {
+            result = stream_tool_calls(r->response_obj, field_obj);
+        }
+    }
+term:
+    if (event_obj != NULL) {
+        json_object_put(event_obj);
+    }
+    debug_return result;
+}
+
+static int stream_tool_calls(json_object *response_obj, json_object *deltas) {
+    debug_enter();
+    static const char *parts[] = {"name", "arguments"};
+    json_object *tool_calls = NULL;
+    if (!json_object_object_get_ex(response_obj, "tool_calls", &tool_calls)) {
+        tool_calls = json_object_new_array();
+        json_object_object_add(response_obj, "tool_calls", tool_calls);
+    }
+    for (size_t i = 0, n = json_object_array_length(deltas); i < n; i++) {
+        json_object *delta = json_object_array_get_idx(deltas, i);
+        json_object *field_obj = NULL;
+        json_object *tool_call = NULL;
+        json_object *function = NULL;
+        size_t index = json_object_object_get_ex(delta, "index", &field_obj) ? (size_t)json_object_get_int(field_obj) : i;
+        while (json_object_array_length(tool_calls) <= index) {
+            tool_call = json_object_new_object();
+            function = json_object_new_object();
+            json_object_object_add(function, "name", json_object_new_string(""));
+            json_object_object_add(function, "arguments", json_object_new_string(""));
+            json_object_object_add(tool_call, "type", json_object_new_string("function"));
+            json_object_object_add(tool_call, "function", function);
+            json_object_array_add(tool_calls, tool_call);
+        }
+        tool_call = json_object_array_get_idx(tool_calls, index);
+        function = json_object_object_get(tool_call, "function");
+        if (json_object_object_get_ex(delta, "id", &field_obj) && field_obj != NULL) {
+            json_object_object_add(tool_call, "id", json_object_get(field_obj));
+        }
+        if (!json_object_object_get_ex(delta, "function", &field_obj) || field_obj == NULL) {
+            continue;
+        }
+        for (size_t j = 0; j < sizeof(parts) / sizeof(parts[0]); j++) {
+            json_object *part = NULL;
+            if (json_object_object_get_ex(field_obj, parts[j], &part) && part != NULL) {
+                const char *old = json_object_get_string(json_object_object_get(function, parts[j]));
+                const char *add = json_object_get_string(part);
+                size_t l = strlen(old) + strlen(add) + 1;
+                char *s = malloc(l);
+                if (s == NULL) {
+                    fprintf(stderr, "Error allocating memory for tool call\n");
+                    debug_return 1;
+                }
+                snprintf(s, l, "%s%s", old, add);
+                json_object_object_add(function, parts[j], json_object_new_string(s));
+                free(s);
+            }
+        }
+    }
+    debug_return 0;
 }
 
 static int string_compare(const void *a, const void *b) {
@@ -652,6 +1223,14 @@ static int string_compare(const void *a, const void *b) {
     debug_return strcmp(*(char **)a, *(char **)b);
 }
 
+static int count_tokens(const char *s) {
+    debug_enter();
+    if (s == NULL) {
+        debug_return 0;
+    }
+    debug_return tokenizer_count(s) + message_overhead_tokens;
+}
+
 static int option_emd_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
     debug_enter();
     json_object *api_object = NULL;
@@ -677,6 +1256,27 @@ static int option_emd_validate(option_t *option, json_object *actions_obj, json_
     debug_return 0;
 }
 
+static int option_mct_validate(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    json_object *api_object = NULL;
+    char *end = NULL;
+    long tokens = strtol(option->value, &end, 10);
+    if (end == option->value || *end != '\0' || tokens <= 0 || tokens > INT32_MAX) {
+        fprintf(stderr, "Error: \"%s\" is not a valid token count\n", option->value);
+        debug_return 1;
+    }
+    if (!json_object_object_get_ex(settings_obj, SETTING_KEY_AI_PROVIDER, &api_object)) {
+        fprintf(stderr, "Error getting AI provider from settings\n");
+        debug_return 1;
+    }
+    if (api_object == NULL || strcmp(json_object_get_string(api_object), ai_provider) != 0) {
+        fprintf(stderr, "Error: AI provider is not %s\n", ai_provider);
+        debug_return 1;
+    }
+    json_object_object_add(settings_obj, SETTING_KEY_MAX_CONTEXT_TOKENS, json_object_new_int(tokens));
+    debug_return 0;
+}
+
 static int set_missing_emd(option_t *option, json_object *actions_obj, json_object *settings_obj) {
     debug_enter();
     json_object *value;
@@ -710,6 +1310,30 @@ static int set_missing_emd(option_t *option, json_object *actions_obj, json_obje
     debug_return 0;
 }
 
+static int set_missing_mct(option_t *option, json_object *actions_obj, json_object *settings_obj) {
+    debug_enter();
+    json_object *value = NULL;
+    json_object *openai_obj = context_get(ai_provider);
+    if (json_object_object_get_ex(settings_obj, SETTING_KEY_MAX_CONTEXT_TOKENS, &value)) {
+        debug("openai max context tokens is set to %s\n", json_object_get_string(value));
+        if (openai_obj == NULL) {
+            openai_obj = json_object_new_object();
+            if (openai_obj == NULL) {
+                fprintf(stderr, "Error creating new JSON object\n");
+                debug_return 1;
+            }
+        }
+        json_object_object_add(openai_obj, SETTING_KEY_MAX_CONTEXT_TOKENS, json_object_get(value));
+        context_set(ai_provider, openai_obj);
+        debug_return 0;
+    }
+    if (openai_obj != NULL && json_object_object_get_ex(openai_obj, SETTING_KEY_MAX_CONTEXT_TOKENS, &value) && value != NULL) {
+        debug("max context tokens in context file is %s\n", json_object_get_string(value));
+        json_object_object_add(settings_obj, SETTING_KEY_MAX_CONTEXT_TOKENS, json_object_get(value));
+    }
+    debug_return 0;
+}
+
 static json_object *use_tool(json_object *tool_response) {
     debug_enter();
     json_object *results = json_object_new_array();
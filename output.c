@@ -0,0 +1,352 @@
+/**
+ * @file output.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Write responses to stdout.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chewie.h"
+#include "output.h"
+
+/** @brief Size of the ring buffer between output_write() and the output thread. A power of 2. */
+#define OUTPUT_RING_SIZE                (256 * 1024)
+/** @brief Bytes collected under output_flush_full before they are written. */
+#define OUTPUT_BUFFER_SIZE              8192
+
+/** @brief How often, and for how long, output_write() had to wait for the output thread. */
+typedef struct stats_t {
+    size_t bytes;
+    size_t stalls;
+    int64_t stall_ms;
+    size_t high_water;
+} stats_t;
+
+// The ring is only ever added to by the thread calling output_write() and
+// only taken from by the output thread, so head is only stored by the one and
+// tail by the other. commit is stored by both: the output thread publishes
+// what output_flush_interval held back once it's due, so publish() only ever
+// moves it forward. The mutex and the conditions are only used to sleep when
+// there is nothing to write or no room to add more.
+static char ring[OUTPUT_RING_SIZE];
+static atomic_size_t head = 0;
+static atomic_size_t commit = 0;
+static atomic_size_t tail = 0;
+static atomic_bool writer_waiting = false;
+static atomic_bool reader_waiting = false;
+static atomic_bool failed = false;
+static atomic_int_fast64_t last_write_ms = 0;
+static atomic_int_fast64_t due_ms = 0;
+static bool stopping = false;
+static bool started = false;
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t has_data = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t has_room = PTHREAD_COND_INITIALIZER;
+static output_flush_t policy = output_flush_token;
+static bool policy_set = false;
+static int interval_ms = 0;
+static stats_t stats = {0};
+
+static void hold(void);
+static int64_t now_ms(void);
+static void publish(size_t end);
+static int start(void);
+static bool wait_for_data(size_t t, size_t *c);
+static void wait_for_room(size_t needed);
+static int write_all(struct iovec *iov, int n);
+static void *write_ring(void *arg);
+
+void output_exit(void) {
+    debug_enter();
+    if (!started) {
+        debug_return;
+    }
+    output_flush();
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&has_data);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+    started = false;
+    stopping = false;
+    debug("output: %zu bytes, %zu stalls, %lld ms stalled, %zu bytes most queued\n", stats.bytes, stats.stalls, (long long)stats.stall_ms, stats.high_water);
+    debug_return;
+}
+
+int output_flush(void) {
+    if (!started) {
+        return atomic_load(&failed) ? 1 : 0;
+    }
+    size_t h = atomic_load(&head);
+    publish(h);
+    if (atomic_load(&tail) != h) {
+        wait_for_room(OUTPUT_RING_SIZE);
+    }
+    return atomic_load(&failed) ? 1 : 0;
+}
+
+int output_parse_flush(const char *s) {
+    debug_enter();
+    char *end = NULL;
+    if (strcmp(s, "token") == 0) {
+        output_set_flush(output_flush_token, 0);
+    } else if (strcmp(s, "line") == 0) {
+        output_set_flush(output_flush_line, 0);
+    } else if (strcmp(s, "full") == 0) {
+        output_set_flush(output_flush_full, 0);
+    } else {
+        errno = 0;
+        long ms = strtol(s, &end, 10);
+        if (end == s || *end != '\0' || errno != 0 || ms < 0 || ms > INT32_MAX) {
+            fprintf(stderr, "Invalid flush policy \"%s\": expected token, line, full or a number of milliseconds\n", s);
+            debug_return 1;
+        }
+        output_set_flush(output_flush_interval, (int)ms);
+    }
+    debug_return 0;
+}
+
+void output_set_flush(output_flush_t p, int ms) {
+    policy = p;
+    interval_ms = ms;
+    policy_set = true;
+}
+
+int output_write(const char *s, size_t n) {
+    bool flush = false;
+    size_t h;
+    if (!policy_set) {
+        output_set_flush(isatty(STDOUT_FILENO) ? output_flush_token : output_flush_line, 0);
+    }
+    if (!started && start()) {
+        return 1;
+    }
+    if (atomic_load(&failed)) {
+        return 1;
+    }
+    h = atomic_load(&head);
+    for (size_t done = 0; done < n;) {
+        size_t room = OUTPUT_RING_SIZE - (h - atomic_load(&tail));
+        if (room == 0) {
+            // Nothing more fits until the output thread catches up, so it
+            // has to be allowed to write what's there whatever the policy.
+            publish(h);
+            wait_for_room(1);
+            continue;
+        }
+        size_t k = n - done < room ? n - done : room;
+        size_t at = h & (OUTPUT_RING_SIZE - 1);
+        size_t first = k < OUTPUT_RING_SIZE - at ? k : OUTPUT_RING_SIZE - at;
+        memcpy(ring + at, s + done, first);
+        memcpy(ring, s + done + first, k - first);
+        h += k;
+        done += k;
+        atomic_store(&head, h);
+    }
+    if (h - atomic_load(&tail) > stats.high_water) {
+        stats.high_water = h - atomic_load(&tail);
+    }
+    stats.bytes += n;
+    switch (policy) {
+        case output_flush_token:
+            flush = true;
+            break;
+        case output_flush_line:
+            flush = memchr(s, '\n', n) != NULL;
+            break;
+        case output_flush_interval:
+            flush = now_ms() - atomic_load(&last_write_ms) >= interval_ms;
+            if (flush) {
+                atomic_store(&due_ms, 0);
+            } else {
+                hold();
+            }
+            break;
+        case output_flush_full:
+            flush = h - atomic_load(&commit) >= OUTPUT_BUFFER_SIZE;
+            break;
+    }
+    if (flush) {
+        publish(h);
+    }
+    return 0;
+}
+
+/**
+ * @brief Note when output held back under output_flush_interval is due to be
+ * written, interval_ms after the last write, unless something held earlier
+ * already is. The output thread is woken to wait for it.
+ */
+static void hold(void) {
+    int_fast64_t none = 0;
+    if (atomic_compare_exchange_strong(&due_ms, &none, atomic_load(&last_write_ms) + interval_ms) && atomic_load(&reader_waiting)) {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&has_data);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Let the output thread write everything up to end, waking it if it's
+ * asleep. It checks commit again after saying it's waiting, so storing commit
+ * before checking reader_waiting can't miss it. commit never moves back, even
+ * if the other thread has published further in the meantime.
+ */
+static void publish(size_t end) {
+    size_t c = atomic_load(&commit);
+    while (c < end && !atomic_compare_exchange_weak(&commit, &c, end));
+    if (atomic_load(&reader_waiting)) {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&has_data);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+static int start(void) {
+    debug_enter();
+    if (pthread_create(&writer, NULL, write_ring, NULL) != 0) {
+        fprintf(stderr, "Error starting output thread\n");
+        atomic_store(&failed, true);
+        debug_return 1;
+    }
+    started = true;
+    debug_return 0;
+}
+
+/**
+ * @brief Wait until there's room for needed more bytes in the ring. Waiting
+ * for the whole ring waits until everything has been written.
+ */
+static void wait_for_room(size_t needed) {
+    int64_t t = now_ms();
+    pthread_mutex_lock(&lock);
+    atomic_store(&writer_waiting, true);
+    while (OUTPUT_RING_SIZE - (atomic_load(&head) - atomic_load(&tail)) < needed && !atomic_load(&failed)) {
+        pthread_cond_wait(&has_room, &lock);
+    }
+    atomic_store(&writer_waiting, false);
+    pthread_mutex_unlock(&lock);
+    if (needed < OUTPUT_RING_SIZE) {
+        stats.stalls++;
+        stats.stall_ms += now_ms() - t;
+    }
+}
+
+/**
+ * @brief Sleep until there's more than t to write, or output_exit() is
+ * stopping the thread. Output held under output_flush_interval is published
+ * here once it's due, so it's written even if nothing more arrives. Returns
+ * false if there's nothing left to write, with *c set to commit.
+ */
+static bool wait_for_data(size_t t, size_t *c) {
+    pthread_mutex_lock(&lock);
+    atomic_store(&reader_waiting, true);
+    while ((*c = atomic_load(&commit)) == t && !stopping) {
+        int64_t due = atomic_load(&due_ms);
+        int64_t ms = due - now_ms();
+        if (due == 0) {
+            pthread_cond_wait(&has_data, &lock);
+        } else if (ms <= 0) {
+            atomic_store(&due_ms, 0);
+            atomic_store(&reader_waiting, false);
+            pthread_mutex_unlock(&lock);
+            publish(atomic_load(&head));
+            pthread_mutex_lock(&lock);
+            atomic_store(&reader_waiting, true);
+        } else {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += ms / 1000;
+            ts.tv_nsec += (ms % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&has_data, &lock, &ts);
+        }
+    }
+    atomic_store(&reader_waiting, false);
+    pthread_mutex_unlock(&lock);
+    return *c != t;
+}
+
+static int write_all(struct iovec *iov, int n) {
+    fflush(stdout);
+    while (n > 0) {
+        ssize_t w = writev(STDOUT_FILENO, iov, n);
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error writing output");
+            return 1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    if (policy == output_flush_interval) {
+        atomic_store(&last_write_ms, now_ms());
+    }
+    return 0;
+}
+
+/**
+ * @brief The output thread. Writes whatever has been published, as one
+ * writev(2) of up to two pieces when it wraps around the end of the ring.
+ */
+static void *write_ring(void *arg) {
+    size_t t = atomic_load(&tail);
+    while (1) {
+        size_t c = atomic_load(&commit);
+        if (c == t && !wait_for_data(t, &c)) {
+            break;
+        }
+        if (!atomic_load(&failed)) {
+            size_t at = t & (OUTPUT_RING_SIZE - 1);
+            size_t k = c - t;
+            size_t first = k < OUTPUT_RING_SIZE - at ? k : OUTPUT_RING_SIZE - at;
+            struct iovec iov[2] = {
+                {.iov_base = ring + at, .iov_len = first},
+                {.iov_base = ring, .iov_len = k - first}
+            };
+            if (write_all(iov, k > first ? 2 : 1)) {
+                atomic_store(&failed, true);
+            }
+        }
+        t = c;
+        atomic_store(&tail, t);
+        if (atomic_load(&writer_waiting)) {
+            pthread_mutex_lock(&lock);
+            pthread_cond_signal(&has_room);
+            pthread_mutex_unlock(&lock);
+        }
+    }
+    return NULL;
+}
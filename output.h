@@ -0,0 +1,63 @@
+/**
+ * @file output.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Write responses to stdout.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * Responses are written to stdout as they arrive, a token at a time. Rather
+ * than going through stdio and flushing after every token, the pieces are
+ * copied into a fixed ring buffer and written with writev(2) by an output
+ * thread of its own, according to the flush policy. The thread receiving the
+ * response only waits for stdout when the ring is full, so a slow terminal or
+ * a pipe that isn't being read doesn't hold up reading from the server until
+ * OUTPUT_RING_SIZE bytes are waiting. How often and for how long it had to
+ * wait is shown in debug builds when chewie exits. The policies are:
+ *
+ * output_flush_token: after every piece. This is the default when stdout is
+ * a terminal, so the response appears as it comes in.
+ *
+ * output_flush_line: whenever a piece holds a newline. This is the default
+ * otherwise, so a program reading chewie's output still gets it a line at a
+ * time.
+ *
+ * output_flush_interval: at most once every given number of milliseconds.
+ * A piece that arrives sooner after the last write is held until that time
+ * has passed, and is then written whether more arrives or not.
+ *
+ * output_flush_full: when at least OUTPUT_BUFFER_SIZE bytes are waiting.
+ *
+ * Under every policy everything waiting is written when the ring is full and
+ * when output_flush() is called, which returns once it has been written.
+ * Anything stdio has buffered for stdout is flushed first, so output written
+ * with printf() before the response still comes out ahead of it. Output
+ * written with stdio after the response should be preceded by output_flush().
+ * output_exit() flushes and stops the output thread.
+ */
+
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stddef.h>
+
+/** @brief When the output buffer is written to stdout. */
+typedef enum output_flush_t {
+    output_flush_token,
+    output_flush_line,
+    output_flush_interval,
+    output_flush_full
+} output_flush_t;
+
+/** @brief Write everything waiting and stop the output thread. */
+extern void output_exit(void);
+/** @brief Write everything waiting to stdout, and wait until it has been written. */
+extern int output_flush(void);
+/** @brief Set the flush policy from a string: "token", "line", "full" or a number of milliseconds. */
+extern int output_parse_flush(const char *s);
+/** @brief Set the flush policy. interval_ms is only used by output_flush_interval. */
+extern void output_set_flush(output_flush_t policy, int interval_ms);
+/** @brief Write len bytes of s to stdout, according to the flush policy. */
+extern int output_write(const char *s, size_t len);
+
+#endif // _OUTPUT_H
@@ -0,0 +1,403 @@
+/**
+ * @file ratelimit.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Keep requests under the providers' rate limits.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chewie.h"
+#include "ratelimit.h"
+
+#define REQUESTS                        0
+#define TOKENS                          1
+
+/**
+ * @brief The buckets of a host and model. level is how much of each limit is
+ * left, as of updated_ms, and window_ms is how long the limit is over. A
+ * limit of 0 isn't known. Nothing is sent before blocked_ms. Times are
+ * milliseconds of wall clock time, since other processes read them.
+ */
+typedef struct bucket_t {
+    char key[RATELIMIT_KEY_MAX];
+    long limit[2];
+    double level[2];
+    int64_t window_ms[2];
+    int64_t updated_ms;
+    int64_t blocked_ms;
+} bucket_t;
+
+/** @brief A header that says something about the rate limits, and where in ratelimit_info_t it goes. */
+typedef struct header_t {
+    const char *name;
+    size_t offset;
+    bool duration;
+} header_t;
+
+static const header_t headers[] = {
+    {"retry-after", offsetof(ratelimit_info_t, retry_after_ms), true},
+    {"retry-after-ms", offsetof(ratelimit_info_t, retry_after_ms), false},
+    {"x-ratelimit-limit-requests", offsetof(ratelimit_info_t, limit_requests), false},
+    {"x-ratelimit-limit-tokens", offsetof(ratelimit_info_t, limit_tokens), false},
+    {"x-ratelimit-remaining-requests", offsetof(ratelimit_info_t, remaining_requests), false},
+    {"x-ratelimit-remaining-tokens", offsetof(ratelimit_info_t, remaining_tokens), false},
+    {"x-ratelimit-reset-requests", offsetof(ratelimit_info_t, reset_requests_ms), true},
+    {"x-ratelimit-reset-tokens", offsetof(ratelimit_info_t, reset_tokens_ms), true},
+    {NULL, 0, false}
+};
+
+/** @brief The windows limits are given over: a second, a minute, an hour and a day. */
+static const int64_t windows[] = {1000, 60000, 3600000, 86400000};
+
+static bucket_t buckets[RATELIMIT_BUCKETS];
+static int bucket_count = 0;
+static char *state_fn = NULL;
+static FILE *state = NULL;
+
+static bucket_t *find(const char *key, int64_t now, bool add);
+static void load(void);
+static void lock(bool create);
+static int64_t now_ms(void);
+static long parse_duration(const char *s);
+static void refill(bucket_t *b, int64_t now);
+static void save(void);
+static void unlock(bool changed);
+static int64_t window(long limit, long remaining, long reset);
+
+long ratelimit_acquire(const char *key, long tokens) {
+    debug_enter();
+    const double need[2] = {1, (double)tokens};
+    int64_t now = now_ms();
+    bucket_t *b = NULL;
+    long wait = 0;
+    lock(false);
+    if ((b = find(key, now, false)) == NULL) {
+        unlock(false);
+        debug_return 0;
+    }
+    if (b->blocked_ms > now) {
+        wait = (long)(b->blocked_ms - now);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (b->limit[i] <= 0) {
+            continue;
+        }
+        double spare = b->limit[i] * RATELIMIT_HEADROOM / 100.0;
+        // A request that needs more than the whole budget can only wait for
+        // the bucket to fill.
+        double n = need[i] < b->limit[i] - spare ? need[i] : b->limit[i] - spare;
+        double shortfall = n + spare - b->level[i];
+        if (shortfall > 0) {
+            long ms = (long)(shortfall * b->window_ms[i] / b->limit[i]) + 1;
+            if (ms > wait) {
+                wait = ms;
+            }
+        }
+    }
+    for (int i = 0; i < 2 && wait == 0; i++) {
+        if (b->limit[i] > 0) {
+            b->level[i] -= need[i];
+        }
+    }
+    unlock(wait == 0);
+    debug_return wait;
+}
+
+void ratelimit_header(ratelimit_info_t *info, const char *line, size_t len) {
+    char s[256];
+    char *value = NULL;
+    if (len >= sizeof(s)) {
+        return;
+    }
+    memcpy(s, line, len);
+    s[len] = 0;
+    s[strcspn(s, "\r\n")] = 0;
+    if ((value = strchr(s, ':')) == NULL) {
+        return;
+    }
+    *value++ = 0;
+    value += strspn(value, " \t");
+    for (const header_t *h = headers; h->name != NULL; h++) {
+        if (strcasecmp(s, h->name) == 0) {
+            char *end = NULL;
+            long n = h->duration ? parse_duration(value) : strtol(value, &end, 10);
+            if (n >= 0 && (h->duration || end != value)) {
+                *(long *)((char *)info + h->offset) = n;
+            }
+            return;
+        }
+    }
+}
+
+void ratelimit_reset(ratelimit_info_t *info) {
+    *info = (ratelimit_info_t){-1, -1, -1, -1, -1, -1, -1};
+}
+
+void ratelimit_set_file(const char *filename) {
+    debug_enter();
+    free(state_fn);
+    state_fn = filename != NULL ? strdup(filename) : NULL;
+    debug_return;
+}
+
+void ratelimit_update(const char *key, const ratelimit_info_t *info, bool limited) {
+    debug_enter();
+    const long limits[2] = {info->limit_requests, info->limit_tokens};
+    const long remaining[2] = {info->remaining_requests, info->remaining_tokens};
+    const long resets[2] = {info->reset_requests_ms, info->reset_tokens_ms};
+    int64_t now = now_ms();
+    bucket_t *b = NULL;
+    bool known = limited;
+    for (int i = 0; i < 2; i++) {
+        known = known || limits[i] > 0 || remaining[i] >= 0;
+    }
+    if (!known) {
+        debug_return;
+    }
+    lock(true);
+    b = find(key, now, true);
+    for (int i = 0; i < 2; i++) {
+        if (limits[i] > 0) {
+            if (b->limit[i] == 0) {
+                b->level[i] = limits[i];
+            }
+            b->limit[i] = limits[i];
+        }
+        if (b->limit[i] > 0 && remaining[i] >= 0 && resets[i] > 0) {
+            int64_t ms = window(b->limit[i], remaining[i], resets[i]);
+            if (ms > 0) {
+                b->window_ms[i] = ms;
+            }
+        }
+        // What's left was counted when the request arrived, so it misses
+        // requests sent since then, by this or another process. It can
+        // only lower the level, and refilling takes care of the rest.
+        if (remaining[i] >= 0 && remaining[i] < b->level[i]) {
+            b->level[i] = remaining[i];
+        }
+        // Without the limit, the rate the bucket fills at isn't known, so
+        // all there is to do when it's empty is wait for it to reset.
+        if (remaining[i] == 0 && b->limit[i] == 0 && resets[i] > 0 && now + resets[i] > b->blocked_ms) {
+            b->blocked_ms = now + resets[i];
+        }
+    }
+    if (limited) {
+        long ms = info->retry_after_ms >= 0 ? info->retry_after_ms : RATELIMIT_BACKOFF_MS;
+        debug("rate limited on %s, holding requests back for %ld ms\n", key, ms);
+        if (now + ms > b->blocked_ms) {
+            b->blocked_ms = now + ms;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (b->level[i] > 0) {
+                b->level[i] = 0;
+            }
+        }
+    }
+    unlock(true);
+    debug_return;
+}
+
+/**
+ * @brief Find key's buckets, filled up to now. If there are none yet and add
+ * is true, new ones are made, in place of the ones least recently used if
+ * there's no room. Returns NULL if there are none and add is false.
+ */
+static bucket_t *find(const char *key, int64_t now, bool add) {
+    bucket_t *b = NULL;
+    for (int i = 0; i < bucket_count; i++) {
+        if (strcmp(buckets[i].key, key) == 0) {
+            refill(&buckets[i], now);
+            return &buckets[i];
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+    if (bucket_count < RATELIMIT_BUCKETS) {
+        b = &buckets[bucket_count++];
+    } else {
+        b = &buckets[0];
+        for (int i = 1; i < bucket_count; i++) {
+            if (buckets[i].updated_ms < b->updated_ms) {
+                b = &buckets[i];
+            }
+        }
+    }
+    memset(b, 0, sizeof(bucket_t));
+    snprintf(b->key, sizeof(b->key), "%s", key);
+    b->window_ms[REQUESTS] = RATELIMIT_WINDOW_MS;
+    b->window_ms[TOKENS] = RATELIMIT_WINDOW_MS;
+    b->updated_ms = now;
+    return b;
+}
+
+/**
+ * @brief Read the buckets from the file. Each line is "key requests-limit
+ * requests-level requests-window tokens-limit tokens-level tokens-window
+ * updated blocked".
+ */
+static void load(void) {
+    char *line = NULL;
+    size_t cap = 0;
+    bucket_count = 0;
+    while (bucket_count < RATELIMIT_BUCKETS && getline(&line, &cap, state) != -1) {
+        bucket_t b = {0};
+        long long window_ms[2] = {0, 0};
+        long long updated = 0;
+        long long blocked = 0;
+        if (sscanf(line, "%383s %ld %lf %lld %ld %lf %lld %lld %lld", b.key, &b.limit[REQUESTS], &b.level[REQUESTS], &window_ms[REQUESTS], &b.limit[TOKENS], &b.level[TOKENS], &window_ms[TOKENS], &updated, &blocked) != 9 ||
+            window_ms[REQUESTS] <= 0 || window_ms[TOKENS] <= 0) {
+            continue;
+        }
+        b.window_ms[REQUESTS] = window_ms[REQUESTS];
+        b.window_ms[TOKENS] = window_ms[TOKENS];
+        b.updated_ms = updated;
+        b.blocked_ms = blocked;
+        buckets[bucket_count++] = b;
+    }
+    free(line);
+}
+
+/**
+ * @brief Lock the file and read the buckets from it, creating it if create is
+ * true. If there's no file, the buckets in memory are used as they are.
+ */
+static void lock(bool create) {
+    int fd = -1;
+    if (state_fn == NULL) {
+        return;
+    }
+    fd = open(state_fn, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if (fd == -1) {
+        return;
+    }
+    if (flock(fd, LOCK_EX) != 0 || (state = fdopen(fd, "r+")) == NULL) {
+        debug("unable to lock %s\n", state_fn);
+        close(fd);
+        return;
+    }
+    load();
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Turn a duration such as "6m0s", "1.5s" or "20ms" into milliseconds.
+ * A number without a unit is seconds, as in Retry-After. Returns -1 if s
+ * isn't a duration, as when Retry-After gives a date.
+ */
+static long parse_duration(const char *s) {
+    double ms = 0;
+    bool found = false;
+    while (*s != 0) {
+        char *end = NULL;
+        double n = strtod(s, &end);
+        if (end == s || n < 0) {
+            break;
+        }
+        s = end;
+        if (strncmp(s, "ms", 2) == 0) {
+            ms += n;
+            s += 2;
+        } else if (*s == 'h') {
+            ms += n * 3600000;
+            s++;
+        } else if (*s == 'm') {
+            ms += n * 60000;
+            s++;
+        } else {
+            ms += n * 1000;
+            s += *s == 's';
+        }
+        found = true;
+    }
+    return found ? (long)(ms + 0.999) : -1;
+}
+
+static void refill(bucket_t *b, int64_t now) {
+    int64_t elapsed = now - b->updated_ms;
+    if (elapsed <= 0) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (b->limit[i] > 0) {
+            b->level[i] += (double)b->limit[i] * elapsed / b->window_ms[i];
+            if (b->level[i] > b->limit[i]) {
+                b->level[i] = b->limit[i];
+            }
+        }
+    }
+    b->updated_ms = now;
+}
+
+/**
+ * @brief Write the buckets back over the file. Everything that reads it holds
+ * the lock, so unlike the HTTP cache it's written in place.
+ */
+static void save(void) {
+    rewind(state);
+    for (int i = 0; i < bucket_count; i++) {
+        const bucket_t *b = &buckets[i];
+        fprintf(state, "%s %ld %.3f %lld %ld %.3f %lld %lld %lld\n", b->key, b->limit[REQUESTS], b->level[REQUESTS], (long long)b->window_ms[REQUESTS], b->limit[TOKENS], b->level[TOKENS], (long long)b->window_ms[TOKENS], (long long)b->updated_ms, (long long)b->blocked_ms);
+    }
+    if (fflush(state) != 0 || ftruncate(fileno(state), ftell(state)) != 0) {
+        debug("unable to write %s\n", state_fn);
+    }
+}
+
+/**
+ * @brief Write the buckets back if they changed, and unlock the file.
+ */
+static void unlock(bool changed) {
+    if (state == NULL) {
+        return;
+    }
+    if (changed) {
+        save();
+    }
+    fclose(state);
+    state = NULL;
+}
+
+/**
+ * @brief Work out how long a limit is over from a response. The reset header
+ * gives the time until the bucket is full again, and it fills at limit per
+ * window, so the window is reset * limit / (limit - remaining). That's rounded
+ * to the nearest of windows, since the reset is rounded and limits are only
+ * ever given per second, minute, hour or day. Returns 0 if the bucket is full
+ * and there's nothing to work it out from.
+ */
+static int64_t window(long limit, long remaining, long reset) {
+    double ms = 0;
+    int64_t nearest = 0;
+    double off = 0;
+    if (remaining >= limit) {
+        return 0;
+    }
+    ms = (double)reset * limit / (limit - remaining);
+    for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+        double d = ms > windows[i] ? ms / windows[i] : windows[i] / ms;
+        if (nearest == 0 || d < off) {
+            nearest = windows[i];
+            off = d;
+        }
+    }
+    return nearest;
+}
@@ -0,0 +1,78 @@
+/**
+ * @file ratelimit.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Keep requests under the providers' rate limits.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * Providers such as OpenAI and Groq limit how many requests, and how many
+ * tokens, can be sent to a model each minute or each day, and say on every
+ * response what the limits are, how much of them is left and how long until
+ * they're reset, in x-ratelimit-* headers. For each host and model there are
+ * two token buckets, one of requests and one of tokens, which fill back up at
+ * the rate the limits allow. How long a limit is over isn't given, so it's
+ * worked out from how long the reset is for what's been used, and until then
+ * taken to be RATELIMIT_WINDOW_MS. A request is only sent once both buckets
+ * hold enough for it, with RATELIMIT_HEADROOM percent of each limit left
+ * over, so that requests go out just under the limits rather than running
+ * into them. The tokens a request uses are estimated from the size of its
+ * body, and corrected by what the next response says is left.
+ *
+ * Until a host has sent its limits, its requests aren't held back at all. A
+ * 429 response empties both buckets until the time its Retry-After header
+ * gives, or for RATELIMIT_BACKOFF_MS if it gives none.
+ *
+ * The buckets are kept in a file in chewie's cache directory, which is locked
+ * while they're read and written, so every chewie running at the same time
+ * shares the same budget. Without the file, each run keeps its own.
+ */
+
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** @brief Milliseconds to hold requests back after a 429 response without a Retry-After header. */
+#define RATELIMIT_BACKOFF_MS            1000
+/** @brief Number of hosts and models whose buckets are kept. */
+#define RATELIMIT_BUCKETS               32
+/** @brief Bytes of request body counted as one token. */
+#define RATELIMIT_BYTES_PER_TOKEN       4
+/** @brief Name of the file the buckets are kept in, in chewie's cache directory. */
+#define RATELIMIT_FILENAME              "ratelimit"
+/** @brief Percent of each limit left unused. */
+#define RATELIMIT_HEADROOM              5
+/** @brief Longest host and model key. */
+#define RATELIMIT_KEY_MAX               384
+/** @brief Milliseconds a limit is taken to be over until a response shows how long it is. */
+#define RATELIMIT_WINDOW_MS             60000
+
+/**
+ * @brief What a response said about the rate limits. Anything it didn't say
+ * is -1. The resets, the time until each limit is all there again, and
+ * retry_after_ms are in milliseconds from when the response arrived.
+ */
+typedef struct ratelimit_info_t {
+    long limit_requests;
+    long limit_tokens;
+    long remaining_requests;
+    long remaining_tokens;
+    long reset_requests_ms;
+    long reset_tokens_ms;
+    long retry_after_ms;
+} ratelimit_info_t;
+
+/** @brief Take what a request of about tokens tokens needs from key's buckets. Returns 0 if it may be sent now, or the milliseconds to wait before asking again. */
+extern long ratelimit_acquire(const char *key, long tokens);
+/** @brief Note what the header line of len bytes says about the rate limits, if anything. */
+extern void ratelimit_header(ratelimit_info_t *info, const char *line, size_t len);
+/** @brief Forget everything in info, before the headers of a new response. */
+extern void ratelimit_reset(ratelimit_info_t *info);
+/** @brief Set the file the buckets are kept in. NULL keeps them in memory. */
+extern void ratelimit_set_file(const char *filename);
+/** @brief Bring key's buckets up to date with a response. limited is true for a 429. */
+extern void ratelimit_update(const char *key, const ratelimit_info_t *info, bool limited);
+
+#endif // _RATELIMIT_H
@@ -0,0 +1,475 @@
+/**
+ * @file route.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Route requests across a pool of ollama hosts.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <curl/curl.h>
+
+#include "chewie.h"
+#include "buffer.h"
+#include "file.h"
+#include "route.h"
+
+/**
+ * @brief A host of the pool. hash is the hash of its URL. checked is set once
+ * it has been checked in this run, and up if it answered. A host that's down
+ * is passed over until down_until, whether this run or an earlier one found
+ * it down.
+ */
+typedef struct host_t {
+    char url[ROUTE_URL_MAX];
+    uint64_t hash;
+    time_t down_until;
+    bool checked;
+    bool up;
+} host_t;
+
+static host_t hosts[ROUTE_HOSTS_MAX];
+static int host_count = 0;
+static char *pool = NULL;
+static char *key = NULL;
+static char *state_fn = NULL;
+static pthread_t prober;
+static bool probing = false;
+static atomic_bool stop = false;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+static host_t *find(const char *url);
+static uint64_t hash(const char *s);
+static void load(void);
+static uint64_t mix(uint64_t x);
+static int parse(const char *s);
+static void *probe(void *arg);
+static void probe_all(CURLM *m, CURL **curl);
+static size_t probe_discard(char *ptr, size_t size, size_t nmemb, void *user_data);
+static int probe_progress(void *user_data, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+static int rank(int *order);
+static void save(void);
+
+void route_exit(void) {
+    debug_enter();
+    if (!probing) {
+        debug_return;
+    }
+    pthread_mutex_lock(&lock);
+    atomic_store(&stop, true);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    pthread_join(prober, NULL);
+    probing = false;
+    curl_global_cleanup();
+    debug_return;
+}
+
+const char *route_host(const char *s) {
+    debug_enter();
+    int order[ROUTE_HOSTS_MAX];
+    const char *url = NULL;
+    struct timespec deadline;
+    if (!route_is_pool(s)) {
+        debug_return s;
+    }
+    if (pool == NULL || strcmp(pool, s) != 0) {
+        route_exit();
+        route_start(s);
+    }
+    if (rank(order) == 0) {
+        debug_return s;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ROUTE_PROBE_TIMEOUT_MS / 1000 + 1;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < host_count && url == NULL; i++) {
+        host_t *h = &hosts[order[i]];
+        // Wait for the host to be checked, unless an earlier run found it
+        // down, in which case it's passed over until it's found up again.
+        while (probing && !h->checked && h->down_until <= time(NULL)) {
+            if (pthread_cond_timedwait(&changed, &lock, &deadline) != 0) {
+                break;
+            }
+        }
+        if (h->checked ? h->up : h->down_until <= time(NULL)) {
+            url = h->url;
+        }
+    }
+    // With every host down, the heaviest is as good as any.
+    if (url == NULL) {
+        url = hosts[order[0]].url;
+    }
+    pthread_mutex_unlock(&lock);
+    debug("routing %s to %s\n", key != NULL ? key : "-", url);
+    debug_return url;
+}
+
+bool route_is_pool(const char *s) {
+    return s != NULL && strchr(s, ',') != NULL;
+}
+
+const char *route_next_host(const char *url) {
+    debug_enter();
+    int order[ROUTE_HOSTS_MAX];
+    int n = rank(order);
+    const char *next = NULL;
+    const host_t *on = NULL;
+    for (int i = 0; i < n && on == NULL; i++) {
+        size_t l = strlen(hosts[i].url);
+        if (strncmp(url, hosts[i].url, l) == 0 && (url[l] == 0 || url[l] == '/')) {
+            on = &hosts[i];
+        }
+    }
+    if (on == NULL) {
+        debug_return NULL;
+    }
+    // Unlike route_host(), this doesn't wait for hosts to be checked. By the
+    // time a request is slow enough to need another host, they have been.
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < n && next == NULL; i++) {
+        const host_t *h = &hosts[order[i]];
+        if (h != on && (h->checked ? h->up : h->down_until <= time(NULL))) {
+            next = h->url;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    debug_return next;
+}
+
+void route_set_file(const char *filename) {
+    debug_enter();
+    free(state_fn);
+    state_fn = filename != NULL ? strdup(filename) : NULL;
+    debug_return;
+}
+
+void route_set_key(const char *k) {
+    debug_enter();
+    char dir[PATH_MAX];
+    const char *base = NULL;
+    size_t l = 0;
+    free(key);
+    key = NULL;
+    if (k == NULL) {
+        debug_return;
+    }
+    // The same context is routed the same way however its name is given,
+    // even before the file exists, so it's the directory that's resolved.
+    base = strrchr(k, '/');
+    l = base != NULL ? (size_t)(base - k) : 0;
+    if (l < sizeof(dir)) {
+        char *d = NULL;
+        memcpy(dir, k, l);
+        dir[l] = 0;
+        if ((d = realpath(base == NULL ? "." : l == 0 ? "/" : dir, NULL)) != NULL) {
+            const char *name = base != NULL ? base + 1 : k;
+            size_t n = strlen(d) + strlen(name) + 2;
+            if ((key = malloc(n)) != NULL) {
+                snprintf(key, n, "%s/%s", strcmp(d, "/") == 0 ? "" : d, name);
+            }
+            free(d);
+        }
+    }
+    if (key == NULL) {
+        key = strdup(k);
+    }
+    debug_return;
+}
+
+void route_start(const char *s) {
+    debug_enter();
+    if (probing || !route_is_pool(s)) {
+        debug_return;
+    }
+    free(pool);
+    pool = strdup(s);
+    if (pool == NULL || parse(s)) {
+        debug_return;
+    }
+    load();
+    atomic_store(&stop, false);
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        debug_return;
+    }
+    if (pthread_create(&prober, NULL, probe, NULL) != 0) {
+        curl_global_cleanup();
+        debug_return;
+    }
+    probing = true;
+    debug_return;
+}
+
+static host_t *find(const char *url) {
+    for (int i = 0; i < host_count; i++) {
+        if (strcmp(hosts[i].url, url) == 0) {
+            return &hosts[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief FNV-1a hash of s.
+ */
+static uint64_t hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s != 0) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief Read which hosts of the pool earlier runs found down. Each line of
+ * the file is "url down_until".
+ */
+static void load(void) {
+    FILE *f = NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    time_t now = time(NULL);
+    if (state_fn == NULL || (f = fopen(state_fn, "r")) == NULL) {
+        return;
+    }
+    while (getline(&line, &cap, f) != -1) {
+        char url[ROUTE_URL_MAX];
+        long long until = 0;
+        host_t *h = NULL;
+        if (sscanf(line, "%255s %lld", url, &until) == 2 && until > now && (h = find(url)) != NULL) {
+            debug("%s was found down by an earlier run\n", url);
+            h->down_until = (time_t)until;
+        }
+    }
+    free(line);
+    fclose(f);
+}
+
+/**
+ * @brief Spread the bits of x, so that weights made from hashes that differ in
+ * a few bits differ in all of them.
+ */
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * @brief Split the comma-separated hosts of s into the pool. Returns 0 if it
+ * holds at least one host.
+ */
+static int parse(const char *s) {
+    host_count = 0;
+    while (*s != 0) {
+        size_t l = strcspn(s, ",");
+        const char *next = s[l] == ',' ? s + l + 1 : s + l;
+        while (l > 0 && (*s == ' ' || *s == '\t')) {
+            s++;
+            l--;
+        }
+        while (l > 0 && (s[l - 1] == ' ' || s[l - 1] == '\t' || s[l - 1] == '/')) {
+            l--;
+        }
+        if (l >= ROUTE_URL_MAX) {
+            fprintf(stderr, "Host in pool is too long: %.*s\n", (int)l, s);
+        } else if (l > 0 && host_count == ROUTE_HOSTS_MAX) {
+            fprintf(stderr, "More than %d hosts in pool, ignoring %.*s\n", ROUTE_HOSTS_MAX, (int)l, s);
+        } else if (l > 0) {
+            host_t *h = &hosts[host_count++];
+            memset(h, 0, sizeof(host_t));
+            memcpy(h->url, s, l);
+            h->url[l] = 0;
+            h->hash = hash(h->url);
+        }
+        s = next;
+    }
+    return host_count == 0 ? 1 : 0;
+}
+
+/**
+ * @brief Check the hosts every ROUTE_PROBE_INTERVAL seconds until
+ * route_exit(). The handles are kept between checks, along with their
+ * connections.
+ */
+static void *probe(void *arg) {
+    CURL *curl[ROUTE_HOSTS_MAX] = {0};
+    CURLM *m = curl_multi_init();
+    for (int i = 0; i < host_count && m != NULL; i++) {
+        char url[ROUTE_URL_MAX + sizeof(ROUTE_PROBE_ENDPOINT)];
+        if ((curl[i] = curl_easy_init()) == NULL) {
+            continue;
+        }
+        snprintf(url, sizeof(url), "%s%s", hosts[i].url, ROUTE_PROBE_ENDPOINT);
+        curl_easy_setopt(curl[i], CURLOPT_URL, url);
+        curl_easy_setopt(curl[i], CURLOPT_PRIVATE, &hosts[i]);
+        curl_easy_setopt(curl[i], CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl[i], CURLOPT_TIMEOUT_MS, (long)ROUTE_PROBE_TIMEOUT_MS);
+        curl_easy_setopt(curl[i], CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl[i], CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(curl[i], CURLOPT_WRITEFUNCTION, probe_discard);
+        curl_easy_setopt(curl[i], CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl[i], CURLOPT_XFERINFOFUNCTION, probe_progress);
+    }
+    while (!atomic_load(&stop)) {
+        struct timespec next;
+        probe_all(m, curl);
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec += ROUTE_PROBE_INTERVAL;
+        pthread_mutex_lock(&lock);
+        while (!atomic_load(&stop) && pthread_cond_timedwait(&changed, &lock, &next) == 0);
+        pthread_mutex_unlock(&lock);
+    }
+    for (int i = 0; i < host_count; i++) {
+        if (curl[i] != NULL) {
+            curl_easy_cleanup(curl[i]);
+        }
+    }
+    if (m != NULL) {
+        curl_multi_cleanup(m);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Check every host at once, and note each one as up or down as its
+ * answer comes in. A host is up if it answers with a 200. A host without a
+ * handle can't be checked, and is taken to be up. If anything changed, the
+ * file is written.
+ */
+static void probe_all(CURLM *m, CURL **curl) {
+    CURLMsg *msg = NULL;
+    int running = 0;
+    int left = 0;
+    bool dirty = false;
+    for (int i = 0; i < host_count; i++) {
+        if (m == NULL || curl[i] == NULL || curl_multi_add_handle(m, curl[i]) != CURLM_OK) {
+            pthread_mutex_lock(&lock);
+            hosts[i].checked = true;
+            hosts[i].up = true;
+            pthread_cond_broadcast(&changed);
+            pthread_mutex_unlock(&lock);
+        }
+    }
+    while (m != NULL) {
+        if (curl_multi_perform(m, &running) != CURLM_OK) {
+            break;
+        }
+        while ((msg = curl_multi_info_read(m, &left)) != NULL) {
+            host_t *h = NULL;
+            long status = 0;
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&h);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+            curl_multi_remove_handle(m, msg->easy_handle);
+            bool up = msg->data.result == CURLE_OK && status == 200;
+            pthread_mutex_lock(&lock);
+            if (!h->checked || h->up != up) {
+                debug("%s is %s\n", h->url, up ? "up" : "down");
+                dirty = true;
+            }
+            h->checked = true;
+            h->up = up;
+            h->down_until = up ? 0 : time(NULL) + ROUTE_EJECT_TIME;
+            pthread_cond_broadcast(&changed);
+            pthread_mutex_unlock(&lock);
+        }
+        if (running == 0 || atomic_load(&stop)) {
+            break;
+        }
+        if (curl_multi_poll(m, NULL, 0, 1000, NULL) != CURLM_OK) {
+            break;
+        }
+    }
+    for (int i = 0; i < host_count && m != NULL; i++) {
+        if (curl[i] != NULL) {
+            curl_multi_remove_handle(m, curl[i]);
+        }
+    }
+    if (dirty) {
+        save();
+    }
+}
+
+static size_t probe_discard(char *ptr, size_t size, size_t nmemb, void *user_data) {
+    return size * nmemb;
+}
+
+static int probe_progress(void *user_data, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    return atomic_load(&stop) ? 1 : 0;
+}
+
+/**
+ * @brief Rank the hosts of the pool for the context by weight, heaviest
+ * first, into order. Returns how many there are.
+ */
+static int rank(int *order) {
+    uint64_t weight[ROUTE_HOSTS_MAX];
+    uint64_t k = hash(key != NULL ? key : "");
+    for (int i = 0; i < host_count; i++) {
+        int j = i;
+        weight[i] = mix(k ^ hosts[i].hash);
+        while (j > 0 && weight[order[j - 1]] < weight[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    return host_count;
+}
+
+/**
+ * @brief Write which hosts are down to the file, keeping what it says about
+ * hosts that aren't in this pool.
+ */
+static void save(void) {
+    buffer_t text = {.spill_size = SIZE_MAX};
+    char line[ROUTE_URL_MAX + 32];
+    FILE *f = NULL;
+    char *s = NULL;
+    size_t cap = 0;
+    time_t now = time(NULL);
+    if (state_fn == NULL) {
+        return;
+    }
+    if ((f = fopen(state_fn, "r")) != NULL) {
+        while (getline(&s, &cap, f) != -1) {
+            char url[ROUTE_URL_MAX];
+            long long until = 0;
+            if (sscanf(s, "%255s %lld", url, &until) == 2 && until > now && find(url) == NULL) {
+                buffer_append(&text, s, strlen(s));
+            }
+        }
+        free(s);
+        fclose(f);
+    }
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < host_count; i++) {
+        if (hosts[i].down_until > now) {
+            int len = snprintf(line, sizeof(line), "%s %lld\n", hosts[i].url, (long long)hosts[i].down_until);
+            buffer_append(&text, line, len);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    if (file_write_data(state_fn, text.data != NULL ? text.data : "", text.len)) {
+        debug("unable to write %s\n", state_fn);
+    }
+    buffer_free(&text);
+}
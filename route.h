@@ -0,0 +1,67 @@
+/**
+ * @file route.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Route requests across a pool of ollama hosts.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * The AI host can be a comma-separated list of hosts serving the same models,
+ * such as "http://gpu1:11434,http://gpu2:11434". Every request of a context
+ * goes to the same host, so the prompt it sends each time, which starts with
+ * the same history as the last one, finds that history still in the host's
+ * cache. The host is picked by rendezvous hashing of the context's filename:
+ * each host is given a weight from the hash of its URL and the filename, and
+ * the heaviest host that is up wins. When a host goes down, only the
+ * contexts that were on it move, each to its next heaviest host, and they
+ * move back once it's up again.
+ *
+ * route_start() checks every host of the pool on a thread of its own, with
+ * a GET of ROUTE_PROBE_ENDPOINT, and keeps checking them every
+ * ROUTE_PROBE_INTERVAL seconds until route_exit(). route_host() waits for
+ * the check of the host it picks, so a host that's down is passed over
+ * before any request is sent to it. A host that fails its check is noted in
+ * a file in chewie's cache directory, and passed over by the runs that
+ * follow, without waiting for it to be checked again, for ROUTE_EJECT_TIME
+ * seconds.
+ *
+ * When a request is hedged, its second copy goes to route_next_host(), the
+ * heaviest host that's up after the one the context is on.
+ */
+
+#ifndef _ROUTE_H
+#define _ROUTE_H
+
+#include <stdbool.h>
+
+/** @brief Seconds a host that failed its check is passed over by later runs. */
+#define ROUTE_EJECT_TIME                60
+/** @brief Name of the file down hosts are noted in, in chewie's cache directory. */
+#define ROUTE_FILENAME                  "hosts"
+/** @brief Most hosts in a pool. */
+#define ROUTE_HOSTS_MAX                 16
+/** @brief Path a host is checked with. */
+#define ROUTE_PROBE_ENDPOINT            "/api/tags"
+/** @brief Seconds between checks of the hosts. */
+#define ROUTE_PROBE_INTERVAL            10
+/** @brief Milliseconds a host has to answer its check. */
+#define ROUTE_PROBE_TIMEOUT_MS          2000
+/** @brief Longest host URL. */
+#define ROUTE_URL_MAX                   256
+
+/** @brief Stop checking the hosts. */
+extern void route_exit(void);
+/** @brief Pick the host of hosts that requests of the context go to. Returns hosts itself if it's a single host. */
+extern const char *route_host(const char *hosts);
+/** @brief Check whether hosts is a pool of more than one host. */
+extern bool route_is_pool(const char *hosts);
+/** @brief Pick the host of the pool that's next after the one url is on for the context, for a second copy of a slow request. Returns NULL if url isn't on a host of the pool, or no other host is up. */
+extern const char *route_next_host(const char *url);
+/** @brief Set the file down hosts are noted in. NULL notes nothing. */
+extern void route_set_file(const char *filename);
+/** @brief Set the context filename that requests are routed by. */
+extern void route_set_key(const char *key);
+/** @brief Start checking the hosts of a pool in the background. */
+extern void route_start(const char *hosts);
+
+#endif // _ROUTE_H
@@ -0,0 +1,249 @@
+/**
+ * @file scan.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Scan JSON text without parsing it.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chewie.h"
+#include "scan.h"
+
+static int hex4(const char *p, const char *end);
+static char *put_utf8(char *d, uint32_t c);
+
+int scan_bool(const char *p, const char *end) {
+    p = scan_ws(p, end);
+    if (end - p >= 4 && memcmp(p, "true", 4) == 0) {
+        return 1;
+    }
+    if (end - p >= 5 && memcmp(p, "false", 5) == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+const char *scan_element(const char *p, const char *end, int i, const char **value_end) {
+    p = scan_ws(p, end);
+    if (p >= end || *p++ != '[') {
+        return NULL;
+    }
+    for (int n = 0; ; n++) {
+        const char *value = scan_ws(p, end);
+        if (value >= end || *value == ']') {
+            return NULL;
+        }
+        if ((p = scan_value(value, end)) == NULL || p == value) {
+            return NULL;
+        }
+        if (n == i) {
+            *value_end = p;
+            return value;
+        }
+        p = scan_ws(p, end);
+        if (p >= end || *p++ != ',') {
+            return NULL;
+        }
+    }
+}
+
+const char *scan_member(const char *p, const char *end, const char *key, const char **value_end) {
+    size_t key_len = strlen(key);
+    p = scan_ws(p, end);
+    if (p >= end || *p++ != '{') {
+        return NULL;
+    }
+    while ((p = scan_ws(p, end)) < end && *p == '"') {
+        const char *k = p + 1;
+        if ((p = scan_string(p, end)) == NULL) {
+            return NULL;
+        }
+        bool match = (size_t)(p - k - 1) == key_len && memcmp(k, key, key_len) == 0;
+        p = scan_ws(p, end);
+        if (p >= end || *p != ':') {
+            return NULL;
+        }
+        const char *value = scan_ws(p + 1, end);
+        if ((p = scan_value(value, end)) == NULL || p == value) {
+            return NULL;
+        }
+        if (match) {
+            *value_end = p;
+            return value;
+        }
+        p = scan_ws(p, end);
+        if (p >= end || *p != ',') {
+            return NULL;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+const char *scan_string(const char *p, const char *end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+const char *scan_unescape(const char *p, const char *end, char **buf, size_t *cap) {
+    const char *s = NULL;
+    char *d = NULL;
+    p = scan_ws(p, end);
+    if (p >= end || *p != '"' || (s = scan_string(p, end)) == NULL) {
+        return NULL;
+    }
+    end = s - 1;
+    p++;
+    // Decoding never makes a string longer.
+    if (*buf == NULL || *cap < (size_t)(end - p) + 1) {
+        size_t n = (size_t)(end - p) + 1 < 256 ? 256 : (size_t)(end - p) + 1;
+        char *b = realloc(*buf, n);
+        if (b == NULL) {
+            fprintf(stderr, "Error allocating %zu bytes for string\n", n);
+            return NULL;
+        }
+        *buf = b;
+        *cap = n;
+    }
+    d = *buf;
+    while (p < end) {
+        const char *bs = memchr(p, '\\', end - p);
+        size_t n = (bs != NULL ? bs : end) - p;
+        memcpy(d, p, n);
+        d += n;
+        p += n;
+        if (p >= end) {
+            break;
+        }
+        if (end - p < 2) {
+            return NULL;
+        }
+        switch (p[1]) {
+            case 'b': *d++ = '\b'; break;
+            case 'f': *d++ = '\f'; break;
+            case 'n': *d++ = '\n'; break;
+            case 'r': *d++ = '\r'; break;
+            case 't': *d++ = '\t'; break;
+            case 'u': {
+                int c = hex4(p + 2, end);
+                if (c < 0) {
+                    return NULL;
+                }
+                p += 4;
+                if (c >= 0xd800 && c < 0xdc00 && end - p >= 8 && p[2] == '\\' && p[3] == 'u') {
+                    int lo = hex4(p + 4, end);
+                    if (lo >= 0xdc00 && lo < 0xe000) {
+                        c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                        p += 6;
+                    }
+                }
+                d = put_utf8(d, c);
+                break;
+            }
+            default: *d++ = p[1]; break;
+        }
+        p += 2;
+    }
+    *d = '\0';
+    return *buf;
+}
+
+const char *scan_value(const char *p, const char *end) {
+    int depth = 0;
+    p = scan_ws(p, end);
+    while (p < end) {
+        switch (*p) {
+            case '"':
+                p = scan_string(p, end);
+                if (p == NULL || depth == 0) {
+                    return p;
+                }
+                continue;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                if (depth == 0) {
+                    return p;
+                }
+                if (--depth == 0) {
+                    return p + 1;
+                }
+                break;
+            case ',':
+                if (depth == 0) {
+                    return p;
+                }
+                break;
+            default:
+                if (depth == 0 && isspace((unsigned char)*p)) {
+                    return p;
+                }
+                break;
+        }
+        p++;
+    }
+    return depth == 0 ? p : NULL;
+}
+
+const char *scan_ws(const char *p, const char *end) {
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+static int hex4(const char *p, const char *end) {
+    int c = 0;
+    if (end - p < 4) {
+        return -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        int h = p[i];
+        if (h >= '0' && h <= '9') {
+            h -= '0';
+        } else if (h >= 'a' && h <= 'f') {
+            h -= 'a' - 10;
+        } else if (h >= 'A' && h <= 'F') {
+            h -= 'A' - 10;
+        } else {
+            return -1;
+        }
+        c = (c << 4) | h;
+    }
+    return c;
+}
+
+static char *put_utf8(char *d, uint32_t c) {
+    if (c < 0x80) {
+        *d++ = c;
+    } else if (c < 0x800) {
+        *d++ = 0xc0 | (c >> 6);
+        *d++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+        *d++ = 0xe0 | (c >> 12);
+        *d++ = 0x80 | ((c >> 6) & 0x3f);
+        *d++ = 0x80 | (c & 0x3f);
+    } else {
+        *d++ = 0xf0 | (c >> 18);
+        *d++ = 0x80 | ((c >> 12) & 0x3f);
+        *d++ = 0x80 | ((c >> 6) & 0x3f);
+        *d++ = 0x80 | (c & 0x3f);
+    }
+    return d;
+}
@@ -0,0 +1,41 @@
+/**
+ * @file scan.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Scan JSON text without parsing it.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * Find values in JSON text in place, without building json-c objects. Each
+ * function takes a pointer into the text and a pointer to the end of it, and
+ * returns a pointer into the same text, or NULL if the text is malformed or
+ * the value isn't there. Nothing is allocated, except by scan_unescape(),
+ * which decodes a string into a buffer the caller keeps between calls.
+ *
+ * These are for hot paths that only need a few fields of a record, like the
+ * history index of a context file or streamed response records. Anything
+ * more involved should be parsed with json-c.
+ */
+
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** @brief Returns 1 if the value at p is true, 0 if it is false and -1 otherwise. */
+extern int scan_bool(const char *p, const char *end);
+/** @brief Find element i of the array at p. Sets value_end to the end of the element. */
+extern const char *scan_element(const char *p, const char *end, int i, const char **value_end);
+/** @brief Find the member named key of the object at p. Sets value_end to the end of its value. */
+extern const char *scan_member(const char *p, const char *end, const char *key, const char **value_end);
+/** @brief Skip the string at p, returning the character after the closing quote. */
+extern const char *scan_string(const char *p, const char *end);
+/** @brief Decode the string at p into buf, growing it as needed. Returns buf, NUL-terminated. */
+extern const char *scan_unescape(const char *p, const char *end, char **buf, size_t *cap);
+/** @brief Skip the value at p, returning the character after it. */
+extern const char *scan_value(const char *p, const char *end);
+/** @brief Skip whitespace. */
+extern const char *scan_ws(const char *p, const char *end);
+
+#endif // _SCAN_H
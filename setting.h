@@ -12,18 +12,27 @@
 
 /// Strings used as setting object keys
 #define SETTING_KEY_AI_PROVIDER             "ai-provider"
+#define SETTING_KEY_BATCH_CONCURRENCY       "batch-concurrency"
 #define SETTING_KEY_BUFFERED                "buffered"
+#define SETTING_KEY_COMPRESS                "compress"
 #define SETTING_KEY_CONTEXT_FILENAME        "context-filename"
 #define SETTING_KEY_DB_HOST                 "db-host"
 #define SETTING_KEY_DB_PROVIDER             "db-provider"
 #define SETTING_KEY_HELP                    "help"
 #define SETTING_KEY_AI_HOST                 "ai-host"
 #define SETTING_KEY_AI_MODEL                "ai-model"
+#define SETTING_KEY_FLUSH                   "flush"
 #define SETTING_KEY_FUNCTION_FILE           "function-file"
+#define SETTING_KEY_HEDGE                   "hedge"
+#define SETTING_KEY_HISTORY                 "history"
+#define SETTING_KEY_PIPE                    "pipe"
 #define SETTING_KEY_PROMPT                  "prompt"
 #define SETTING_KEY_SYSTEM_PROMPT           "system-prompt"
 #define SETTING_KEY_SYSTEM_PROMPT_PROMPT    "prompt"
 #define SETTING_KEY_SYSTEM_PROMPT_EXIT      "exit"
+#define SETTING_KEY_SUMMARY_TOKENS          "summary-tokens"
+#define SETTING_KEY_SUMMARY_TURNS           "summary-turns"
+#define SETTING_KEY_TOKENIZER               "tokenizer"
 #define SETTING_KEY_TOOLS                   "tools"
 
 #endif // _SETTING_H
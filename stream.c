@@ -0,0 +1,103 @@
+/**
+ * @file stream.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Split a streamed response into records.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chewie.h"
+#include "stream.h"
+
+/** @brief Field name of the server-sent event lines that carry data. */
+#define SSE_DATA                        "data:"
+
+static int emit(stream_t *stream, const char *line, size_t len, stream_record_func_t func, void *user_data);
+static int keep(stream_t *stream, const char *data, size_t len);
+
+int stream_feed(stream_t *stream, const char *data, size_t len, stream_record_func_t func, void *user_data) {
+    const char *end = data + len;
+    const char *eol = NULL;
+    int r = 0;
+    if (stream->len > 0) {
+        if ((eol = memchr(data, '\n', len)) == NULL) {
+            return keep(stream, data, len);
+        }
+        if (keep(stream, data, eol - data)) {
+            return 1;
+        }
+        size_t n = stream->len;
+        stream->len = 0;
+        if ((r = emit(stream, stream->buf, n, func, user_data)) != 0) {
+            return r;
+        }
+        data = eol + 1;
+    }
+    while (data < end && (eol = memchr(data, '\n', end - data)) != NULL) {
+        if ((r = emit(stream, data, eol - data, func, user_data)) != 0) {
+            return r;
+        }
+        data = eol + 1;
+    }
+    return data < end ? keep(stream, data, end - data) : 0;
+}
+
+int stream_finish(stream_t *stream, stream_record_func_t func, void *user_data) {
+    size_t len = stream->len;
+    stream->len = 0;
+    return len > 0 ? emit(stream, stream->buf, len, func, user_data) : 0;
+}
+
+void stream_free(stream_t *stream) {
+    free(stream->buf);
+    stream->buf = NULL;
+    stream->len = 0;
+    stream->cap = 0;
+}
+
+void stream_init(stream_t *stream, stream_format_t format) {
+    memset(stream, 0, sizeof(stream_t));
+    stream->format = format;
+}
+
+static int emit(stream_t *stream, const char *line, size_t len, stream_record_func_t func, void *user_data) {
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    if (stream->format == stream_format_sse) {
+        if (len < sizeof(SSE_DATA) - 1 || memcmp(line, SSE_DATA, sizeof(SSE_DATA) - 1) != 0) {
+            return 0;
+        }
+        line += sizeof(SSE_DATA) - 1;
+        len -= sizeof(SSE_DATA) - 1;
+        if (len > 0 && *line == ' ') {
+            line++;
+            len--;
+        }
+    }
+    return len > 0 ? func(line, len, user_data) : 0;
+}
+
+static int keep(stream_t *stream, const char *data, size_t len) {
+    if (stream->len + len > stream->cap) {
+        size_t cap = stream->cap == 0 ? 4096 : stream->cap;
+        while (cap < stream->len + len) {
+            cap *= 2;
+        }
+        char *b = realloc(stream->buf, cap);
+        if (b == NULL) {
+            fprintf(stderr, "Error allocating %zu bytes for response stream\n", cap);
+            return 1;
+        }
+        stream->buf = b;
+        stream->cap = cap;
+    }
+    memcpy(stream->buf + stream->len, data, len);
+    stream->len += len;
+    return 0;
+}
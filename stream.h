@@ -0,0 +1,56 @@
+/**
+ * @file stream.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Split a streamed response into records.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * Streamed responses arrive in chunks that don't line up with the records in
+ * them: a chunk can hold several records, or end in the middle of one. A
+ * stream_t takes the chunks as they come and hands each complete record to a
+ * callback. Two framings are understood:
+ *
+ * stream_format_ndjson: one JSON record per line, as sent by ollama.
+ *
+ * stream_format_sse: server-sent events, as sent by OpenAI. The callback gets
+ * the payload of each "data:" line; comments and other fields are skipped.
+ *
+ * Records that are entirely within a chunk are passed to the callback in
+ * place. Only the part of a record that is cut off at the end of a chunk is
+ * copied, into a buffer that is kept for the next chunk, so once that buffer
+ * has grown to the longest record nothing more is allocated.
+ */
+
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stddef.h>
+
+/** @brief Record framing of a stream. */
+typedef enum stream_format_t {
+    stream_format_ndjson,
+    stream_format_sse
+} stream_format_t;
+
+/** @brief Called for each record. A non-zero return stops the stream. */
+typedef int (*stream_record_func_t)(const char *record, size_t len, void *user_data);
+
+/** @brief State of a stream between chunks. */
+typedef struct stream_t {
+    stream_format_t format;
+    char *buf;
+    size_t len;
+    size_t cap;
+} stream_t;
+
+/** @brief Pass the complete records in the next chunk of the stream to func. */
+extern int stream_feed(stream_t *stream, const char *data, size_t len, stream_record_func_t func, void *user_data);
+/** @brief Pass a final record that wasn't terminated by a newline to func. */
+extern int stream_finish(stream_t *stream, stream_record_func_t func, void *user_data);
+/** @brief Release the stream's buffer. */
+extern void stream_free(stream_t *stream);
+/** @brief Set up a stream with the given framing. */
+extern void stream_init(stream_t *stream, stream_format_t format);
+
+#endif // _STREAM_H
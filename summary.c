@@ -0,0 +1,127 @@
+/**
+ * @file summary.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Fold old history entries into a rolling summary.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <json-c/json_object.h>
+
+#include "chewie.h"
+#include "api.h"
+#include "context.h"
+#include "setting.h"
+#include "summary.h"
+
+static const char summary_system_prompt[] =
+    "You maintain a running summary of a conversation between a user and an AI "
+    "assistant. Merge the earlier summary, if any, with the conversation that "
+    "follows it into one concise summary. Keep names, facts, decisions, code "
+    "and open questions that later messages may refer to. Reply with the "
+    "summary only.";
+static const char summary_previous[] = "Earlier summary:\n%s\n\n";
+static const char summary_conversation[] = "Conversation:\n";
+
+static int get_summary_end(json_object *settings, int start, int count);
+static int get_threshold(json_object *settings, const char *key);
+
+int summary_update(json_object *settings) {
+    debug_enter();
+    const char *summary = context_get_summary();
+    char *transcript = NULL;
+    char *prompt = NULL;
+    char *response = NULL;
+    int start = context_get_summary_end();
+    int end = get_summary_end(settings, start, context_get_history_length());
+    int result = 1;
+    if (end <= start) {
+        debug_return 0;
+    }
+    if (api_interface == NULL || api_interface->complete == NULL) {
+        debug("AI provider can't summarize\n");
+        debug_return 0;
+    }
+    debug("summarizing history entries %d to %d\n", start, end - 1);
+    transcript = context_get_transcript(start, end);
+    if (transcript == NULL) {
+        goto term;
+    }
+    size_t l = sizeof(summary_previous) + sizeof(summary_conversation) + strlen(transcript);
+    if (summary != NULL) {
+        l += strlen(summary);
+    }
+    prompt = malloc(l);
+    if (prompt == NULL) {
+        fprintf(stderr, "Error allocating memory for summary prompt\n");
+        goto term;
+    }
+    char *p = prompt;
+    if (summary != NULL) {
+        p += sprintf(p, summary_previous, summary);
+    }
+    sprintf(p, "%s%s", summary_conversation, transcript);
+    response = api_interface->complete(settings, summary_system_prompt, prompt);
+    if (response == NULL) {
+        fprintf(stderr, "Error summarizing context history\n");
+        goto term;
+    }
+    if (context_set_summary(response, end)) {
+        fprintf(stderr, "Error storing context summary\n");
+        goto term;
+    }
+    context_update();
+    result = 0;
+term:
+    free(transcript);
+    free(prompt);
+    free(response);
+    debug_return result;
+}
+
+static int get_summary_end(json_object *settings, int start, int count) {
+    debug_enter();
+    int turns = get_threshold(settings, SETTING_KEY_SUMMARY_TURNS);
+    int tokens = get_threshold(settings, SETTING_KEY_SUMMARY_TOKENS);
+    int end = start;
+    if (turns > 0 && count - start > turns) {
+        int keep = turns / 2 > 0 ? turns / 2 : 1;
+        end = count - keep;
+    }
+    if (tokens > 0) {
+        int total = 0;
+        for (int i = start; i < count; i++) {
+            total += context_get_history_tokens(i);
+        }
+        if (total > tokens) {
+            int kept = 0;
+            int i = count;
+            while (i > start + 1) {
+                int t = context_get_history_tokens(i - 1);
+                if (i < count && kept + t > tokens / 2) {
+                    break;
+                }
+                kept += t;
+                i--;
+            }
+            if (i > end) {
+                end = i;
+            }
+        }
+    }
+    debug_return end;
+}
+
+static int get_threshold(json_object *settings, const char *key) {
+    debug_enter();
+    json_object *value = NULL;
+    if (json_object_object_get_ex(settings, key, &value) && value != NULL) {
+        debug_return json_object_get_int(value);
+    }
+    debug_return 0;
+}
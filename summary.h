@@ -0,0 +1,24 @@
+/**
+ * @file summary.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Fold old history entries into a rolling summary.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * Once the history that isn't covered by the context summary grows past the
+ * "summary-turns" or "summary-tokens" setting, the oldest of those entries
+ * are sent to the AI provider along with the current summary, and the
+ * response becomes the new summary. The newest half of the allowance is kept
+ * as it is. The summarized entries stay in the context file as an archive.
+ */
+
+#ifndef _SUMMARY_H
+#define _SUMMARY_H
+
+#include <json-c/json_object.h>
+
+/** @brief Summarize the oldest history entries if the settings call for it. */
+extern int summary_update(json_object *settings);
+
+#endif // _SUMMARY_H
@@ -0,0 +1,687 @@
+/**
+ * @file tokenizer.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Count tokens locally.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chewie.h"
+#include "file.h"
+#include "tokenizer.h"
+
+/** @brief SentencePiece replaces spaces with this character (U+2581). */
+#define SPACE_PIECE                     "\xe2\x96\x81"
+#define SPACE_PIECE_LEN                 (sizeof(SPACE_PIECE) - 1)
+/** @brief SentencePiece piece types. */
+#define PIECE_TYPE_NORMAL               1
+#define PIECE_TYPE_USER_DEFINED         4
+#define PIECE_TYPE_BYTE                 6
+/** @brief Longest token accepted from a BPE rank file. */
+#define MAX_TOKEN_LEN                   1024
+
+/** @brief Kinds of vocabulary. */
+typedef enum tokenizer_type_t {
+    tokenizer_type_none,
+    tokenizer_type_bpe,
+    tokenizer_type_sentencepiece
+} tokenizer_type_t;
+
+/**
+ * @brief Edge of the token trie. Edges are kept in an open-addressed hash
+ * table keyed by the parent node and the byte, so a node costs no more than
+ * its rank no matter how many children it has. A child of 0 marks an empty
+ * slot; the root is node 0 and is never anyone's child.
+ */
+typedef struct trie_edge_t {
+    uint32_t key;
+    uint32_t child;
+} trie_edge_t;
+
+static char *vocab_fn = NULL;
+static bool load_attempted = false;
+static tokenizer_type_t type = tokenizer_type_none;
+static int32_t *node_rank = NULL;
+static uint32_t node_count = 0;
+static uint32_t node_cap = 0;
+static trie_edge_t *edges = NULL;
+static uint32_t edge_count = 0;
+static uint32_t edge_mask = 0;
+static bool byte_fallback = false;
+static uint32_t *bounds = NULL;
+static int32_t *pair_rank = NULL;
+static size_t scratch_cap = 0;
+static char *sp_text = NULL;
+static size_t sp_text_cap = 0;
+
+static int add_edge(uint32_t node, unsigned char b, uint32_t child);
+static int add_piece(const char *piece, size_t len, int piece_type, int32_t id);
+static int base64_decode(const char *s, size_t len, unsigned char *out, size_t out_size);
+static int count_bpe(const unsigned char *s, size_t len);
+static int count_piece(const unsigned char *s, size_t len, bool chars);
+static int count_sentencepiece(const char *s);
+static int ensure_scratch(size_t n);
+static int estimate(const char *s);
+static uint32_t hash(uint32_t key);
+static bool is_digit(unsigned char c);
+static bool is_letter(unsigned char c);
+static bool is_space(unsigned char c);
+static int load(const char *fn);
+static int load_bpe(const char *map, size_t size);
+static int load_sentencepiece_model(const char *map, size_t size);
+static int load_sentencepiece_vocab(const char *map, size_t size);
+static uint32_t new_node(void);
+static size_t next_piece(const unsigned char *s, size_t len);
+static int read_varint(const unsigned char **p, const unsigned char *end, uint64_t *value);
+static int skip_field(const unsigned char **p, const unsigned char *end, int wire_type);
+static uint32_t trie_child(uint32_t node, unsigned char b);
+static int trie_insert(const unsigned char *s, size_t len, int32_t rank);
+static int32_t trie_rank(const unsigned char *s, size_t len);
+static size_t utf8_len(unsigned char c);
+
+int tokenizer_count(const char *s) {
+    debug_enter();
+    if (s == NULL) {
+        debug_return 0;
+    }
+    if (!load_attempted) {
+        load_attempted = true;
+        if (vocab_fn != NULL && load(vocab_fn)) {
+            fprintf(stderr, "Error loading tokenizer vocabulary \"%s\", estimating token counts\n", vocab_fn);
+            tokenizer_free();
+            load_attempted = true;
+        }
+    }
+    switch (type) {
+        case tokenizer_type_bpe:
+            debug_return count_bpe((const unsigned char *)s, strlen(s));
+        case tokenizer_type_sentencepiece:
+            debug_return count_sentencepiece(s);
+        default:
+            debug_return estimate(s);
+    }
+}
+
+void tokenizer_free(void) {
+    debug_enter();
+    free(node_rank);
+    node_rank = NULL;
+    node_count = 0;
+    node_cap = 0;
+    free(edges);
+    edges = NULL;
+    edge_count = 0;
+    edge_mask = 0;
+    free(bounds);
+    bounds = NULL;
+    free(pair_rank);
+    pair_rank = NULL;
+    scratch_cap = 0;
+    free(sp_text);
+    sp_text = NULL;
+    sp_text_cap = 0;
+    byte_fallback = false;
+    type = tokenizer_type_none;
+    load_attempted = false;
+    debug_return;
+}
+
+bool tokenizer_is_exact(void) {
+    debug_enter();
+    if (!load_attempted) {
+        tokenizer_count("");
+    }
+    debug_return type != tokenizer_type_none;
+}
+
+void tokenizer_set_file(const char *fn) {
+    debug_enter();
+    tokenizer_free();
+    free(vocab_fn);
+    vocab_fn = fn != NULL ? strdup(fn) : NULL;
+    debug_return;
+}
+
+static int add_edge(uint32_t node, unsigned char b, uint32_t child) {
+    uint32_t key = node << 8 | b;
+    if ((edge_count + 1) * 2 > edge_mask + 1) {
+        uint32_t cap = edge_mask == 0 ? 1 << 16 : (edge_mask + 1) * 2;
+        trie_edge_t *e = calloc(cap, sizeof(trie_edge_t));
+        if (e == NULL) {
+            fprintf(stderr, "Error allocating memory for tokenizer vocabulary\n");
+            return 1;
+        }
+        for (uint32_t i = 0; edges != NULL && i <= edge_mask; i++) {
+            if (edges[i].child != 0) {
+                uint32_t j = hash(edges[i].key) & (cap - 1);
+                while (e[j].child != 0) {
+                    j = (j + 1) & (cap - 1);
+                }
+                e[j] = edges[i];
+            }
+        }
+        free(edges);
+        edges = e;
+        edge_mask = cap - 1;
+    }
+    uint32_t i = hash(key) & edge_mask;
+    while (edges[i].child != 0) {
+        i = (i + 1) & edge_mask;
+    }
+    edges[i].key = key;
+    edges[i].child = child;
+    edge_count++;
+    return 0;
+}
+
+static int add_piece(const char *piece, size_t len, int piece_type, int32_t id) {
+    unsigned int b = 0;
+    if (len == 6 && memcmp(piece, "<0x", 3) == 0 && piece[5] == '>' && sscanf(piece + 3, "%2x", &b) == 1) {
+        byte_fallback = true;
+        return 0;
+    }
+    if (piece_type == PIECE_TYPE_BYTE) {
+        byte_fallback = true;
+        return 0;
+    }
+    if (piece_type != PIECE_TYPE_NORMAL && piece_type != PIECE_TYPE_USER_DEFINED) {
+        return 0;
+    }
+    return trie_insert((const unsigned char *)piece, len, id);
+}
+
+static int base64_decode(const char *s, size_t len, unsigned char *out, size_t out_size) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len && s[i] != '='; i++) {
+        char c = s[i];
+        int v;
+        if (c >= 'A' && c <= 'Z') {
+            v = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            v = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            v = c - '0' + 52;
+        } else if (c == '+') {
+            v = 62;
+        } else if (c == '/') {
+            v = 63;
+        } else {
+            return -1;
+        }
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == out_size) {
+                return -1;
+            }
+            out[n++] = acc >> bits & 0xff;
+        }
+    }
+    return n;
+}
+
+static int count_bpe(const unsigned char *s, size_t len) {
+    debug_enter();
+    int count = 0;
+    while (len > 0) {
+        size_t l = next_piece(s, len);
+        count += count_piece(s, l, false);
+        s += l;
+        len -= l;
+    }
+    debug_return count;
+}
+
+static int count_piece(const unsigned char *s, size_t len, bool chars) {
+    uint32_t n = 0;
+    int count = 0;
+    if (len == 0) {
+        return 0;
+    }
+    if (trie_rank(s, len) >= 0) {
+        return 1;
+    }
+    if (ensure_scratch(len + 1)) {
+        return (len + 3) / 4;
+    }
+    for (size_t i = 0; i < len; i += chars ? utf8_len(s[i]) : 1) {
+        bounds[n++] = i;
+    }
+    bounds[n] = len;
+    for (uint32_t i = 0; i + 1 < n; i++) {
+        pair_rank[i] = trie_rank(s + bounds[i], bounds[i + 2] - bounds[i]);
+    }
+    while (n > 1) {
+        int32_t best = -1;
+        for (uint32_t i = 0; i + 1 < n; i++) {
+            if (pair_rank[i] >= 0 && (best < 0 || pair_rank[i] < pair_rank[best])) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        memmove(&bounds[best + 1], &bounds[best + 2], (n - best - 1) * sizeof(uint32_t));
+        if (best + 2 < (int32_t)n - 1) {
+            memmove(&pair_rank[best + 1], &pair_rank[best + 2], (n - best - 3) * sizeof(int32_t));
+        }
+        n--;
+        if (best > 0) {
+            pair_rank[best - 1] = trie_rank(s + bounds[best - 1], bounds[best + 1] - bounds[best - 1]);
+        }
+        if (best + 1 < (int32_t)n) {
+            pair_rank[best] = trie_rank(s + bounds[best], bounds[best + 2] - bounds[best]);
+        }
+    }
+    if (!chars) {
+        return n;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        size_t l = bounds[i + 1] - bounds[i];
+        if (trie_rank(s + bounds[i], l) >= 0 || !byte_fallback) {
+            count++;
+        } else {
+            count += l;
+        }
+    }
+    return count;
+}
+
+static int count_sentencepiece(const char *s) {
+    debug_enter();
+    size_t len = SPACE_PIECE_LEN;
+    size_t n = 0;
+    size_t start = 0;
+    int count = 0;
+    for (const char *p = s; *p != '\0'; p++) {
+        len += *p == ' ' ? SPACE_PIECE_LEN : 1;
+    }
+    if (len > sp_text_cap) {
+        char *t = realloc(sp_text, len);
+        if (t == NULL) {
+            fprintf(stderr, "Error allocating memory for tokenizer\n");
+            debug_return estimate(s);
+        }
+        sp_text = t;
+        sp_text_cap = len;
+    }
+    memcpy(sp_text, SPACE_PIECE, SPACE_PIECE_LEN);
+    n = SPACE_PIECE_LEN;
+    for (const char *p = s; *p != '\0'; p++) {
+        if (*p == ' ') {
+            memcpy(sp_text + n, SPACE_PIECE, SPACE_PIECE_LEN);
+            n += SPACE_PIECE_LEN;
+        } else {
+            sp_text[n++] = *p;
+        }
+    }
+    for (size_t i = SPACE_PIECE_LEN; i <= n; i++) {
+        if (i == n || (i + SPACE_PIECE_LEN <= n && memcmp(sp_text + i, SPACE_PIECE, SPACE_PIECE_LEN) == 0 &&
+            memcmp(sp_text + i - SPACE_PIECE_LEN, SPACE_PIECE, SPACE_PIECE_LEN) != 0)) {
+            count += count_piece((const unsigned char *)sp_text + start, i - start, true);
+            start = i;
+        }
+    }
+    debug_return count;
+}
+
+static int ensure_scratch(size_t n) {
+    if (n <= scratch_cap) {
+        return 0;
+    }
+    size_t cap = scratch_cap == 0 ? 256 : scratch_cap;
+    while (cap < n) {
+        cap *= 2;
+    }
+    uint32_t *b = realloc(bounds, cap * sizeof(uint32_t));
+    if (b == NULL) {
+        fprintf(stderr, "Error allocating memory for tokenizer\n");
+        return 1;
+    }
+    bounds = b;
+    int32_t *r = realloc(pair_rank, cap * sizeof(int32_t));
+    if (r == NULL) {
+        fprintf(stderr, "Error allocating memory for tokenizer\n");
+        return 1;
+    }
+    pair_rank = r;
+    scratch_cap = cap;
+    return 0;
+}
+
+static int estimate(const char *s) {
+    return (strlen(s) + 3) / 4;
+}
+
+static uint32_t hash(uint32_t key) {
+    return key * 2654435761u;
+}
+
+static bool is_digit(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_letter(unsigned char c) {
+    return isalpha(c) || c >= 0x80;
+}
+
+static bool is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static int load(const char *fn) {
+    debug_enter();
+    size_t size = 0;
+    int result = 1;
+    const char *map = file_map(fn, &size);
+    const char *eol = NULL;
+    if (map == NULL) {
+        debug_return 1;
+    }
+    if (new_node() != 0) {
+        goto term;
+    }
+    eol = memchr(map, '\n', size);
+    if ((unsigned char)map[0] == 0x0a) {
+        debug("loading SentencePiece model \"%s\"\n", fn);
+        result = load_sentencepiece_model(map, size);
+        type = tokenizer_type_sentencepiece;
+    } else if (memchr(map, '\t', eol != NULL ? (size_t)(eol - map) : size) != NULL) {
+        debug("loading SentencePiece vocabulary \"%s\"\n", fn);
+        result = load_sentencepiece_vocab(map, size);
+        type = tokenizer_type_sentencepiece;
+    } else {
+        debug("loading BPE ranks \"%s\"\n", fn);
+        result = load_bpe(map, size);
+        type = tokenizer_type_bpe;
+    }
+    debug("tokenizer trie has %u nodes\n", node_count);
+term:
+    file_unmap(map, size);
+    debug_return result;
+}
+
+static int load_bpe(const char *map, size_t size) {
+    debug_enter();
+    unsigned char token[MAX_TOKEN_LEN];
+    const char *end = map + size;
+    const char *eol = NULL;
+    for (const char *p = map; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char *sp = memchr(p, ' ', eol - p);
+        if (sp == NULL) {
+            continue;
+        }
+        int len = base64_decode(p, sp - p, token, sizeof(token));
+        int32_t rank = 0;
+        const char *q = sp + 1;
+        if (len <= 0 || q == eol) {
+            fprintf(stderr, "Error parsing BPE rank \"%.*s\"\n", (int)(eol - p), p);
+            debug_return 1;
+        }
+        for (; q < eol && is_digit(*q); q++) {
+            rank = rank * 10 + (*q - '0');
+        }
+        if (trie_insert(token, len, rank)) {
+            debug_return 1;
+        }
+    }
+    debug_return 0;
+}
+
+static int load_sentencepiece_model(const char *map, size_t size) {
+    debug_enter();
+    const unsigned char *p = (const unsigned char *)map;
+    const unsigned char *end = p + size;
+    int32_t id = 0;
+    while (p < end) {
+        uint64_t tag = 0;
+        uint64_t len = 0;
+        if (read_varint(&p, end, &tag)) {
+            goto err;
+        }
+        if (tag != (1 << 3 | 2)) {
+            if (skip_field(&p, end, tag & 7)) {
+                goto err;
+            }
+            continue;
+        }
+        if (read_varint(&p, end, &len) || len > (uint64_t)(end - p)) {
+            goto err;
+        }
+        const unsigned char *q = p;
+        const unsigned char *piece_end = p + len;
+        const char *piece = NULL;
+        uint64_t piece_len = 0;
+        uint64_t piece_type = PIECE_TYPE_NORMAL;
+        p = piece_end;
+        while (q < piece_end) {
+            uint64_t field_tag = 0;
+            if (read_varint(&q, piece_end, &field_tag)) {
+                goto err;
+            }
+            if (field_tag == (1 << 3 | 2)) {
+                if (read_varint(&q, piece_end, &piece_len) || piece_len > (uint64_t)(piece_end - q)) {
+                    goto err;
+                }
+                piece = (const char *)q;
+                q += piece_len;
+            } else if (field_tag == (3 << 3 | 0)) {
+                if (read_varint(&q, piece_end, &piece_type)) {
+                    goto err;
+                }
+            } else if (skip_field(&q, piece_end, field_tag & 7)) {
+                goto err;
+            }
+        }
+        if (piece != NULL && add_piece(piece, piece_len, piece_type, id)) {
+            debug_return 1;
+        }
+        id++;
+    }
+    debug_return 0;
+err:
+    fprintf(stderr, "Error parsing SentencePiece model\n");
+    debug_return 1;
+}
+
+static int load_sentencepiece_vocab(const char *map, size_t size) {
+    debug_enter();
+    const char *end = map + size;
+    const char *eol = NULL;
+    int32_t id = 0;
+    for (const char *p = map; p < end; p = eol + 1, id++) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char *tab = memchr(p, '\t', eol - p);
+        size_t len = (tab != NULL ? tab : eol) - p;
+        int piece_type = PIECE_TYPE_NORMAL;
+        if ((len == 5 && memcmp(p, "<unk>", 5) == 0) || (len == 3 && memcmp(p, "<s>", 3) == 0) || (len == 4 && memcmp(p, "</s>", 4) == 0)) {
+            piece_type = 0;
+        }
+        if (len > 0 && add_piece(p, len, piece_type, id)) {
+            debug_return 1;
+        }
+    }
+    debug_return 0;
+}
+
+static uint32_t new_node(void) {
+    if (node_count == node_cap) {
+        uint32_t cap = node_cap == 0 ? 1 << 16 : node_cap * 2;
+        int32_t *r = realloc(node_rank, cap * sizeof(int32_t));
+        if (r == NULL) {
+            fprintf(stderr, "Error allocating memory for tokenizer vocabulary\n");
+            return UINT32_MAX;
+        }
+        node_rank = r;
+        node_cap = cap;
+    }
+    node_rank[node_count] = -1;
+    return node_count++;
+}
+
+static size_t next_piece(const unsigned char *s, size_t len) {
+    unsigned char c = s[0];
+    size_t i = 0;
+    if (c == '\'' && len > 1) {
+        unsigned char c1 = tolower(s[1]);
+        unsigned char c2 = len > 2 ? tolower(s[2]) : 0;
+        if ((c1 == 'l' && c2 == 'l') || (c1 == 'v' && c2 == 'e') || (c1 == 'r' && c2 == 'e')) {
+            return 3;
+        }
+        if (c1 == 's' || c1 == 'd' || c1 == 'm' || c1 == 't') {
+            return 2;
+        }
+    }
+    if (is_letter(c) || (len > 1 && c != '\r' && c != '\n' && !is_digit(c) && is_letter(s[1]))) {
+        i = is_letter(c) ? 0 : 1;
+        while (i < len && is_letter(s[i])) {
+            i++;
+        }
+        return i;
+    }
+    if (is_digit(c)) {
+        while (i < len && i < 3 && is_digit(s[i])) {
+            i++;
+        }
+        return i;
+    }
+    if (!is_space(c) || (c == ' ' && len > 1 && !is_space(s[1]))) {
+        i = c == ' ' ? 1 : 0;
+        while (i < len && !is_space(s[i]) && !is_letter(s[i]) && !is_digit(s[i])) {
+            i++;
+        }
+        while (i < len && (s[i] == '\r' || s[i] == '\n')) {
+            i++;
+        }
+        return i;
+    }
+    size_t last_newline = 0;
+    while (i < len && is_space(s[i])) {
+        i++;
+        if (s[i - 1] == '\r' || s[i - 1] == '\n') {
+            last_newline = i;
+        }
+    }
+    if (last_newline > 0) {
+        return last_newline;
+    }
+    if (i < len && i > 1) {
+        return i - 1;
+    }
+    return i;
+}
+
+static int read_varint(const unsigned char **p, const unsigned char *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        *value |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int skip_field(const unsigned char **p, const unsigned char *end, int wire_type) {
+    uint64_t v = 0;
+    switch (wire_type) {
+        case 0:
+            return read_varint(p, end, &v);
+        case 1:
+            v = 8;
+            break;
+        case 2:
+            if (read_varint(p, end, &v)) {
+                return 1;
+            }
+            break;
+        case 5:
+            v = 4;
+            break;
+        default:
+            return 1;
+    }
+    if (v > (uint64_t)(end - *p)) {
+        return 1;
+    }
+    *p += v;
+    return 0;
+}
+
+static uint32_t trie_child(uint32_t node, unsigned char b) {
+    uint32_t key = node << 8 | b;
+    if (edges == NULL) {
+        return 0;
+    }
+    for (uint32_t i = hash(key) & edge_mask; edges[i].child != 0; i = (i + 1) & edge_mask) {
+        if (edges[i].key == key) {
+            return edges[i].child;
+        }
+    }
+    return 0;
+}
+
+static int trie_insert(const unsigned char *s, size_t len, int32_t rank) {
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint32_t child = trie_child(node, s[i]);
+        if (child == 0) {
+            if ((child = new_node()) == UINT32_MAX) {
+                return 1;
+            }
+            if (child > 0xffffff) {
+                fprintf(stderr, "Tokenizer vocabulary is too large\n");
+                return 1;
+            }
+            if (add_edge(node, s[i], child)) {
+                return 1;
+            }
+        }
+        node = child;
+    }
+    if (node_rank[node] < 0 || rank < node_rank[node]) {
+        node_rank[node] = rank;
+    }
+    return 0;
+}
+
+static int32_t trie_rank(const unsigned char *s, size_t len) {
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        if ((node = trie_child(node, s[i])) == 0) {
+            return -1;
+        }
+    }
+    return node_rank[node];
+}
+
+static size_t utf8_len(unsigned char c) {
+    if (c >= 0xf0) {
+        return 4;
+    }
+    if (c >= 0xe0) {
+        return 3;
+    }
+    if (c >= 0xc0) {
+        return 2;
+    }
+    return 1;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file tokenizer.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Count tokens locally.
+ * @version 0.1.0
+ * @date 2024-04-27
+ * @copyright Copyright (c) 2024
+ * @details
+ * Count the tokens in a string without asking the AI provider. Two kinds of
+ * vocabulary files are understood:
+ *
+ * BPE rank files, as used by tiktoken (cl100k_base.tiktoken,
+ * o200k_base.tiktoken, etc.). Each line holds a base64-encoded token and its
+ * rank. Text is split into pieces the way those encodings do it, then each
+ * piece is merged byte pair by byte pair, lowest rank first.
+ *
+ * SentencePiece vocabularies, as shipped with llama models, either as the
+ * binary tokenizer.model file or as a text .vocab file with one tab-separated
+ * piece and score per line. Spaces become "\xe2\x96\x81", characters are
+ * merged by piece id, and anything left over falls back to byte tokens.
+ *
+ * All tokens are kept in a byte trie, so looking up the rank of a candidate
+ * merge walks the bytes of the merge once and allocates nothing. The
+ * vocabulary file is only loaded the first time tokens are counted. If no
+ * vocabulary file is set, or it can't be loaded, token counts are estimated
+ * from the length of the string.
+ */
+
+#ifndef _TOKENIZER_H
+#define _TOKENIZER_H
+
+#include <stdbool.h>
+
+/** @brief Count the tokens in the given string. */
+extern int tokenizer_count(const char *s);
+/** @brief Release the loaded vocabulary. */
+extern void tokenizer_free(void);
+/** @brief Returns true if token counts come from a vocabulary file rather than an estimate. */
+extern bool tokenizer_is_exact(void);
+/** @brief Set the vocabulary file to load the first time tokens are counted. */
+extern void tokenizer_set_file(const char *fn);
+
+#endif // _TOKENIZER_H